@@ -65,31 +65,53 @@ Code written by Chris Lomont, 2015
  
  *         kseg0_program_mem     (rx)  : ORIGIN = 0x9D000000, LENGTH = 0x1F000
  *
- *     Subtract 0x1800 from the LENGTH, add it to the ORIGIN, and insert
+ *     Subtract 0x3000 from the LENGTH, add it to the ORIGIN, and insert
  *     another entry like so. This split the memory section into two. Depending
- *     on compiler options, you may have to increase this 0x1800 as needed.
+ *     on compiler options, you may have to increase this 0x3000 as needed. The
+ *     options defined below as shipped fit; turning on all the commented out
+ *     ones needs about 0x4800, so check the .hcbcode size in the map file
+ *     after changing them.
  *
- *         hypnocube_bootcode    (rx)  : ORIGIN = 0x9D000000, LENGTH = 0x1800
+ *     Earlier versions used 0x1800 here. An application linked for 0x1800
+ *     starts inside this bootloader, which refuses to write those pages, so
+ *     relink the application with the new script and load the new bootloader
+ *     with a programmer before flashing it. Both must agree on this size.
+ *
+ *         hypnocube_bootcode    (rx)  : ORIGIN = 0x9D000000, LENGTH = 0x3000
  *         kseg0_program_mem     (rx)  : ORIGIN = 0x9D000000 + LENGTH(hypnocube_bootcode),
  *                                       LENGTH = 0x1F000 - LENGTH(hypnocube_bootcode)
  *
- *     Also reserve one word in RAM by similarly splitting the line
+ *     Also reserve two words in RAM by similarly splitting the line
  *
  *         kseg1_data_mem       (w!x)  : ORIGIN = 0xA0000000, LENGTH = 0x8000
  *
  *     into two
  *
- *         hypnocube_bootram    (w!x)  : ORIGIN = 0xA0000000, LENGTH = 0x4
+ *         hypnocube_bootram    (w!x)  : ORIGIN = 0xA0000000, LENGTH = 0x8
  *         kseg1_data_mem       (w!x)  : ORIGIN = 0xA0000000 + LENGTH(hypnocube_bootram),
  *                                       LENGTH = 0x8000-LENGTH(hypnocube_bootram)
  *
- *     These two changes made room in flash and ram for our uses. Right after 
+ *     With USE_JOURNAL defined, also keep the application out of the last
+ *     program flash page, JOURNAL_START, by splitting the line
+ *
+ *         exception_mem               : ORIGIN = 0x9D01F000, LENGTH = 0x1000
+ *
+ *     into two
+ *
+ *         exception_mem               : ORIGIN = 0x9D01F000, LENGTH = 0xC00
+ *         hypnocube_journal           : ORIGIN = 0x9D01FC00, LENGTH = 0x400
+ *
+ *     The application exception vectors still fit below it. The flasher
+ *     drops any hex data in that page, since the bootloader refuses it.
+ *
+ *     These changes made room in flash and ram for our uses. Right after 
  *     the closing brace in the memory section, add this line
  * 
  *         _HCBOOT_LD_SIZE_ = LENGTH(hypnocube_bootcode);
+ *         _HCBOOT_RAM_LD_SIZE_ = LENGTH(hypnocube_bootram);
  *
- *     which defines a symbol used in the code to determine the bootloader 
- *     code area to protect.
+ *     which define symbols used in the code to determine the bootloader 
+ *     code area to protect, and to check the RAM reserved.
  * 
  *     Now we have to tell the linker what to put in these locations using
  *     SECTIONs. So, before the .text: section definition, add these sections 
@@ -112,7 +134,7 @@ Code written by Chris Lomont, 2015
  *          . = ALIGN(4) ;
  *        } >hypnocube_bootram
  *
- *     Now the bootloader code and single variable will be located correctly.
+ *     Now the bootloader code and variables will be located correctly.
  *
  *
  *  3. To make the bootloader called on power up, you need to modify the C
@@ -163,7 +185,17 @@ Code written by Chris Lomont, 2015
  *     The size must be an integral number of flash pages. Check your page
  *     sizes.
  *
- *  6. Read the Notes section for more information.
+ *  6. With USE_FAST_BOOT defined, as shipped, a device that holds an
+ *     application only listens for a flasher at power on while its UART
+ *     receive line is low. The flasher must hold a break on the line while
+ *     the device powers up, then send ACK_OK, as PICFlasher does. Flashers
+ *     that only repeat ACK_OK, such as earlier PICFlasher versions sending it
+ *     every 100 ms, no longer connect to such a device. For them, comment out
+ *     USE_FAST_BOOT, or fit a FAST_BOOT_STRAP_PIN jumper and close it before
+ *     powering up. A device with a blank first application page still
+ *     listens for BOOT_WAIT_MS.
+ *
+ *  7. Read the Notes section for more information.
  *
  ******************************************************************************/
 
@@ -182,17 +214,98 @@ Code written by Chris Lomont, 2015
 
 // UART baud rate
 #define DESIRED_BAUDRATE 1000000   
+
+// define this to let the flasher switch to a faster baud rate after connecting
+#define USE_BAUD_CHANGE
+
+#ifdef USE_BAUD_CHANGE
+// ms to wait for the flasher to confirm a new baud rate before going back
+#define BAUD_CONFIRM_MS 500
+#endif
 // Define a UART (UART1, UART2, etc) to use. You must add code cases as needed
 #define HC_UART1
 // #define HC_UART2
 
+// define this to match the flasher baud rate while waiting for it to connect,
+// by timing the low pulse at the start of each ACK_OK sync byte. Timing is
+// by polling, which leaves little margin at 1 Mbaud, and each poll waits up
+// to 2 ms on the pin, so it is off unless flashers at other rates are needed.
+// Only rates from AUTOBAUD_MIN_BAUDRATE to DESIRED_BAUDRATE are taken. Faster
+// flashers should connect at a lower rate and use the 'R' command
+// #define USE_AUTOBAUD
+
+#ifdef USE_AUTOBAUD
+// the port pin the UART receive is mapped to in BootUARTInit
+#define AUTOBAUD_RX_PIN PORTAbits.RA4
+// slowest rate taken, slower timings are treated as noise
+#define AUTOBAUD_MIN_BAUDRATE 9600
+// sync bytes timed and averaged before setting the rate, to smooth polling jitter
+#define AUTOBAUD_SAMPLES 4
+#endif
+
+// bits of CRC32K processed per step, trading boot flash space for speed.
+// The CRC runs over every received packet and over flash for the 'C', 'M'
+// and 'P' commands. Table sizes and rough cycles per byte (estimates from the
+// instructions per step, not measured on hardware; define DEBUG_BOOTLOADER to
+// have the 'C' command report the real figure):
+//   1 : no table, one shift and xor per bit, about 40 cycles per byte
+//   2 : 16 byte table, about 20 cycles per byte
+//   4 : 64 byte table, about 10 cycles per byte
+//   8 : 1024 byte table, about 5 cycles per byte, needs a larger boot section
+#define CRC_BITS_PER_STEP 4
+
 // Number of milliseconds to look for flashing tool at boot. 
 #define BOOT_WAIT_MS 1000
 
+// define this to let the application reset into bootloader command mode by
+// calling BootloaderRequestEntry, for example on a flasher 'B' command. A magic
+// word after bootResult survives the software reset, and the bootloader then
+// skips the listen window, since the flasher is already waiting
+#define USE_HANDOFF
+
+// define this to skip the BOOT_WAIT_MS listen window at power on when no
+// flasher can be present, starting the application in tens of microseconds
+// instead of a second (30 us in the host model, not measured on hardware).
+// Flashers must hold a break to connect, see usage step 6. The bootloader
+// still listens when the UART receive
+// line is held low (the flasher sends a break while it waits for the device),
+// when the optional strap pin is low, or when the first application page is
+// blank. The flasher writes that page last, and a lazy erase clears it first,
+// so an interrupted flash also leaves the bootloader listening
+#define USE_FAST_BOOT
+
+#ifdef USE_FAST_BOOT
+// the port pin the UART receive is mapped to in BootUARTInit
+#define FAST_BOOT_RX_PIN PORTAbits.RA4
+// optional jumper to ground that forces the listen window. Add its pull up
+// to FAST_BOOT_PULLUPS_ON and FAST_BOOT_PULLUPS_OFF
+// #define FAST_BOOT_STRAP_PIN PORTBbits.RB7
+// pull ups holding unconnected pins high while they are sampled, then
+// restored to their reset state for the application
+#define FAST_BOOT_PULLUPS_ON()  CNPUASET = 1<<4
+#define FAST_BOOT_PULLUPS_OFF() CNPUACLR = 1<<4
+// microseconds for the pull ups to charge the pins, then to sample them
+#define FAST_BOOT_SETTLE_US 10
+#define FAST_BOOT_SAMPLE_US 20
+#endif
+
 // define this to use encrypted images, else unencrypted
 #define USE_CRYPTO
 
 #ifdef USE_CRYPTO
+// define this to decrypt with the ChaCha state in registers, XORing the
+// keystream a word at a time, instead of the smaller byte at a time version.
+// Rough cycles to decrypt a 1K page at 20 rounds (estimates from the
+// instructions per round, not measured on hardware; define DEBUG_BOOTLOADER
+// to have write packets report the real figure):
+//   byte version about 70000, word version about 20000
+#define USE_FAST_CRYPTO
+
+// define this to allow 'A' write packets, which carry the keystream block
+// counter they were encrypted at. Each can then be decrypted on its own, so
+// a failed packet can be sent again without the flasher starting over
+// #define USE_COUNTER_PACKETS
+
 // If encrypted, you need a 32 byte key, stored here as eight 4 byte values
 // These get written as the key, word 0 first (lowest address), each stored
 // big endian into a byte array
@@ -206,6 +319,159 @@ Code written by Chris Lomont, 2015
 #define PASSWORD_WORD7 0x12345678
 #endif
 
+// define this to receive the UART with DMA channel 0 into a ring buffer on
+// the stack, so bytes arriving while flash is programmed or a packet is
+// decrypted are kept instead of overrunning the 4 byte UART FIFO
+#define USE_RX_DMA
+
+#ifndef USE_RX_DMA
+// without the receive DMA, define this to start and wait on each flash
+// program or erase from a small routine copied into RAM, which moves
+// received bytes into a ring on the stack until the operation finishes.
+// From flash the CPU stalls until programming is done, and the 4 byte UART
+// FIFO overruns during a page erase. Uses UART1
+#define USE_RAM_NVM
+#endif
+
+#if defined(USE_RX_DMA) || defined(USE_RAM_NVM)
+// size of the receive ring in bytes, a power of two, at most 65536
+// it lives on the 8K boot stack, and with the receive DMA must hold the whole
+// write window. With multi-page write packets it moves above the stack with
+// the packet buffer, see BULK_RAM_OFFSET, and is made larger
+#if defined(USE_RX_DMA)
+#define RX_RING_SIZE (WRITE_PACKET_PAGES > 1 ? 16384 : 4096)
+#else
+#define RX_RING_SIZE 4096
+#endif
+#endif
+
+#ifdef USE_RX_DMA
+// DCH0INT flags the DMA sets on filling the first half of the ring, and on
+// filling the second half and wrapping
+#define DMA_DEST_HALF (1<<4) // CHDHIF
+#define DMA_DEST_DONE (1<<5) // CHDDIF
+#endif
+
+// define this to queue UART output in a small ring above the stack, moved
+// into the transmit FIFO whenever the bootloader polls for a received byte or
+// waits on flash. Replies and text then no longer wait a byte time for each
+// character, only while the ring is full. Uses UART1
+#define USE_TX_RING
+
+#ifdef USE_TX_RING
+// size of the transmit ring in bytes, a power of two
+#define TX_RING_SIZE 256
+#endif
+
+#ifdef USE_RX_DMA
+
+// define this to decrypt and CRC each 64 byte chunk of a write packet while
+// the rest of the packet is still arriving, making the next keystream block
+// whenever no byte is waiting. Then only the last chunk and the flash
+// programming remain after the last byte. Needs the receive ring, since the
+// UART FIFO alone overruns while a chunk is processed. The turnaround saved
+// has not been measured on hardware, DEBUG_TURNAROUND prints it
+#define USE_STREAM_RECEIVE
+#endif
+
+// define this to expand write packets sent LZ77 compressed, marked by the top
+// bit of their length. Sparse firmware with long runs of 0xFF or 0x00 then
+// needs far fewer bytes over the link
+// #define USE_COMPRESSION
+
+// define this to give up on a write packet whose bytes stop arriving, so a
+// dropped byte costs one resend instead of a hung session. The bootloader
+// waits for the line to go quiet, then replies NACK_RECEIVE_TIMEOUT
+// #define USE_RECEIVE_TIMEOUT
+
+#ifdef USE_RECEIVE_TIMEOUT
+// ms allowed between two bytes of a write packet, and the quiet time that
+// ends the resync after a timeout. Must cover gaps in the flasher's sending
+#define RECEIVE_BYTE_MS 50
+// ms allowed for a whole write packet, long enough for the largest packet at
+// the slowest baud rate used
+#define RECEIVE_PACKET_MS 5000
+#endif
+
+// define this to print the core timer cycles from the last byte of each
+// write packet to its reply, printed after the reply so the printing is not
+// counted. For measuring only, the flasher just shows the lines as text
+// #define DEBUG_TURNAROUND
+
+// define this to allow the 'L' lazy erase command, which erases each page the
+// first time a write packet touches it instead of erasing up front
+#define USE_LAZY_ERASE
+
+#ifdef USE_LAZY_ERASE
+// most program flash plus boot flash pages tracked, a multiple of 32
+// must be at least (FLASH_SIZE+BOOT_SIZE)/FLASH_PAGE_SIZE for the part
+#define LAZY_ERASE_MAX_PAGES 288
+#endif
+
+// define this for staged updates. The running application receives an image
+// stream, the same 'W' packets the flasher sends, and stores it in a staging
+// region at the top of program flash with BootStagingErase, BootStagingWrite
+// and BootStagingFinish. On the next reset the bootloader checks the stream
+// CRC and runs the packets through the write command from flash, with lazy
+// erase, so the application is only down for the flash to flash copy. A copy
+// cut short by power loss is redone on the next reset. The application must
+// be linked below STAGING_START, and staged images may not write boot flash
+// #define USE_STAGING
+
+#if defined(USE_STAGING) && !defined(USE_LAZY_ERASE)
+#error staged updates erase pages as written, and need USE_LAZY_ERASE
+#endif
+
+// define this to allow the 'K' blank check command, which returns a bitmap of
+// the pages in a range that are not all 0xFF. Erases also skip pages that
+// are already blank, which shortens erasing a partly blank chip
+// #define USE_BLANK_CHECK
+
+// define this to allow the 'T' stats command, which returns the core timer
+// ticks spent in each phase of flashing and a ring of timestamped events,
+// both kept since the last erase. Unlike the DEBUG_BOOTLOADER prints, this
+// costs only a few timer reads per packet, so barely changes the timing
+// #define USE_STATS
+
+#ifdef USE_STATS
+// number of most recent events kept, a power of two
+#define STATS_EVENTS 32
+#endif
+
+// define this to allow the 'F' binary info command. It returns the info as
+// type, length, value records, and switches erase progress to one status
+// byte per page with no text, until the next 'I' switches back to text for
+// interactive use. Saves the flasher parsing a kilobyte or more of text
+// #define USE_BINARY_MODE
+
+// define this to accept sequence numbered 'S' write packets, which let the
+// flasher keep several packets in flight and resend only the ones that failed.
+// The flasher uses them only when the info command reports a write window,
+// so older flashers keep using 'W' packets
+#define USE_WRITE_WINDOW
+
+#ifdef USE_WRITE_WINDOW
+// number of 'S' packets the flasher may have in flight. Without the receive
+// DMA the UART FIFO cannot hold a second packet while one is decrypted and
+// checked, and USE_RAM_NVM only keeps bytes during flash operations, so this
+// must stay 1, which still saves the flasher side delays
+#ifdef USE_RX_DMA
+#define WRITE_WINDOW_SIZE 3
+#else
+#define WRITE_WINDOW_SIZE 1
+#endif
+#endif
+
+// define this to journal write progress in a flash page, so a flash cut short
+// by a dropped link can carry on where it stopped instead of starting over.
+// The flasher names the session with the 'J' command before erasing, and each
+// write packet committed in order then appends its count and keystream
+// position to the page. After reconnecting, 'J' reports how far the same
+// session got and 'U' resumes from there. Lazy erase sessions are not
+// journaled, since which pages were erased is lost. The application must be
+// linked clear of the JOURNAL_START page
+// #define USE_JOURNAL
+
 
 // To have some blinking LED feedback, define these for your device
 // otherwise leave blank
@@ -224,6 +490,16 @@ Code written by Chris Lomont, 2015
 #if defined(__32MX150F128C__) || defined(__32MX150F128B__)
 #define FLASH_PAGE_SIZE 1024 // bytes
 #define FLASH_ROW_SIZE   128 // bytes
+// 32K of RAM holds a four page packet buffer and the DMA ring for a window
+// above the 8K boot stack
+#define WRITE_PACKET_PAGES 4
+// upper program flash for staged images, below the exception page the
+// application needs. The application gets the 52K from 0x1D003000
+#define STAGING_START 0x1D010000
+#define STAGING_SIZE  0xF000
+// last program flash page, above the application exception vectors, for the
+// write journal. The linker script keeps it out of exception_mem
+#define JOURNAL_START 0x1D01FC00
 
 #else
 
@@ -231,6 +507,28 @@ error! need defines for your chip
 
 #endif
 
+// most flash pages one write packet may hold, reported in the info so the
+// flasher sizes its packets. Parts with little RAM keep single page packets
+#ifndef WRITE_PACKET_PAGES
+#define WRITE_PACKET_PAGES 1
+#endif
+#define MAX_PACKET_SIZE (WRITE_PACKET_PAGES*FLASH_PAGE_SIZE)
+
+#if defined(USE_STAGING) && !defined(STAGING_START)
+#error staged updates need STAGING_START and STAGING_SIZE for your chip
+#endif
+
+#if defined(USE_JOURNAL) && !defined(JOURNAL_START)
+#error the write journal needs JOURNAL_START for your chip
+#endif
+
+#if WRITE_PACKET_PAGES > 1
+// RAM offset of the multi-page packet buffer, then the receive ring, too
+// large for the 8K boot stack. The application startup code has not run
+// yet, so the RAM above the stack is free. Leaves 2K for USE_RAM_NVM
+#define BULK_RAM_OFFSET 0x2800
+#endif
+
 // todo - clean and organize these better
 // memory regions, end is one past usable end
 // all values are PHYSICAL addresses, not logical
@@ -274,7 +572,7 @@ error! need defines for your chip
  * executive for debugging (which is the main reason this bootloader is loaded
  * elsewhere). This bootloader installs a small jump into the start of this C
  * runtime to jump to an address where the bootloader will always reside, the
- * start of user flash at logical address 0xBD000000, where it uses about 6K of
+ * start of user flash at logical address 0xBD000000, where it uses about 11K of
  * flash. The jump stub and the boot code itself are protected by the bootloader
  * from being overwritten.
  *
@@ -306,9 +604,42 @@ error! need defines for your chip
  *        Useful fields: bootloader version, product version, PIC version?
  *        memory locations
  *        Responds with DATA CRC
+ *    'F' (0x46) = Fast identify. No data. Returns the same info as binary
+ *        records, and makes erases reply without text until the next 'I'.
+ *        See BootCommandBinaryInfo. Only present if the info command lists it.
  *    'C' (0x43) = CRC. Compute CRC32K over all flash, and output text, then ACK.
  *    'E' (0x45) = Erase. Send 'E' Address CRC, responds ACK CRC
  *    'W' (0x57) = Write. Send 'W' Address Length CRC, returns ACK CRC or NACK CRC
+ *    'S' (0x53) = Sequenced write. Like 'W' with a sequence number, so several
+ *        can be in flight. Returns one ACK or NACK, then the sequence number.
+ *        Only present if the info command lists a write window.
+ *    'A' (0x41) = Addressed write. Like 'W' with the keystream block counter
+ *        the payload was encrypted at, so packets decrypt on their own.
+ *        Only present if the info command lists it.
+ *    'P' (0x50) = Page erase. Send 'P' and a list of page ranges to erase,
+ *        instead of all of flash. Replies like 'E'. See BootCommandRangeErase.
+ *    'M' (0x4D) = Manifest. Send 'M' and a page range, returns one CRC32K per
+ *        page in binary. See BootCommandManifest.
+ *    'K' (0x4B) = Blank check. Send 'K' and a page range like 'M', returns a
+ *        bitmap of the pages that are not blank. See BootCommandBlankCheck.
+ *        Only present if the info command lists it.
+ *    'T' (0x54) = sTats. No data. Returns phase times, counts, and recent
+ *        events in binary. See BootCommandStats.
+ *        Only present if the info command lists it.
+ *    'L' (0x4C) = Lazy erase. Like 'E', but each page is erased when first
+ *        written. Only present if the info command lists it.
+ *    'J' (0x4A) = Journal. Send 'J' and a session ID before an erase, returns
+ *        how many write packets the session had committed before the link
+ *        dropped. See BootCommandJournal. Only present if the info command
+ *        lists it.
+ *    'U' (0x55) = resUme. Send 'U' and the count from 'J', and writing
+ *        carries on after that packet without an erase. See BootCommandResume.
+ *    'R' (0x52) = Rate. Send 'R' and a big endian 32-bit baud rate. Returns
+ *        ACK_OK if the rate stays the same, else ACK_BAUD_CHANGE and switches.
+ *        The flasher then sends ACK_OK at the new rate, answered with ACK_OK.
+ *        If none comes, the Device goes back to the old rate and sends
+ *        NACK_SEQUENCE_ERROR there.
+ *        Only present if the info command lists a baud rate.
  *    'Q' (0x51) = Quit. Send 'Q'CRC. Return ACK then Device exits boot loader.
  *
  ******************************************************************************/
@@ -347,6 +678,23 @@ error! need defines for your chip
  * should zero memory). As a result, the code uses a decent chunk of RAM, so
  * should not be called later from the C strtup.
  * 
+ * With USE_RX_DMA the UART receive ring is also on the stack, and DMA channel
+ * 0 fills it. The channel is stopped before the bootloader returns, since the
+ * stack then belongs to the application. If the DMA comes round to bytes not
+ * yet read, which its half and done flags show, the ring is dropped and the
+ * write packet being received is answered with NACK_CRC_MISMATCH, so the
+ * flasher sends it again.
+ *
+ * With USE_RAM_NVM the ring is on the stack too, and the routine that runs
+ * flash operations is copied to RAM just above the 8K stack. The bus matrix
+ * RAM partition is set so that RAM can execute, and put back to its reset
+ * values before the bootloader returns. A flash operation that laps the ring
+ * drops it, with the same NACK as for the DMA.
+ *
+ * With USE_TX_RING the UART output is queued at TX_RAM_OFFSET, which is free
+ * since the application startup code has not run yet. The ring is emptied
+ * and cleared before the bootloader returns.
+ * 
  * All functions start with "Boot" to prevent accidentally calling outside
  * functions and all use the BOOT_FUNC macro to locate them properly in flash.
  *
@@ -506,9 +854,14 @@ error! need defines for your chip
 
 // from linker, used to tell the bootloader its size
 extern const unsigned int _HCBOOT_LD_SIZE_;
+#ifdef USE_HANDOFF
+// from linker, the RAM reserved for bootResult and the handoff word
+extern const unsigned int _HCBOOT_RAM_LD_SIZE_;
+#define BOOT_RAM_SIZE            ((uint32_t)(uintptr_t)(&_HCBOOT_RAM_LD_SIZE_))// must match linker script
+#endif
 
 // addresses to protect the bootloader
-#define BOOTLOADER_SIZE          ((uint32_t)(&_HCBOOT_LD_SIZE_))// must match linker script
+#define BOOTLOADER_SIZE          ((uint32_t)(uintptr_t)(&_HCBOOT_LD_SIZE_))// must match linker script
 #define BOOT_PHYSICAL_ADDRESS    0x1D000000 // note PHYSICAL address
 #define BOOT_LOGICAL_ADDRESS     0x9D000000 // note LOGICAL address
 
@@ -522,7 +875,38 @@ extern const unsigned int _HCBOOT_LD_SIZE_;
 #define BUFFER_OVERHEAD 20
 
 // internal ram buffer size used for temp storage
-#define BUFFER_SIZE (FLASH_PAGE_SIZE+BUFFER_OVERHEAD)
+#define BUFFER_SIZE (MAX_PACKET_SIZE+BUFFER_OVERHEAD)
+
+#if defined(USE_RX_DMA) && defined(USE_WRITE_WINDOW)
+#if RX_RING_SIZE < WRITE_WINDOW_SIZE*BUFFER_SIZE
+#error receive ring cannot hold the write window
+#endif
+#endif
+
+#if WRITE_PACKET_PAGES > 1
+// word aligned size of the packet buffer, the receive ring follows it
+#define BULK_BUFFER_SIZE ((BUFFER_SIZE+3)&~3)
+#if defined(USE_RX_DMA) || defined(USE_RAM_NVM)
+#if BULK_RAM_OFFSET + BULK_BUFFER_SIZE + RX_RING_SIZE > 0x8000
+#error packet buffer and receive ring do not fit in 32K of RAM
+#endif
+#endif
+#endif
+
+#ifdef USE_TX_RING
+// RAM offset of the transmit ring, above the stack and clear of the RAM
+// flash routine, after the packet buffer and receive ring if those are there
+#if WRITE_PACKET_PAGES > 1 && (defined(USE_RX_DMA) || defined(USE_RAM_NVM))
+#define TX_RAM_OFFSET (BULK_RAM_OFFSET + BULK_BUFFER_SIZE + RX_RING_SIZE)
+#elif WRITE_PACKET_PAGES > 1
+#define TX_RAM_OFFSET (BULK_RAM_OFFSET + BULK_BUFFER_SIZE)
+#else
+#define TX_RAM_OFFSET 0x2800
+#endif
+#if TX_RAM_OFFSET + 8 + TX_RING_SIZE > 0x8000
+#error transmit ring does not fit in 32K of RAM
+#endif
+#endif
 
 // used to put code items into the boot rom section we defined in the linker script
 #define BOOT_CODE   __attribute__((section(".hcbcode")))
@@ -552,6 +936,8 @@ extern const unsigned int _HCBOOT_LD_SIZE_;
         
 // how to map logical addresses to physical addresses
 #define LOGICAL_TO_PHYSICAL_ADDRESS(addr) ((addr)&0x1FFFFFFF)
+// and back, to the uncached KSEG1 view used for reading flash
+#define PHYSICAL_TO_LOGICAL_ADDRESS(addr) ((addr)|0xA0000000)
 
 // bootloader code version
 BOOTSTRING(bootloaderVersion,"0.5");
@@ -579,6 +965,8 @@ enum {
     ACK_PAGE_ERASED              = 0xF0,
     ACK_PAGE_PROTECTED           = 0xF1,
     ACK_ERASE_DONE               = 0xF2,
+    // baud rate accepted, switching after this byte
+    ACK_BAUD_CHANGE              = 0xF3,
 
     // reserved for ACK
     // the byte that signals a positive outcome to the flashing utility
@@ -587,7 +975,12 @@ enum {
 };
 
 // NACK is a byte, starts with 0xE0, has 16 lower nibbles
+#ifdef USE_STATS
+// also logged as a stats event, so needs bs
+#define NACK(reason) do { STAT_EVENT(bs, EVENT_NACK, reason); BootUARTWriteByte(reason); } while (0)
+#else
 #define NACK(reason) BootUARTWriteByte(reason)
+#endif
 // NACK reasons
 enum {
     // write problems
@@ -609,10 +1002,62 @@ enum {
     // erase problems
     NACK_ERASE_FAILED             = 0xED,
 
-    // currently unused
-    NACK_UNUSED1                  = 0xEE,
-    NACK_UNUSED2                  = 0xEF
+    // sequenced write packet outside the write window, or a baud rate
+    // change not confirmed
+    NACK_SEQUENCE_ERROR           = 0xEE,
+
+    // write packet bytes stopped arriving, followed by the count received
+    NACK_RECEIVE_TIMEOUT          = 0xEF
+};
+
+#ifdef USE_STATS
+// phases timed for the 'T' stats command
+enum {
+    STAT_RECEIVE_WAIT = 0, // waiting for a byte from the flasher
+    STAT_DECRYPT      = 1, // keystream and xor of write packets
+    STAT_CRC          = 2, // write packet and readback CRCs
+    STAT_ERASE        = 3, // NVM page erases
+    STAT_PROGRAM      = 4, // NVM row and word writes
+    STAT_VERIFY       = 5, // comparing written flash to the buffer
+    STAT_PHASES       = 6
+};
+
+// counts sent by the 'T' stats command after the page erase counts
+enum {
+    COUNT_PACKETS     = 0, // write packets received
+    COUNT_ROWS        = 1, // rows programmed
+    COUNT_WORDS       = 2, // single words programmed
+    COUNT_RETRIES     = 3, // row or word writes retried
+    COUNT_NACKS       = 4, // NACK replies sent
+    STAT_COUNTS       = 5
+};
+
+// events in the stats ring, logged with a 24 bit value
+enum {
+    EVENT_PACKET_START = 1, // value is the payload length
+    EVENT_PACKET_END   = 2, // value is the reply
+    EVENT_ERASE        = 3, // value is the low 24 bits of the page address
+    EVENT_PROGRAM      = 4, // value is the low 24 bits of the write address
+    EVENT_NACK         = 5  // value is the NACK reason
+};
+#endif
+
+#ifdef USE_BINARY_MODE
+// record types in the 'F' binary info
+enum {
+    INFO_VERSION      = 1,  // bootloader version text
+    INFO_DEVICE_ID    = 2,  // 32-bit DEVID, without the revision
+    INFO_REVISION     = 3,  // 8-bit DEVID revision
+    INFO_BOOT_SIZE    = 4,  // 32-bit bootloader size
+    INFO_PAGE_SIZE    = 5,  // 16-bit flash page size
+    INFO_ROW_SIZE     = 6,  // 16-bit flash row size
+    INFO_PACKET_SIZE  = 7,  // 32-bit most data bytes in a write packet
+    INFO_WRITE_WINDOW = 8,  // 8-bit write window, if 'S' is understood
+    INFO_BAUD_RATE    = 9,  // 32-bit baud rate, if 'R' is understood
+    INFO_COMMANDS     = 10, // command letters understood
+    INFO_COMPRESSION  = 11  // packet compression text, if understood
 };
+#endif
 
 // outcomes of the bootloader code, for querying
 // by the application
@@ -621,8 +1066,11 @@ enum {
     BOOT_RESULT_SUCCESSFUL = 1,
     BOOT_RESULT_POWER_EXIT = 2,
     BOOT_RESULT_STARTED = 3,
+    BOOT_RESULT_FAST_EXIT = 4,
+    BOOT_RESULT_STAGED = 5,
     BOOT_SET_HARDWARE_FAILED = -1,
     BOOT_RESULT_ASSUMPTIONS_FAILED = -2,
+    BOOT_RESULT_STAGED_FAILED = -3,
 };
 
 // one return variable at bottom of ram
@@ -639,6 +1087,13 @@ BOOT_RAM uint8_t bootResult  __attribute__ ((persistent));
 // this define must match the address of the boot result
 #define BOOT_RESULT_VIRTUAL_ADDRESS 0xA0000000
 
+#ifdef USE_HANDOFF
+// word after bootResult, in the reserved boot RAM so crt0 leaves it alone.
+// BootloaderRequestEntry sets it to the magic value before a software reset
+#define BOOT_HANDOFF       (*(volatile uint32_t *)(BOOT_RESULT_VIRTUAL_ADDRESS+4))
+#define BOOT_HANDOFF_MAGIC 0x48434254 // "HCBT"
+#endif
+
 // structure for tracking a timer
 typedef struct
 {
@@ -648,6 +1103,18 @@ typedef struct
     uint32_t ticksPerCount; // can count many things, 
 } Timer_t;
 
+#ifdef USE_TX_RING
+// transmit ring at TX_RAM_OFFSET. Output functions have no Boot_t, so it
+// lives at a fixed address instead
+typedef struct
+{
+    // count of bytes put in and taken out of the ring, masked when used
+    uint32_t txHead, txTail;
+    uint8_t txRing[TX_RING_SIZE];
+} TxRing_t;
+#define BOOT_TX ((TxRing_t *)(0xA0000000 + TX_RAM_OFFSET))
+#endif
+
 #ifdef USE_CRYPTO
 // crypto state
 typedef struct
@@ -674,12 +1141,36 @@ typedef struct
     Timer_t nvmTimerUs;
 
     // buffer for receiving pacekt of data from the flash utility
+#if WRITE_PACKET_PAGES > 1
+    // BUFFER_SIZE bytes at BULK_RAM_OFFSET
+    uint8_t * buffer;
+#else
     uint8_t buffer[BUFFER_SIZE];
+#endif
     // where in buffer to put next byte read
     int readPos;
     // number of bytes in packet when finished
     int readMax;
 
+#ifdef USE_RX_DMA
+    // receive ring filled by DMA, RX_RING_SIZE bytes
+    uint8_t * rxRing;
+    // index of the next unread byte in the ring
+    uint32_t rxTail;
+#endif
+
+#ifdef USE_RAM_NVM
+    // receive ring filled during flash operations, RX_RING_SIZE bytes
+    uint8_t * rxRing;
+    // count of bytes put in and taken out of the ring, masked when used
+    uint32_t rxHead, rxTail;
+#endif
+
+#if defined(USE_RX_DMA) || defined(USE_RAM_NVM)
+    // set when unread bytes were lost to the receive ring lapping
+    bool rxOverflow;
+#endif
+
     // place to store CRC calculations
     uint32_t transmittedCrc,computedCrc;
 
@@ -705,18 +1196,206 @@ typedef struct
     // set to true on last write packet seen
     bool writesFinished;
 
+#ifdef USE_BINARY_MODE
+    // set by the 'F' info command, cleared by 'I'. Erases then send only a
+    // status byte per page
+    bool binaryMode;
+#endif
+
+    // set once the BOOT_START page has been erased for writing since the
+    // last erase command. Other writes into that page must wait for it
+    bool bootPageErased;
+
+#ifdef USE_LAZY_ERASE
+    // set by the lazy erase command, pages are erased on first write
+    bool lazyErase;
+
+    // one bit per page erased since the lazy erase command, program
+    // flash pages first, then boot flash pages
+    uint32_t erasedPages[LAZY_ERASE_MAX_PAGES/32];
+#endif
+
+#ifdef USE_WRITE_WINDOW
+    // sequence number received with the current 'S' packet
+    uint8_t sequenceNumber;
+
+    // packets accepted in sequence since the last erase
+    uint32_t nextSequence;
+
+    // set when the current packet is a resend of an earlier sequence number
+    bool retransmission;
+
+#ifdef USE_CRYPTO
+    // crypto block counter at the start of each packet in the window, so
+    // a resent packet is decrypted from its original keystream position
+    uint32_t windowCounter[WRITE_WINDOW_SIZE];
+
+    // crypto block counter to return to after decrypting a resent packet
+    uint32_t liveCounter;
+#endif
+
+    // CRC32K of the flash read back after the last write, sent with ACK_OK
+    uint32_t readbackCrc;
+#endif
+
+#ifdef USE_COMPRESSION
+    // set when the current write packet payload is compressed
+    bool compressedPacket;
+#endif
+
+#ifdef USE_COUNTER_PACKETS
+    // crypto block counter of the last 'A' packet, and its packetCounter,
+    // to tell that packet sent again from a new one
+    uint32_t packetBlockCounter;
+    uint32_t counterPacket;
+#endif
+
+#ifdef USE_RECEIVE_TIMEOUT
+    // time since the last byte of the current write packet, the whole
+    // packet being timed with timeoutTimerMs
+    Timer_t byteTimerMs;
+
+    // set once the current write packet stops arriving
+    bool receiveTimeout;
+
+    // bytes of the current write packet read after the command byte
+    uint32_t receivedCount;
+
+    // packet placement before the current write packet, put back if it
+    // times out so it can be sent again as if it never came
+    uint32_t savedPacketCounter;
+#ifdef USE_WRITE_WINDOW
+    uint32_t savedSequence;
+#endif
+#ifdef USE_CRYPTO
+    uint32_t savedBlockCounter;
+#endif
+#endif
+
     // counter used to retry writes a few times when flashing
     uint32_t writeRetryCounter;
 
     // space for result of a flash write
     uint32_t flashWriteResult;
 
+#ifdef DEBUG_TURNAROUND
+    // core timer when the last byte of the current write packet arrived
+    uint32_t lastByteTicks;
+#endif
+
+#ifdef USE_STAGING
+    // next byte and end of the staged stream while copying it, which
+    // BootUARTReadByte returns instead of received bytes. 0 otherwise
+    const uint8_t * stagedRead, * stagedEnd;
+
+    // last write packet reply, kept since nothing is sent while copying
+    uint8_t stagedReply;
+    // true while the stream is only decoded and checked, not written
+    bool stagedCheck;
+#endif
+
+#ifdef USE_JOURNAL
+    // session ID from the last 'J' command, set until an erase uses it
+    uint32_t sessionId;
+    bool sessionSet;
+
+    // set while committed write packets are being journaled
+    bool journalOn;
+
+    // write packets all committed since the erase, as last journaled
+    uint32_t journalCount;
+
+    // bit i set when packet journalCount+1+i is committed, those after a
+    // failed packet waiting for its resend through the write window
+    uint32_t journalAcked;
+
+    // byte offset in the journal page of the next free record
+    uint32_t journalFree;
+
+    // newest count record written, carried over when the page starts over
+    uint32_t journalRecord[2];
+#endif
+
+#ifdef USE_STATS
+    // core timer ticks spent in each STAT_ phase, and when each last started
+    uint32_t statTicks[STAT_PHASES], statStart[STAT_PHASES];
+
+    // core timer at the first read finding no byte, 0 if not waiting
+    uint32_t waitStart;
+
+    // COUNT_ values
+    uint32_t statCounts[STAT_COUNTS];
+
+    // ring of events, the core timer then the type<<24 | value
+    uint32_t eventTicks[STATS_EVENTS], eventData[STATS_EVENTS];
+    // events logged, the newest at (eventCount-1) & (STATS_EVENTS-1)
+    uint32_t eventCount;
+#endif
+
 #ifdef USE_CRYPTO
     Crypto_t crypto;
 #endif
 
 } Boot_t;
 
+/**************************** Stats section **********************************/
+#ifdef USE_STATS
+
+// read the core tick counter, defined in the utility section
+BOOT_CODE static uint32_t BootReadTimer();
+
+// time a phase, the start and stop must pair up within one function
+#define STAT_START(bs, phase) (bs)->statStart[phase] = BootReadTimer()
+#define STAT_STOP(bs, phase) (bs)->statTicks[phase] += BootReadTimer() - (bs)->statStart[phase]
+#define STAT_COUNT(bs, count) (bs)->statCounts[count]++
+#define STAT_EVENT(bs, type, value) BootStatEvent(bs, type, value)
+
+// log an event in the ring, overwriting the oldest
+BOOT_CODE static void BootStatEvent(Boot_t * bs, uint32_t type, uint32_t value)
+{
+    uint32_t i = bs->eventCount & (STATS_EVENTS-1);
+    bs->eventTicks[i] = BootReadTimer();
+    bs->eventData[i]  = (type<<24) | (value & 0xFFFFFF);
+    bs->eventCount++;
+    if (type == EVENT_NACK)
+        bs->statCounts[COUNT_NACKS]++;
+}
+
+// track receive waits, called after each UART read. The wait runs from the
+// first read finding no byte to the read that gets one
+BOOT_CODE static void BootStatWait(Boot_t * bs, bool gotByte)
+{
+    if (!gotByte)
+    {
+        if (bs->waitStart == 0)
+            bs->waitStart = BootReadTimer() | 1;
+    }
+    else if (bs->waitStart != 0)
+    {
+        bs->statTicks[STAT_RECEIVE_WAIT] += BootReadTimer() - bs->waitStart;
+        bs->waitStart = 0;
+    }
+}
+
+// clear the phase times, counts, and events
+BOOT_CODE static void BootStatReset(Boot_t * bs)
+{
+    int i;
+    for (i = 0; i < STAT_PHASES; ++i)
+        bs->statTicks[i] = 0;
+    for (i = 0; i < STAT_COUNTS; ++i)
+        bs->statCounts[i] = 0;
+    bs->waitStart = 0;
+    bs->eventCount = 0;
+}
+
+#else
+#define STAT_START(bs, phase)
+#define STAT_STOP(bs, phase)
+#define STAT_COUNT(bs, count)
+#define STAT_EVENT(bs, type, value)
+#endif
+
 /**************************** UART section ***********************************/
 #if 0
 // if there is any UART error, return 1, else return 0
@@ -738,33 +1417,153 @@ BOOT_CODE static int BootUARTError()
 
 #endif
 
+#ifdef USE_TX_RING
+// move queued bytes into the UART transmit FIFO while it has room
+BOOT_CODE static void BootUARTDrain()
+{
+    TxRing_t * tx = BOOT_TX;
+    while (tx->txTail != tx->txHead && !U1STAbits.UTXBF)
+    {
+        U1TXREG = tx->txRing[tx->txTail & (TX_RING_SIZE - 1)];
+        tx->txTail++;
+    }
+}
+#endif
+
+#ifdef USE_RX_DMA
+// true if the DMA has come round to bytes not yet read. When the reader
+// enters a half of the ring, the flag for the DMA filling the other half is
+// cleared, so once set again the DMA is back in the reader's half
+BOOT_CODE static bool BootRxDmaLapped(Boot_t * bs)
+{
+    bool firstHalf = bs->rxTail < RX_RING_SIZE/2;
+    // flag before pointer, so the pointer is never behind the flag
+    if ((DCH0INT & (firstHalf ? DMA_DEST_DONE : DMA_DEST_HALF)) == 0)
+        return false;
+    uint32_t head = DCH0DPTR;
+    // behind the reader in its half is fine, level with it the ring is full
+    return (head < RX_RING_SIZE/2) != firstHalf || head >= bs->rxTail;
+}
+
+// drop all bytes in the ring, leaving the DMA flags to mark its next lap
+BOOT_CODE static void BootRxDmaDrop(Boot_t * bs)
+{
+    bs->rxTail = DCH0DPTR;
+    DCH0INTCLR = DMA_DEST_HALF | DMA_DEST_DONE;
+}
+#endif
+
 // read byte if one is ready.
 // if exists, return true and byte
 // if return false, byte = 0 is none avail, else
 // byte != 0 means error
-BOOT_CODE static bool BootUARTReadByte(uint8_t * byte)
+BOOT_CODE static bool BootUARTReadByte(Boot_t * bs, uint8_t * byte)
+    {
+#ifdef USE_STAGING
+    // copying a staged image, whose packets were checked to fit the stream.
+    // Should one read past its end anyway, it gets zeros and BootRunStaged
+    // fails the stream
+    if (bs->stagedRead != 0)
+    {
+        *byte = bs->stagedRead < bs->stagedEnd ? *bs->stagedRead : 0;
+        bs->stagedRead++;
+        return true;
+    }
+#endif
+#ifdef USE_TX_RING
+    // every wait for a byte polls here, so keep the output moving
+    BootUARTDrain();
+#endif
+#ifdef USE_RX_DMA
+    if (BootRxDmaLapped(bs))
+    { // bytes were written over before being read, the packet is lost
+        BootRxDmaDrop(bs);
+        bs->rxOverflow = true;
+    }
+    // the DMA destination pointer is where the next byte will land
+    else if (DCH0DPTR != bs->rxTail)
+    {
+        *byte = bs->rxRing[bs->rxTail];
+        bs->rxTail = (bs->rxTail + 1) & (RX_RING_SIZE - 1);
+        // entering a half, so watch for the DMA filling it again
+        if (bs->rxTail == RX_RING_SIZE/2)
+            DCH0INTCLR = DMA_DEST_HALF;
+        else if (bs->rxTail == 0)
+            DCH0INTCLR = DMA_DEST_DONE;
+#ifdef USE_STATS
+        BootStatWait(bs, true);
+#endif
+        return true;
+    }
+#else
+#ifdef USE_RAM_NVM
+    // bytes saved during a flash operation came before any still in the FIFO
+    if (bs->rxHead != bs->rxTail)
     {
+        *byte = bs->rxRing[bs->rxTail & (RX_RING_SIZE - 1)];
+        bs->rxTail++;
+#ifdef USE_STATS
+        BootStatWait(bs, true);
+#endif
+        return true;
+    }
+#endif
     // if data ready, get it
     if (U1STAbits.URXDA != 0)
     {
         *byte = U1RXREG;
+#ifdef USE_STATS
+        BootStatWait(bs, true);
+#endif
         return true;
     }
+#endif
     *byte = 0;
+#ifdef USE_STATS
+    BootStatWait(bs, false);
+#endif
     return false;
     } // UARTReadByte
 
 
-// blocking call to write byte to UART
+// write byte to UART, only waiting while there is no room for it
 BOOT_CODE static void BootUARTWriteByte(char byte)
 {
+#ifdef USE_TX_RING
+    TxRing_t * tx = BOOT_TX;
+    if (tx->txHead == tx->txTail && !U1STAbits.UTXBF)
+    { // nothing queued ahead of it, and the FIFO has room
+        U1TXREG = byte;
+        return;
+    }
+    while (tx->txHead - tx->txTail == TX_RING_SIZE)
+        BootUARTDrain();
+    tx->txRing[tx->txHead & (TX_RING_SIZE - 1)] = byte;
+    tx->txHead++;
+#else
 #ifdef HC_UART1
-        while (!U1STAbits.TRMT);   // wait till bit clear, then ready to transmit
+        while (U1STAbits.UTXBF);   // wait till transmit FIFO has room
         U1TXREG = byte; // write a byte
 #else
-        while (!U2STAbits.TRMT);   // wait till bit clear, then ready to transmit
+        while (U2STAbits.UTXBF);   // wait till transmit FIFO has room
         U2TXREG = byte; // write a byte
 #endif
+#endif
+}
+
+// send everything written and wait until the last bit has left, before the
+// baud rate changes or the application gets the UART
+BOOT_CODE static void BootUARTFlush()
+{
+#ifdef USE_TX_RING
+    while (BOOT_TX->txTail != BOOT_TX->txHead)
+        BootUARTDrain();
+#endif
+#ifdef HC_UART1
+        while (!U1STAbits.TRMT);   // wait till transmit shift register empty
+#else
+        while (!U2STAbits.TRMT);   // wait till transmit shift register empty
+#endif
 }
 
 // print the message to the serial port.
@@ -838,7 +1637,7 @@ BOOT_CODE static void BootUARTInit()
     TRISACLR = (unsigned int)(1<<0);
     ANSELACLR = (unsigned int)(1<<0);
 
-    U1RXR = 2; // RPB2 = U1RX
+    U1RXR = 2; // RPA4 = U1RX
     RPA0R = 1; // PIN RPA0 = U1TX
 
     // clock divider
@@ -855,6 +1654,11 @@ BOOT_CODE static void BootUARTInit()
             (1<<12) | // RX_ENABLE
             (1<<10) | // TX_ENABLE
             0;
+
+#ifdef USE_TX_RING
+    BOOT_TX->txHead = 0;
+    BOOT_TX->txTail = 0;
+#endif
 #else
     todo - UART2
 #endif
@@ -866,6 +1670,114 @@ BOOT_CODE static void BootUARTInit()
 
 }
 
+#ifdef USE_RX_DMA
+// start DMA channel 0 copying each received UART byte into the ring.
+// The channel auto enables, so it wraps to the ring start after the last byte
+BOOT_CODE static void BootRxDmaStart(Boot_t * bs, uint8_t * ring)
+{
+    bs->rxRing = ring;
+    bs->rxTail = 0;
+
+    DMACONSET = 1<<15; // DMA module on
+
+    DCH0CON  = 0;  // channel off, priority 0
+    DCH0ECON =
+            (_UART1_RX_IRQ << 8) | // CHSIRQ, start a cell transfer on each RX byte
+            (1<<4) |               // SIRQEN, start IRQ enabled
+            0;
+    DCH0SSA  = LOGICAL_TO_PHYSICAL_ADDRESS((uintptr_t)&U1RXREG);
+    DCH0DSA  = LOGICAL_TO_PHYSICAL_ADDRESS((uintptr_t)ring);
+    DCH0SSIZ = 1;
+    DCH0DSIZ = RX_RING_SIZE;
+    DCH0CSIZ = 1;  // one byte per trigger
+    DCH0INT  = 0;  // no channel interrupts, flags cleared
+
+    IFS1CLR = 1<<(_UART1_RX_IRQ-32); // drop any stale receive request
+
+    DCH0CON =
+            (1<<7) | // CHEN, channel enabled
+            (1<<4) | // CHAEN, auto enable to wrap the ring
+            0;
+}
+
+// stop the receive DMA, must be done before the ring on the stack goes away
+BOOT_CODE static void BootRxDmaStop()
+{
+    DCH0CON  = 0;
+    DCH0ECON = 0;
+    DMACONCLR = 1<<15; // DMA module off
+}
+#endif
+
+#ifdef USE_RAM_NVM
+// RAM offset of the flash operation routine, just above the 8K boot stack,
+// a multiple of 2K for the bus matrix partition
+#define RAM_NVM_OFFSET 0x2000
+
+// MIPS32 code for the flash operation routine, run from RAM. Called as
+//   uint32_t routine(&NVMCON, &U1STA, ring, head)
+// it unlocks and starts the NVM operation set up in NVMCON, then until WR
+// clears copies each received byte to ring[head & (RX_RING_SIZE-1)] and
+// increments head, returning the final head.
+#define RAM_NVM_WORDS 24
+BOOT_DATA static const uint32_t bootRamNvmCode[RAM_NVM_WORDS] = {
+    0x3C08AA99, //         lui   t0, 0xAA99
+    0x35086655, //         ori   t0, t0, 0x6655
+    0x3C095566, //         lui   t1, 0x5566
+    0x352999AA, //         ori   t1, t1, 0x99AA
+    0x340A8000, //         ori   t2, zero, NVMCON_WR
+    0xAC880010, //         sw    t0, 0x10(a0)   NVMKEY
+    0xAC890010, //         sw    t1, 0x10(a0)   NVMKEY
+    0xAC8A0008, //         sw    t2, 0x08(a0)   NVMCONSET
+    0x8C8B0000, // loop:   lw    t3, 0(a0)      NVMCON
+    0x016A5824, //         and   t3, t3, t2
+    0x1160000B, //         beq   t3, zero, done
+    0x00000000, //         nop
+    0x8CAC0000, //         lw    t4, 0(a1)      U1STA
+    0x318C0001, //         andi  t4, t4, 1      URXDA
+    0x1180FFF9, //         beq   t4, zero, loop
+    0x00000000, //         nop
+    0x8CAD0020, //         lw    t5, 0x20(a1)   U1RXREG
+    0x30EE0000 | (RX_RING_SIZE-1), // andi t6, a3, RX_RING_SIZE-1
+    0x00CE7021, //         addu  t6, a2, t6
+    0xA1CD0000, //         sb    t5, 0(t6)
+    0x1000FFF3, //         b     loop
+    0x24E70001, //         addiu a3, a3, 1
+    0x03E00008, // done:   jr    ra
+    0x00E01025  //         or    v0, a3, zero
+};
+
+typedef uint32_t (*BootRamNvm_t)(volatile uint32_t *, volatile uint32_t *, uint8_t *, uint32_t);
+
+// copy the flash operation routine to RAM and let that RAM execute
+BOOT_CODE static void BootRamNvmStart(Boot_t * bs, uint8_t * ring)
+{
+    int i;
+    bs->rxRing = ring;
+    bs->rxHead = 0;
+    bs->rxTail = 0;
+
+    // copy while all of RAM is still data, then split off 2K of kernel
+    // program RAM. The RAM above it stays data for the packet buffer
+    for (i = 0; i < RAM_NVM_WORDS; ++i)
+        ((uint32_t*)(0xA0000000 + RAM_NVM_OFFSET))[i] = bootRamNvmCode[i];
+    BMXDKPBA = RAM_NVM_OFFSET;
+    BMXDUDBA = RAM_NVM_OFFSET + 0x800;
+    BMXDUPBA = BMXDRMSZ;
+}
+
+// put the RAM partition back to the reset values the application expects
+BOOT_CODE static void BootRamNvmStop()
+{
+    int i;
+    BMXDKPBA = 0;
+    BMXDUDBA = 0;
+    BMXDUPBA = 0;
+    for (i = 0; i < RAM_NVM_WORDS; ++i)
+        ((uint32_t*)(0xA0000000 + RAM_NVM_OFFSET))[i] = 0;
+}
+#endif
+
 // print debug messages if the debugging define is set, else ignore them
 #ifdef DEBUG_BOOTLOADER
 #define BootDebugPrint(message) BootPrintSerial(message)
@@ -890,7 +1802,7 @@ BOOT_CODE static void BootPrintMemory(const char * msg, uint32_t address, int le
             BootPrintSerialHex(addr);
             BootPrintSerial(" : ");
         }
-        BootPrintSerialHexN((uint8_t)(*((uint8_t*)addr)),2);
+        BootPrintSerialHexN((uint8_t)(*((uint8_t*)(uintptr_t)addr)),2);
         BootPrintSerial(" ");
         if ((i&7)==7)
         {
@@ -917,15 +1829,13 @@ BOOT_CODE static uint32_t BootOverlap(
 // set the core tick counter
 BOOT_CODE static void BootWriteTimer(uint32_t time)
 {
-    asm volatile("mtc0   %0, $9": "+r"(time));
+    _CP0_SET_COUNT(time);
 }
 
 // read the core tick counter
 BOOT_CODE static uint32_t BootReadTimer()
 {
-    uint32_t time;
-    asm volatile("mfc0   %0, $9" : "=r"(time));
-    return time;
+    return _CP0_GET_COUNT();
 }
 
 // initialize the timer fields
@@ -963,7 +1873,9 @@ BOOT_CODE static void BootDelay(Timer_t * timer, uint32_t ticksPerCount, int cou
     BootStartTimer(timer, ticksPerCount);
     while (BootUpdateTimer(timer)<counts)
     {
-        // do nothing
+#ifdef USE_TX_RING
+        BootUARTDrain();
+#endif
     }
 }
 
@@ -982,50 +1894,140 @@ BOOT_CODE static void BootReadBigEndian(uint32_t * answer, uint8_t * buffer, int
 
 /*************************** CRC32K section ***********************************/
 
+#define CRC32K_POLY 0x741B8CD7U
+
+// The CRC is shifted CRC_BITS_PER_STEP bits per step, with one table lookup
+// per step except in the bitwise version. See CRC_BITS_PER_STEP for sizes.
+#if CRC_BITS_PER_STEP == 1
+#define CRC32K_STEP(crc) (((crc) & 0x80000000U) == 0 ? ((crc)<<1) : ((crc)<<1)^CRC32K_POLY)
+#elif CRC_BITS_PER_STEP == 2
+BOOT_DATA static const uint32_t crc32kTable[4] = {
+    0x00000000U, 0x741B8CD7U, 0xE83719AEU, 0x9C2C9579U
+};
+#elif CRC_BITS_PER_STEP == 4
+BOOT_DATA static const uint32_t crc32kTable[16] = {
+    0x00000000U, 0x741B8CD7U, 0xE83719AEU, 0x9C2C9579U,
+    0xA475BF8BU, 0xD06E335CU, 0x4C42A625U, 0x38592AF2U,
+    0x3CF0F3C1U, 0x48EB7F16U, 0xD4C7EA6FU, 0xA0DC66B8U,
+    0x98854C4AU, 0xEC9EC09DU, 0x70B255E4U, 0x04A9D933U
+};
+#elif CRC_BITS_PER_STEP == 8
+BOOT_DATA static const uint32_t crc32kTable[256] = {
+    0x00000000U, 0x741B8CD7U, 0xE83719AEU, 0x9C2C9579U, 0xA475BF8BU, 0xD06E335CU,
+    0x4C42A625U, 0x38592AF2U, 0x3CF0F3C1U, 0x48EB7F16U, 0xD4C7EA6FU, 0xA0DC66B8U,
+    0x98854C4AU, 0xEC9EC09DU, 0x70B255E4U, 0x04A9D933U, 0x79E1E782U, 0x0DFA6B55U,
+    0x91D6FE2CU, 0xE5CD72FBU, 0xDD945809U, 0xA98FD4DEU, 0x35A341A7U, 0x41B8CD70U,
+    0x45111443U, 0x310A9894U, 0xAD260DEDU, 0xD93D813AU, 0xE164ABC8U, 0x957F271FU,
+    0x0953B266U, 0x7D483EB1U, 0xF3C3CF04U, 0x87D843D3U, 0x1BF4D6AAU, 0x6FEF5A7DU,
+    0x57B6708FU, 0x23ADFC58U, 0xBF816921U, 0xCB9AE5F6U, 0xCF333CC5U, 0xBB28B012U,
+    0x2704256BU, 0x531FA9BCU, 0x6B46834EU, 0x1F5D0F99U, 0x83719AE0U, 0xF76A1637U,
+    0x8A222886U, 0xFE39A451U, 0x62153128U, 0x160EBDFFU, 0x2E57970DU, 0x5A4C1BDAU,
+    0xC6608EA3U, 0xB27B0274U, 0xB6D2DB47U, 0xC2C95790U, 0x5EE5C2E9U, 0x2AFE4E3EU,
+    0x12A764CCU, 0x66BCE81BU, 0xFA907D62U, 0x8E8BF1B5U, 0x939C12DFU, 0xE7879E08U,
+    0x7BAB0B71U, 0x0FB087A6U, 0x37E9AD54U, 0x43F22183U, 0xDFDEB4FAU, 0xABC5382DU,
+    0xAF6CE11EU, 0xDB776DC9U, 0x475BF8B0U, 0x33407467U, 0x0B195E95U, 0x7F02D242U,
+    0xE32E473BU, 0x9735CBECU, 0xEA7DF55DU, 0x9E66798AU, 0x024AECF3U, 0x76516024U,
+    0x4E084AD6U, 0x3A13C601U, 0xA63F5378U, 0xD224DFAFU, 0xD68D069CU, 0xA2968A4BU,
+    0x3EBA1F32U, 0x4AA193E5U, 0x72F8B917U, 0x06E335C0U, 0x9ACFA0B9U, 0xEED42C6EU,
+    0x605FDDDBU, 0x1444510CU, 0x8868C475U, 0xFC7348A2U, 0xC42A6250U, 0xB031EE87U,
+    0x2C1D7BFEU, 0x5806F729U, 0x5CAF2E1AU, 0x28B4A2CDU, 0xB49837B4U, 0xC083BB63U,
+    0xF8DA9191U, 0x8CC11D46U, 0x10ED883FU, 0x64F604E8U, 0x19BE3A59U, 0x6DA5B68EU,
+    0xF18923F7U, 0x8592AF20U, 0xBDCB85D2U, 0xC9D00905U, 0x55FC9C7CU, 0x21E710ABU,
+    0x254EC998U, 0x5155454FU, 0xCD79D036U, 0xB9625CE1U, 0x813B7613U, 0xF520FAC4U,
+    0x690C6FBDU, 0x1D17E36AU, 0x5323A969U, 0x273825BEU, 0xBB14B0C7U, 0xCF0F3C10U,
+    0xF75616E2U, 0x834D9A35U, 0x1F610F4CU, 0x6B7A839BU, 0x6FD35AA8U, 0x1BC8D67FU,
+    0x87E44306U, 0xF3FFCFD1U, 0xCBA6E523U, 0xBFBD69F4U, 0x2391FC8DU, 0x578A705AU,
+    0x2AC24EEBU, 0x5ED9C23CU, 0xC2F55745U, 0xB6EEDB92U, 0x8EB7F160U, 0xFAAC7DB7U,
+    0x6680E8CEU, 0x129B6419U, 0x1632BD2AU, 0x622931FDU, 0xFE05A484U, 0x8A1E2853U,
+    0xB24702A1U, 0xC65C8E76U, 0x5A701B0FU, 0x2E6B97D8U, 0xA0E0666DU, 0xD4FBEABAU,
+    0x48D77FC3U, 0x3CCCF314U, 0x0495D9E6U, 0x708E5531U, 0xECA2C048U, 0x98B94C9FU,
+    0x9C1095ACU, 0xE80B197BU, 0x74278C02U, 0x003C00D5U, 0x38652A27U, 0x4C7EA6F0U,
+    0xD0523389U, 0xA449BF5EU, 0xD90181EFU, 0xAD1A0D38U, 0x31369841U, 0x452D1496U,
+    0x7D743E64U, 0x096FB2B3U, 0x954327CAU, 0xE158AB1DU, 0xE5F1722EU, 0x91EAFEF9U,
+    0x0DC66B80U, 0x79DDE757U, 0x4184CDA5U, 0x359F4172U, 0xA9B3D40BU, 0xDDA858DCU,
+    0xC0BFBBB6U, 0xB4A43761U, 0x2888A218U, 0x5C932ECFU, 0x64CA043DU, 0x10D188EAU,
+    0x8CFD1D93U, 0xF8E69144U, 0xFC4F4877U, 0x8854C4A0U, 0x147851D9U, 0x6063DD0EU,
+    0x583AF7FCU, 0x2C217B2BU, 0xB00DEE52U, 0xC4166285U, 0xB95E5C34U, 0xCD45D0E3U,
+    0x5169459AU, 0x2572C94DU, 0x1D2BE3BFU, 0x69306F68U, 0xF51CFA11U, 0x810776C6U,
+    0x85AEAFF5U, 0xF1B52322U, 0x6D99B65BU, 0x19823A8CU, 0x21DB107EU, 0x55C09CA9U,
+    0xC9EC09D0U, 0xBDF78507U, 0x337C74B2U, 0x4767F865U, 0xDB4B6D1CU, 0xAF50E1CBU,
+    0x9709CB39U, 0xE31247EEU, 0x7F3ED297U, 0x0B255E40U, 0x0F8C8773U, 0x7B970BA4U,
+    0xE7BB9EDDU, 0x93A0120AU, 0xABF938F8U, 0xDFE2B42FU, 0x43CE2156U, 0x37D5AD81U,
+    0x4A9D9330U, 0x3E861FE7U, 0xA2AA8A9EU, 0xD6B10649U, 0xEEE82CBBU, 0x9AF3A06CU,
+    0x06DF3515U, 0x72C4B9C2U, 0x766D60F1U, 0x0276EC26U, 0x9E5A795FU, 0xEA41F588U,
+    0xD218DF7AU, 0xA60353ADU, 0x3A2FC6D4U, 0x4E344A03U
+};
+#else
+#error CRC_BITS_PER_STEP must be 1, 2, 4, or 8
+#endif
+
+#if CRC_BITS_PER_STEP != 1
+#define CRC32K_STEP(crc) (crc32kTable[(crc)>>(32-CRC_BITS_PER_STEP)]^((crc)<<CRC_BITS_PER_STEP))
+#endif
+
 // Compute the CRC32K of the given data.
-// done without tables to save space in bootloader
 // The initial crc value should be 0, and this can be chained across calls.
 // returns the new CRC
-BOOT_CODE static uint32_t BootCrc32AddByteBitwise(uint8_t datum, uint32_t crc32)
+BOOT_CODE static uint32_t BootCrc32AddByte(uint8_t datum, uint32_t crc32)
 {
-    #define poly 0x741B8CD7U
+    int32_t bit;
     crc32 ^= (uint32_t)(datum << 24);
-#if 1
-    // 1 bit per line
-    crc32 = (crc32 & 0x80000000U) == 0 ? (crc32<<1) : (crc32<<1)^poly;
-    crc32 = (crc32 & 0x80000000U) == 0 ? (crc32<<1) : (crc32<<1)^poly;
-    crc32 = (crc32 & 0x80000000U) == 0 ? (crc32<<1) : (crc32<<1)^poly;
-    crc32 = (crc32 & 0x80000000U) == 0 ? (crc32<<1) : (crc32<<1)^poly;
-    crc32 = (crc32 & 0x80000000U) == 0 ? (crc32<<1) : (crc32<<1)^poly;
-    crc32 = (crc32 & 0x80000000U) == 0 ? (crc32<<1) : (crc32<<1)^poly;
-    crc32 = (crc32 & 0x80000000U) == 0 ? (crc32<<1) : (crc32<<1)^poly;
-    crc32 = (crc32 & 0x80000000U) == 0 ? (crc32<<1) : (crc32<<1)^poly;
-#else
-    // 2 bits per line
-    static const uint32_t const tbl4 [] = {0,poly,poly<<1,(poly<<1)^poly};
-    crc32 = tbl4[crc32>>30]^(crc32<<2);
-    crc32 = tbl4[crc32>>30]^(crc32<<2);
-    crc32 = tbl4[crc32>>30]^(crc32<<2);
-    crc32 = tbl4[crc32>>30]^(crc32<<2);
-#endif
-
-    #undef poly
+    for (bit = 0; bit < 8; bit += CRC_BITS_PER_STEP)
+        crc32 = CRC32K_STEP(crc32);
     return crc32;
 }
 
-
-/*************************** Decryption section *******************************/
-#ifdef USE_CRYPTO
-
-#define ROTATE(v,left) (((v)<<left)|((v)>>(32-left)))
-
+// Compute the CRC32K of length bytes at data, same result as calling
+// BootCrc32AddByte on each byte in order. Aligned words are read with a
+// single load each, and byte swapped since the CRC takes the first byte
+// as its high bits while the PIC32 is little endian.
+// returns the new CRC
+BOOT_CODE static uint32_t BootCrc32AddBytes(const uint8_t * data, uint32_t length, uint32_t crc32)
+{
+    int32_t bit;
+    while (length > 0 && ((uintptr_t)data & 3) != 0)
+    {
+        crc32 = BootCrc32AddByte(*data++, crc32);
+        length--;
+    }
+    while (length >= 4)
+    {
+        crc32 ^= __builtin_bswap32(*((const uint32_t*)data));
+        for (bit = 0; bit < 32; bit += CRC_BITS_PER_STEP)
+            crc32 = CRC32K_STEP(crc32);
+        data   += 4;
+        length -= 4;
+    }
+    while (length > 0)
+    {
+        crc32 = BootCrc32AddByte(*data++, crc32);
+        length--;
+    }
+    return crc32;
+}
+
+
+/*************************** Decryption section *******************************/
+#ifdef USE_CRYPTO
+
+#define ROTATE(v,left) (((v)<<left)|((v)>>(32-left)))
+
 #define QUARTERROUND(a,b,c,d) \
   cs->x[a] += cs->x[b]; cs->x[d] = ROTATE(cs->x[d]^cs->x[a],16); \
   cs->x[c] += cs->x[d]; cs->x[b] = ROTATE(cs->x[b]^cs->x[c],12); \
   cs->x[a] += cs->x[b]; cs->x[d] = ROTATE(cs->x[d]^cs->x[a], 8); \
   cs->x[c] += cs->x[d]; cs->x[b] = ROTATE(cs->x[b]^cs->x[c], 7)
 
+#ifdef USE_FAST_CRYPTO
+// same as QUARTERROUND, on local variables
+#define QUARTERROUND_LOCAL(a,b,c,d) \
+  a += b; d = ROTATE(d^a,16); \
+  c += d; b = ROTATE(b^c,12); \
+  a += b; d = ROTATE(d^a, 8); \
+  c += d; b = ROTATE(b^c, 7)
+#endif
 
+#if !defined(USE_FAST_CRYPTO) || defined(USE_JOURNAL)
 BOOT_CODE static void BootCryptoUnpack(uint8_t * output, int index, uint32_t val)
 {
     output[index++] = val;
@@ -1033,6 +2035,7 @@ BOOT_CODE static void BootCryptoUnpack(uint8_t * output, int index, uint32_t val
     output[index++] = val >> 16;
     output[index]   = val >> 24;
 }
+#endif
 
 BOOT_CODE static uint32_t BootCryptoPack(uint8_t * k, int index)
 {
@@ -1044,6 +2047,7 @@ BOOT_CODE static uint32_t BootCryptoPack(uint8_t * k, int index)
             (k[index + 3] << 24));
 }
 
+#ifndef USE_FAST_CRYPTO
 // output 64 bytes, input 16 uint32_t
 BOOT_CODE static void BootCryptoNextState(
     Crypto_t * cs,
@@ -1069,6 +2073,7 @@ BOOT_CODE static void BootCryptoNextState(
     for (cs->i = 0; cs->i < 16; ++cs->i)
         BootCryptoUnpack(output, 4*cs->i, cs->x[cs->i]);
 }
+#endif
 
 
 // Set the key, given a key of 128 or 256 bits in length
@@ -1140,6 +2145,109 @@ BOOT_CODE static void BootCryptoSetKeyAndInitializationVector(
     cs->state[15] = BootCryptoPack(initializationVectorBytes, 4);
 }
 
+#ifdef USE_FAST_CRYPTO
+// make the next 64 byte keystream block as sixteen words in cs->x, and
+// increment the 64 bit block counter
+// The working state lives in locals so the compiler keeps it in registers
+// through the rounds.
+BOOT_CODE static void BootCryptoKeystream(Crypto_t * cs, int rounds)
+{
+    uint32_t x0, x1, x2, x3, x4, x5, x6, x7;
+    uint32_t x8, x9, x10, x11, x12, x13, x14, x15;
+    int32_t round;
+
+    x0  = cs->state[0];  x1  = cs->state[1];
+    x2  = cs->state[2];  x3  = cs->state[3];
+    x4  = cs->state[4];  x5  = cs->state[5];
+    x6  = cs->state[6];  x7  = cs->state[7];
+    x8  = cs->state[8];  x9  = cs->state[9];
+    x10 = cs->state[10]; x11 = cs->state[11];
+    x12 = cs->state[12]; x13 = cs->state[13];
+    x14 = cs->state[14]; x15 = cs->state[15];
+
+    for (round = rounds; round > 0; round -= 2)
+    {
+        QUARTERROUND_LOCAL(x0, x4, x8, x12);
+        QUARTERROUND_LOCAL(x1, x5, x9, x13);
+        QUARTERROUND_LOCAL(x2, x6, x10,x14);
+        QUARTERROUND_LOCAL(x3, x7, x11,x15);
+        QUARTERROUND_LOCAL(x0, x5, x10,x15);
+        QUARTERROUND_LOCAL(x1, x6, x11,x12);
+        QUARTERROUND_LOCAL(x2, x7, x8, x13);
+        QUARTERROUND_LOCAL(x3, x4, x9, x14);
+    }
+
+    cs->x[0]  = x0  + cs->state[0];  cs->x[1]  = x1  + cs->state[1];
+    cs->x[2]  = x2  + cs->state[2];  cs->x[3]  = x3  + cs->state[3];
+    cs->x[4]  = x4  + cs->state[4];  cs->x[5]  = x5  + cs->state[5];
+    cs->x[6]  = x6  + cs->state[6];  cs->x[7]  = x7  + cs->state[7];
+    cs->x[8]  = x8  + cs->state[8];  cs->x[9]  = x9  + cs->state[9];
+    cs->x[10] = x10 + cs->state[10]; cs->x[11] = x11 + cs->state[11];
+    cs->x[12] = x12 + cs->state[12]; cs->x[13] = x13 + cs->state[13];
+    cs->x[14] = x14 + cs->state[14]; cs->x[15] = x15 + cs->state[15];
+
+    // increment 64 bit counter
+    cs->state[12]++;
+    if (cs->state[12] == 0)
+    {
+        cs->state[13]++;
+        /* stopping at 2^70 bytes per nonce is user's responsibility */
+    }
+}
+
+// XOR up to 64 bytes with the keystream block, a word at a time when both
+// buffers are word aligned. Message and cypher may be the same buffer.
+BOOT_CODE static void BootCryptoXor(
+        Crypto_t * cs,
+        uint8_t * messageBytes,
+        uint8_t * cypherBytes,
+        uint32_t length)
+{
+    uint32_t i = 0;
+    if ((((uintptr_t)messageBytes | (uintptr_t)cypherBytes) & 3) == 0)
+    { // PIC32 is little endian, the same order the keystream bytes use
+        for (; i + 4 <= length; i += 4)
+            *((uint32_t*)(cypherBytes + i)) = *((uint32_t*)(messageBytes + i)) ^ cs->x[i/4];
+    }
+    for (; i < length; ++i)
+        cypherBytes[i] = messageBytes[i] ^ (uint8_t)(cs->x[i/4] >> (8*(i&3)));
+}
+#else
+// make the next 64 byte keystream block in cs->output, and increment the
+// 64 bit block counter
+BOOT_CODE static void BootCryptoKeystream(Crypto_t * cs, int rounds)
+{
+    BootCryptoNextState(cs,cs->output, cs->state, rounds);
+
+#ifdef DEBUG_BOOTLOADER
+    if (cs->state[12] < 3)
+    {
+        BootPrintMemory("Enc output: ", (uint32_t)(cs->output), 64);
+    }
+#endif
+
+    cs->state[12]++;
+    if (cs->state[12] == 0)
+    {
+        cs->state[13]++;
+        /* stopping at 2^70 bytes per nonce is user's responsibility */
+    }
+}
+
+// XOR up to 64 bytes with the keystream block
+// Message and cypher may be the same buffer.
+BOOT_CODE static void BootCryptoXor(
+        Crypto_t * cs,
+        uint8_t * messageBytes,
+        uint8_t * cypherBytes,
+        uint32_t length)
+{
+    for (cs->i = 0; cs->i < (int)length; ++cs->i)
+        cypherBytes[cs->i] = (messageBytes[cs->i] ^ cs->output[cs->i]);
+}
+#endif // USE_FAST_CRYPTO
+
+#ifndef USE_STREAM_RECEIVE
 // note encrypt and decrypt are the same function
 BOOT_CODE static void BootCryptoDecrypt(
         Crypto_t * cs,
@@ -1148,45 +2256,24 @@ BOOT_CODE static void BootCryptoDecrypt(
         uint8_t * cypherBytes,
         int rounds)
 {
-    cs->bytes = messageLength;
+    uint32_t blockLength;
     if (rounds < 1)
     {
         BootDebugPrintE("ERROR: Crypto rounds must be positive");
         return;
     }
 
-    if (cs->bytes == 0) return;
-    cs->d64 = 0;
-    for (;;)
+    while (messageLength > 0)
     {
-        // update internal state and increment 64 bit counter
-        BootCryptoNextState(cs,cs->output, cs->state, rounds);
-
-#ifdef DEBUG_BOOTLOADER
-        if (cs->state[12] < 3)
-        {
-            BootPrintMemory("Enc output: ", (uint32_t)(cs->output), 64);
-        }
-#endif
-
-        cs->state[12]++;
-        if (cs->state[12] == 0)
-        {
-            cs->state[13]++;
-            /* stopping at 2^70 bytes per nonce is user's responsibility */
-        }
-        if (cs->bytes <= 64)
-        {
-            for (cs->i = 0; cs->i < cs->bytes; ++cs->i)
-                cypherBytes[cs->i + cs->d64] = (messageBytes[cs->i + cs->d64] ^ cs->output[cs->i]);
-            return;
-        }
-        for (cs->i = 0; cs->i < 64; ++cs->i)
-            cypherBytes[cs->i + cs->d64] = (messageBytes[cs->i + cs->d64] ^ cs->output[cs->i]);
-        cs->bytes -= 64;
-        cs->d64 += 64;
+        BootCryptoKeystream(cs, rounds);
+        blockLength = messageLength < 64 ? messageLength : 64;
+        BootCryptoXor(cs, messageBytes, cypherBytes, blockLength);
+        messageBytes  += blockLength;
+        cypherBytes   += blockLength;
+        messageLength -= blockLength;
     }
 }
+#endif
 #endif // USE_CRYPTO
 
 /*************************** Flash writing section*****************************/
@@ -1208,6 +2295,22 @@ BOOT_CODE static bool BootNVMemOperation(Boot_t * bs, uint32_t nvmop)
     // we wait 7
     BootDelay(&(bs->nvmTimerUs), TICKS_PER_MICROSECOND,7);
 
+#ifdef USE_TX_RING
+    // the CPU cannot run the ring during the operation, but the FIFO
+    // keeps sending, so fill it
+    BootUARTDrain();
+#endif
+
+#ifdef USE_RAM_NVM
+    // unlock, start, and wait from RAM, keeping received bytes
+    bs->rxHead = ((BootRamNvm_t)(0xA0000000 + RAM_NVM_OFFSET))(
+            &NVMCON, &U1STA, bs->rxRing, bs->rxHead);
+    if (bs->rxHead - bs->rxTail > RX_RING_SIZE)
+    { // unread bytes were written over, so drop them all
+        bs->rxTail = bs->rxHead;
+        bs->rxOverflow = true;
+    }
+#else
     // write enable sequence
     NVMKEY 	= 0xAA996655;
     NVMKEY 	= 0x556699AA;
@@ -1215,6 +2318,7 @@ BOOT_CODE static bool BootNVMemOperation(Boot_t * bs, uint32_t nvmop)
 
     // Wait for WR bit to clear
     while(NVMCON & NVMCON_WR);
+#endif
 
     // Disable Flash Write/Erase operations
     NVMCONCLR = NVMCON_WREN;
@@ -1260,7 +2364,11 @@ BOOT_CODE static bool BootNVMemWriteWord(Boot_t * bs, uint32_t physicalDestinati
     }
     NVMADDR = physicalDestinationAddress;
     NVMDATA = data;
-    return BootNVMemOperation(bs,NVM_OP_WRITE_WORD);
+    STAT_COUNT(bs, COUNT_WORDS);
+    STAT_START(bs, STAT_PROGRAM);
+    bool result = BootNVMemOperation(bs,NVM_OP_WRITE_WORD);
+    STAT_STOP(bs, STAT_PROGRAM);
+    return result;
 }
 
 // write 32 bit value to given physical address
@@ -1276,15 +2384,19 @@ BOOT_CODE static bool BootNVMemWriteRow(Boot_t * bs, uint32_t physicalDestinatio
     }
 
     // must be word aligned
-    if (((uint32_t)physicalData) & (3U))
+    if (((uintptr_t)physicalData) & (3U))
     {
         ERROR('b');
         return false;
     }
 
     NVMADDR = physicalDestinationAddress;
-    NVMSRCADDR = (uint32_t)physicalData;
-    return BootNVMemOperation(bs,NVM_OP_WRITE_ROW);
+    NVMSRCADDR = (uintptr_t)physicalData;
+    STAT_COUNT(bs, COUNT_ROWS);
+    STAT_START(bs, STAT_PROGRAM);
+    bool result = BootNVMemOperation(bs,NVM_OP_WRITE_ROW);
+    STAT_STOP(bs, STAT_PROGRAM);
+    return result;
 }
 
 // erase page
@@ -1296,13 +2408,113 @@ BOOT_CODE static bool BootNVMemErasePage(Boot_t * bs, uint32_t physicalDestinati
     if (physicalDestinationAddress & (FLASH_PAGE_SIZE-1))
         return false;
     NVMADDR = physicalDestinationAddress;
-    return BootNVMemOperation(bs,NVM_OP_ERASE_PAGE);
+    STAT_EVENT(bs, EVENT_ERASE, physicalDestinationAddress);
+    STAT_START(bs, STAT_ERASE);
+    bool result = BootNVMemOperation(bs,NVM_OP_ERASE_PAGE);
+    STAT_STOP(bs, STAT_ERASE);
+    return result;
+}
+
+#ifdef USE_STAGING
+/* 
+ * The staging region starts with a four word header, then the stream of
+ * 'W' packets exactly as the flasher would send them, ending with the zero
+ * length packet:
+ * word 0 : STAGED_MAGIC, written last, once the stream and other words are in
+ * word 1 : stream length in bytes
+ * word 2 : CRC32K of the stream, as given by whoever sent it
+ * word 3 : 0xFFFFFFFF from the erase, cleared by the bootloader once the
+ *          copy is done, or the stream is refused before anything is erased
+ */
+#define STAGED_MAGIC       0x48435354 // "HCST"
+#define STAGED_HEADER_SIZE 16
+
+// run an NVM operation for the application, which has no Boot_t and whose
+// RAM holds no flash routine, so the CPU stalls until it is done
+// return true on success, else false
+BOOT_CODE static bool BootStagingOperation(uint32_t nvmop)
+{
+#ifdef IGNORE_FLASH_OPS
+    return true; // do not change anything
+#else
+    uint32_t start, status;
+
+    NVMCON = NVMCON_WREN | nvmop;
+    start = BootReadTimer();
+    while (BootReadTimer() - start < 7*TICKS_PER_MICROSECOND)
+        ; // LVD settling, as in BootNVMemOperation
+
+    // the unlock sequence must not be split by an application interrupt
+    status = __builtin_disable_interrupts();
+    NVMKEY 	= 0xAA996655;
+    NVMKEY 	= 0x556699AA;
+    NVMCONSET 	= NVMCON_WR;
+    __builtin_mtc0(12, 0, status);
+
+    while(NVMCON & NVMCON_WR);
+    NVMCONCLR = NVMCON_WREN;
+
+    if (NVMCON & 0x3000)
+    { // clear the error for the next operation
+        BootStagingOperation(NVM_OP_CLEAR_ERROR);
+        return false;
+    }
+    return true;
+#endif
+}
+
+// called by the application to erase the staging region before staging an
+// image. Takes the page erase time for each page, about 20 ms
+// return true on success, else false
+BOOT_CODE bool BootStagingErase()
+{
+    uint32_t address;
+    for (address = STAGING_START; address < STAGING_START + STAGING_SIZE; address += FLASH_PAGE_SIZE)
+    {
+        NVMADDR = address;
+        if (!BootStagingOperation(NVM_OP_ERASE_PAGE))
+            return false;
+    }
+    return true;
+}
+
+// called by the application to store a stream word, bytes in stream order
+// from the low byte, at the word aligned byte offset into the stream
+// return true on success, else false
+BOOT_CODE bool BootStagingWrite(uint32_t offset, uint32_t word)
+{
+    if ((offset & 3) != 0 || STAGING_SIZE - STAGED_HEADER_SIZE <= offset)
+        return false;
+    NVMADDR = STAGING_START + STAGED_HEADER_SIZE + offset;
+    NVMDATA = word;
+    return BootStagingOperation(NVM_OP_WRITE_WORD);
 }
 
+// called by the application once the whole stream is stored, marking it
+// ready for the bootloader to copy on the next reset
+// return true on success, else false
+BOOT_CODE bool BootStagingFinish(uint32_t length, uint32_t crc)
+{
+    if (STAGING_SIZE - STAGED_HEADER_SIZE < length)
+        return false;
+    NVMADDR = STAGING_START + 4;
+    NVMDATA = length;
+    if (!BootStagingOperation(NVM_OP_WRITE_WORD))
+        return false;
+    NVMADDR = STAGING_START + 8;
+    NVMDATA = crc;
+    if (!BootStagingOperation(NVM_OP_WRITE_WORD))
+        return false;
+    NVMADDR = STAGING_START;
+    NVMDATA = STAGED_MAGIC;
+    return BootStagingOperation(NVM_OP_WRITE_WORD);
+}
+#endif
+
 /*************************** Bootloader logic *********************************/
 
 // instructions needed to jump into the bootloader. Checked below
-BOOT_DATA static const uint32_t const bootloaderShim[BOOT_INSTRUCTION_COUNT] =
+BOOT_DATA static const uint32_t bootloaderShim[BOOT_INSTRUCTION_COUNT] =
 {0x3C1DA000, 0x37BD2000, 0x3C089D00, 0x25080000, 0x0100F809, 0x00000000};
 
 // Check the address for bootloader code that jumps into the
@@ -1385,15 +2597,15 @@ BOOT_CODE bool BootTestAssumptions()
      */
 
     // check entry address
-    if ((uint32_t)(&BootloaderEntry) != BOOT_LOGICAL_ADDRESS)
+    if ((uintptr_t)(&BootloaderEntry) != BOOT_LOGICAL_ADDRESS)
         return false;
 
     // check string addresses working
-    if ((uint32_t)bootloaderVersion < BOOT_LOGICAL_ADDRESS || (BOOT_LOGICAL_ADDRESS+BOOTLOADER_SIZE) < (uint32_t)bootloaderVersion)
+    if ((uintptr_t)bootloaderVersion < BOOT_LOGICAL_ADDRESS || (BOOT_LOGICAL_ADDRESS+BOOTLOADER_SIZE) < (uintptr_t)bootloaderVersion)
         return false;
 
     // test bootloaderShim, want in boot code
-    if ((uint32_t)bootloaderShim < BOOT_LOGICAL_ADDRESS || (BOOT_LOGICAL_ADDRESS+BOOTLOADER_SIZE) < (uint32_t)bootloaderShim)
+    if ((uintptr_t)bootloaderShim < BOOT_LOGICAL_ADDRESS || (BOOT_LOGICAL_ADDRESS+BOOTLOADER_SIZE) < (uintptr_t)bootloaderShim)
         return false;
 
     //// check boot code in place in crt0 at the reset vector
@@ -1401,9 +2613,15 @@ BOOT_CODE bool BootTestAssumptions()
         return false;
     
     // check ram address working
-    if ((uint32_t)&bootResult != BOOT_RESULT_VIRTUAL_ADDRESS)
+    if ((uintptr_t)&bootResult != BOOT_RESULT_VIRTUAL_ADDRESS)
         return false;
 
+#ifdef USE_HANDOFF
+    // the handoff word must not be application data
+    if (BOOT_RAM_SIZE < 8)
+        return false;
+#endif
+
     return true;
 }
 
@@ -1411,6 +2629,19 @@ BOOTSTRING(infoText00, "Bootloader Version    : ");
 BOOTSTRING(infoText01, "DEVID                 : ");
 BOOTSTRING(infoText02, "DEVID Ver             : ");
 BOOTSTRING(infoText03, "Bootloader size       : ");
+BOOTSTRING(infoText07, "Max packet size       : ");
+#ifdef USE_WRITE_WINDOW
+BOOTSTRING(infoText04, "Write window          : ");
+#endif
+
+#ifdef USE_BAUD_CHANGE
+BOOTSTRING(infoText05, "Baud rate             : ");
+#endif
+BOOTSTRING(infoText06, "Commands              : ");
+#ifdef USE_COMPRESSION
+BOOTSTRING(infoText08, "Compression           : ");
+BOOTSTRING(compressionText, "LZ77");
+#endif
 
 BOOTSTRING(flashText01,"Flasher detected      : ");
 BOOTSTRING(flashText02," ms.");
@@ -1425,8 +2656,49 @@ BOOT_CODE static void BootWriteVersion()
     ENDLINE();
 }
 
+// put the command letters understood in letters, so the flasher can tell
+// what is supported. return the count
+BOOT_CODE static int BootCommandLetters(uint8_t * letters)
+{
+    int count = 0;
+    letters[count++] = 'I';
+#ifdef USE_BINARY_MODE
+    letters[count++] = 'F';
+#endif
+    letters[count++] = 'C';
+    letters[count++] = 'M';
+#ifdef USE_BLANK_CHECK
+    letters[count++] = 'K';
+#endif
+    letters[count++] = 'E';
+    letters[count++] = 'P';
+#ifdef USE_LAZY_ERASE
+    letters[count++] = 'L';
+#endif
+#ifdef USE_JOURNAL
+    letters[count++] = 'J';
+    letters[count++] = 'U';
+#endif
+    letters[count++] = 'W';
+#ifdef USE_COUNTER_PACKETS
+    letters[count++] = 'A';
+#endif
+#ifdef USE_WRITE_WINDOW
+    letters[count++] = 'S';
+#endif
+#ifdef USE_BAUD_CHANGE
+    letters[count++] = 'R';
+#endif
+#ifdef USE_STATS
+    letters[count++] = 'T';
+#endif
+    letters[count++] = 'Q';
+    return count;
+}
+
 BOOT_CODE static void BootCommandInfo(Boot_t * bs)
 {
+    int i, count;
 
 #define DUMPHEX(txt,val) BootPrintSerial(txt); \
     BootPrintSerialHex(val); \
@@ -1444,6 +2716,25 @@ BOOT_CODE static void BootCommandInfo(Boot_t * bs)
     DUMPHEX(infoText01, DEVIDbits.DEVID);
     DUMPHEX(infoText02, DEVIDbits.VER);
     DUMPHEX(infoText03, BOOTLOADER_SIZE);
+    DUMPINT(infoText07, MAX_PACKET_SIZE);
+#ifdef USE_WRITE_WINDOW
+    DUMPINT(infoText04, WRITE_WINDOW_SIZE);
+#endif
+#ifdef USE_BAUD_CHANGE
+    DUMPINT(infoText05, SYS_CLOCK/(4*(U1BRG+1)));
+#endif
+#ifdef USE_COMPRESSION
+    BootPrintSerial(infoText08);
+    BootPrintSerial(compressionText);
+    ENDLINE();
+#endif
+
+    // command letters understood, so the flasher can tell what is supported
+    BootPrintSerial(infoText06);
+    count = BootCommandLetters(bs->buffer);
+    for (i = 0; i < count; ++i)
+        WRITE(bs->buffer[i]);
+    ENDLINE();
 
 
 #ifdef DEBUG_BOOTLOADER
@@ -1462,9 +2753,9 @@ BOOT_CODE static void BootCommandInfo(Boot_t * bs)
     DUMPINT("BOOT struct size      : ", sizeof(Boot_t));
 
     // addresses
-    DUMPHEX("Bootloader address    : ",(uint32_t)(&BootloaderEntry));
+    DUMPHEX("Bootloader address    : ",(uintptr_t)(&BootloaderEntry));
     // DUMPHEX("String address        : ",(uint32_t)BOOTLOADER_VERSION);
-    DUMPHEX("Boot result address   : ",(uint32_t)&bootResult);
+    DUMPHEX("Boot result address   : ",(uintptr_t)&bootResult);
 
     // some memory dump to help debugging
     // BootPrintMemory("Mem at 0x9D00 2000: ", 0x9D002000, 8*16);
@@ -1474,6 +2765,11 @@ BOOT_CODE static void BootCommandInfo(Boot_t * bs)
 #undef DUMPHEX // clean up
 #undef DUMPINT
 
+#ifdef USE_BINARY_MODE
+    // someone reading text, so keep to text
+    bs->binaryMode = false;
+#endif
+
     // final ack to denote finised
     ACK(ACK_OK);
     
@@ -1519,9 +2815,208 @@ BOOT_CODE static bool BootModifyAddressesAllowed(uint32_t address, uint32_t leng
         return false; // would overwrite configuration bits
     }
 
+#ifdef USE_JOURNAL
+    // protect the journal page, only written by the journal code
+    if (BootOverlap(
+            address, address+length,
+            JOURNAL_START, JOURNAL_START+FLASH_PAGE_SIZE) != 0
+            )
+    {
+        ERROR('J');
+        return false; // would overwrite the journal
+    }
+#endif
+
+    return true;
+}
+
+
+#if defined(USE_BLANK_CHECK) || defined(USE_FAST_BOOT) || defined(USE_JOURNAL)
+// return true if the page at the physical address reads all 0xFF.
+// Reads words uncached, and stops at the first programmed word
+BOOT_CODE static bool BootPageBlank(uint32_t physicalAddress)
+{
+    const uint32_t * flash = (const uint32_t *)(uintptr_t)PHYSICAL_TO_LOGICAL_ADDRESS(physicalAddress);
+    uint32_t words = FLASH_PAGE_SIZE/4;
+    while (words > 0)
+    {
+        if (*flash++ != 0xFFFFFFFF)
+            return false;
+        words--;
+    }
     return true;
 }
+#endif
+
+#ifdef USE_JOURNAL
+/*
+ * The journal page at JOURNAL_START records how far a flash got:
+ * word 0    : JOURNAL_MAGIC, written after the session ID
+ * word 1    : session ID from the 'J' command before the erase
+ * words 2-3 : the crypto IV, once the IV packet is committed
+ * then two word records. A count record is appended each time more packets
+ * are committed:
+ * word 0    : count of write packets all committed since the erase, with
+ *             JOURNAL_BOOT_PAGE set if the BOOT_START page was erased by then
+ * word 1    : crypto block counter the next packet starts at
+ * and a range record before each packet not yet committed is programmed:
+ * word 0    : physical address of the packet writes, with JOURNAL_RANGE set
+ * word 1    : length of the packet writes in bytes
+ * The last count record is the one that counts, and the range records after
+ * it are the writes a resume must undo. A resume erases pages to undo them,
+ * so first appends an undo record, JOURNAL_UNDO then 0, and when done the
+ * count record again. An undo record left last means a reset came while a
+ * page was erased, losing committed words, so the journal counts nothing.
+ * A record cut short by a reset is skipped. A full page is erased and begun
+ * again with the header and the newest count record, and the page is erased
+ * once the last packet is seen.
+ */
+#define JOURNAL_MAGIC       0x48434A4E // "HCJN"
+#define JOURNAL_HEADER_SIZE 16
+#define JOURNAL_BOOT_PAGE   0x80000000
+#define JOURNAL_RANGE       0x40000000
+#define JOURNAL_UNDO        0x20000000
+
+// the journal page words, read uncached
+#define JOURNAL ((const uint32_t *)PHYSICAL_TO_LOGICAL_ADDRESS(JOURNAL_START))
+
+// erase the journal page and write the header for sessionId
+// return true on success
+BOOT_CODE static bool BootJournalHeader(Boot_t * bs)
+{
+    if (!BootPageBlank(JOURNAL_START) && !BootNVMemErasePage(bs, JOURNAL_START))
+        return false;
+    bs->journalFree = JOURNAL_HEADER_SIZE;
+    return BootNVMemWriteWord(bs, JOURNAL_START + 4, bs->sessionId) &&
+        BootNVMemWriteWord(bs, JOURNAL_START, JOURNAL_MAGIC);
+}
+
+// start journaling the writes after an erase, if journaled is set and a 'J'
+// command named the session, else clear any old journal. If the journal
+// cannot be written the flash goes on without it
+BOOT_CODE static void BootJournalStart(Boot_t * bs, bool journaled)
+{
+    bs->journalOn = false;
+    bs->journalCount = 0;
+    bs->journalAcked = 0;
+    bs->journalRecord[0] = 0xFFFFFFFF;
+    if (journaled && bs->sessionSet)
+        bs->journalOn = BootJournalHeader(bs);
+    else if (!BootPageBlank(JOURNAL_START))
+        BootNVMemErasePage(bs, JOURNAL_START);
+
+    // each erase needs the session named again
+    bs->sessionSet = false;
+}
+
+// return the newest count record of the journal for the session named by
+// 'J', and set journalFree after the last record. return 0 if there is none,
+// or if an undo after it was cut short
+BOOT_CODE static const uint32_t * BootJournalLast(Boot_t * bs)
+{
+    const uint32_t * record = 0;
+    if (!bs->sessionSet || JOURNAL[0] != JOURNAL_MAGIC || JOURNAL[1] != bs->sessionId)
+        return 0;
+    for (bs->journalFree = JOURNAL_HEADER_SIZE;
+         bs->journalFree < FLASH_PAGE_SIZE && JOURNAL[bs->journalFree/4] != 0xFFFFFFFF;
+         bs->journalFree += 8)
+    {
+        if (JOURNAL[bs->journalFree/4 + 1] == 0xFFFFFFFF ||
+            (JOURNAL[bs->journalFree/4] & JOURNAL_RANGE) != 0)
+            continue;
+        if ((JOURNAL[bs->journalFree/4] & JOURNAL_UNDO) != 0)
+            record = 0;
+        else
+            record = JOURNAL + bs->journalFree/4;
+    }
+    return record;
+}
+
+// write a two word record at journalFree and move past it
+// return true on success
+BOOT_CODE static bool BootJournalWrite(Boot_t * bs, uint32_t word0, uint32_t word1)
+{
+    bs->journalFree += 8;
+    return BootNVMemWriteWord(bs, JOURNAL_START + bs->journalFree - 8, word0) &&
+        BootNVMemWriteWord(bs, JOURNAL_START + bs->journalFree - 4, word1);
+}
+
+// append a record, starting the page over with the header and the newest
+// count record when it is full. Range records of packets committed ahead of
+// a missing one would be lost then, so journaling stops instead, as it does
+// if the page cannot be written, the older records still being true
+BOOT_CODE static void BootJournalAppend(Boot_t * bs, uint32_t word0, uint32_t word1)
+{
+    uint32_t iv0 = JOURNAL[2], iv1 = JOURNAL[3];
+    if (bs->journalOn && bs->journalFree >= FLASH_PAGE_SIZE)
+    {
+        bs->journalOn = bs->journalAcked == 0 && BootJournalHeader(bs) &&
+            (iv0 == 0xFFFFFFFF ||
+             (BootNVMemWriteWord(bs, JOURNAL_START + 8, iv0) &&
+              BootNVMemWriteWord(bs, JOURNAL_START + 12, iv1))) &&
+            (bs->journalRecord[0] == 0xFFFFFFFF ||
+             BootJournalWrite(bs, bs->journalRecord[0], bs->journalRecord[1]));
+    }
+    if (bs->journalOn)
+        bs->journalOn = BootJournalWrite(bs, word0, word1);
+}
+
+// journal the range of the write packet about to be programmed, unless it
+// is already committed, so a resume can undo it if it is not
+BOOT_CODE static void BootJournalRange(Boot_t * bs)
+{
+    if (bs->journalOn && bs->packetCounter > bs->journalCount)
+        BootJournalAppend(bs, bs->writeAddress | JOURNAL_RANGE, bs->writeSize);
+}
+
+// journal a write packet reply. Only packets committed in order move the
+// count on, those ahead of a failed one waiting in journalAcked for its resend
+BOOT_CODE static void BootJournalPacket(Boot_t * bs, uint8_t reply)
+{
+    // packets between the journaled ones and this one, wraps if behind
+    uint32_t ahead = bs->packetCounter - bs->journalCount - 1, counter = 0;
+    if (!bs->journalOn || reply != ACK_OK || ahead >= 32)
+        return;
+
+#ifdef USE_CRYPTO
+    // the IV is still at the start of the buffer
+    if (bs->packetCounter == 1)
+    {
+        bs->journalOn =
+            BootNVMemWriteWord(bs, JOURNAL_START + 8, BootCryptoPack(bs->buffer, 0)) &&
+            BootNVMemWriteWord(bs, JOURNAL_START + 12, BootCryptoPack(bs->buffer, 4));
+        if (!bs->journalOn)
+            return;
+    }
+#endif
+
+    bs->journalAcked |= 1U<<ahead;
+    if ((bs->journalAcked & 1) == 0)
+        return; // an earlier packet is still missing
+    while ((bs->journalAcked & 1) != 0)
+    {
+        bs->journalAcked >>= 1;
+        bs->journalCount++;
+    }
+
+#ifdef USE_CRYPTO
+    // keystream position of the packet after the committed ones
+    counter = bs->crypto.state[12];
+#ifdef USE_WRITE_WINDOW
+    if (bs->journalCount < bs->nextSequence)
+    { // that packet came already, but failed
+        if (bs->nextSequence - bs->journalCount > WRITE_WINDOW_SIZE)
+            return; // and can no longer be resent, so its position is gone
+        counter = bs->windowCounter[(bs->journalCount + 1) % WRITE_WINDOW_SIZE];
+    }
+#endif
+#endif
 
+    bs->journalRecord[0] = bs->journalCount | (bs->bootPageErased ? JOURNAL_BOOT_PAGE : 0);
+    bs->journalRecord[1] = counter;
+    BootJournalAppend(bs, bs->journalRecord[0], bs->journalRecord[1]);
+}
+#endif
 
 // erase the range of pages stored in
 // boot struct writeAddress of writeSize length
@@ -1540,6 +3035,9 @@ BOOT_CODE static void BootEraseHelper(Boot_t * bs)
 #else
 #endif
 
+#ifdef USE_BINARY_MODE
+        if (!bs->binaryMode)
+#endif
         BootPrintSerialHex(bs->curAddress);
 
         // do not erase bootloader addresses - just skip them
@@ -1548,7 +3046,14 @@ BOOT_CODE static void BootEraseHelper(Boot_t * bs)
         // written, in order to protect the bootloader path
         if (BootModifyAddressesAllowed(bs->curAddress,FLASH_PAGE_SIZE) && bs->curAddress != BOOT_START)
         {
-
+#ifdef USE_BLANK_CHECK
+            if (BootPageBlank(bs->curAddress))
+            { // nothing to erase
+                // allows progress bar
+                ACK(ACK_PAGE_ERASED);
+            }
+            else
+#endif
             if (BootNVMemErasePage(bs,bs->curAddress))
             { // success
                 // allows progress bar
@@ -1584,6 +3089,61 @@ BOOT_CODE static void BootEraseHelper(Boot_t * bs)
 
 } // BootCommandErase
 
+// start an erase, clearing the counts and forgetting any writes done
+BOOT_CODE static void BootEraseStart(Boot_t * bs)
+{
+#ifdef USE_STATS
+    BootStatReset(bs);
+#endif
+
+    bs->pageEraseAttemptCount = 0; // track for stats
+    bs->pageEraseFailureCount = 0; // count failures
+
+    bs->packetCounter = 0;
+    bs->writesFinished = false;
+    bs->bootPageErased = false;
+#ifdef USE_WRITE_WINDOW
+    bs->nextSequence = 0;
+#endif
+#ifdef USE_COUNTER_PACKETS
+    bs->counterPacket = 0;
+#endif
+#ifdef USE_LAZY_ERASE
+    bs->lazyErase = false;
+#endif
+}
+
+// finish an erase with the text and final ack the flasher waits for
+BOOT_CODE static void BootEraseFinish(Boot_t * bs)
+{
+    // needed done before writing is allowed
+    // todo - if ever set up so no errors on a correct erase, then
+    // make this only set to true during success
+    bs->flashErased = true;
+
+#ifdef USE_BINARY_MODE
+    if (bs->binaryMode)
+    { // no text, and ACK_ERASE_DONE always ends it, after any NACK
+        if (bs->pageEraseFailureCount != 0)
+            NACK(NACK_ERASE_FAILED);
+        ACK(ACK_ERASE_DONE);
+        return;
+    }
+#endif
+
+    BOOTSTRING(eraseText01,"Erase finished");
+    BootPrintSerial(eraseText01);
+    ENDLINE();
+
+    // one final ack or nack based on success
+    if (bs->pageEraseFailureCount != 0)
+        NACK(NACK_ERASE_FAILED); // send an error reply
+    else
+    {
+        ACK(ACK_ERASE_DONE);
+    }
+}
+
 // erase FLASH
 BOOT_CODE static void BootCommandErase(Boot_t * bs)
 {
@@ -1601,9 +3161,10 @@ BOOT_CODE static void BootCommandErase(Boot_t * bs)
     ENDLINE();
 #endif
 
-    bs->pageEraseAttemptCount = 0; // track for stats
-    bs->pageEraseFailureCount = 0; // count failures
-
+    BootEraseStart(bs);
+#ifdef USE_JOURNAL
+    BootJournalStart(bs, true);
+#endif
 
     // erase normal flash
     bs->writeAddress = FLASH_START;
@@ -1617,41 +3178,223 @@ BOOT_CODE static void BootCommandErase(Boot_t * bs)
     bs->writeSize    = BOOT_END - BOOT_START;
     BootEraseHelper(bs);
 
+    BootEraseFinish(bs);
+}
 
-    // needed done before writing is allowed
-    // todo - if ever set up so no errors on a correct erase, then
-    // make this only set to true during success
-    bs->flashErased = true;
+/*
+ * A page erase command has the following format
+ * byte  0           : 'P' (0x50) the page erase command.
+ * byte  1           : number of ranges N, 1 or more
+ * next 6N bytes     : N ranges, each a big endian 32-bit physical address
+ *                     of a page, then a big endian 16-bit count of pages
+ * last 4 bytes      : big endian CRC32K of bytes 1 through 6N
+ *
+ * Every range must lie inside program flash or boot flash. Pages are then
+ * erased as for 'E', with the same protection and replies. A bad list gets a
+ * single NACK and nothing is erased: NACK_PACKET_SIZE_TOO_LARGE for too many
+ * ranges, NACK_CRC_MISMATCH, NACK_WRITE_MISALIGNED_ERROR for a range not on
+ * a page boundary, or NACK_WRITE_OUT_OF_BOUNDS.
+ */
 
-    BOOTSTRING(eraseText01,"Erase finished");
-    BootPrintSerial(eraseText01);
-    ENDLINE();
+// check a range of whole pages lies inside program flash or boot flash
+// size is in bytes, at most 64M
+// return ACK_OK if so, else the NACK reason
+BOOT_CODE static uint32_t BootPageRangeCheck(uint32_t address, uint32_t size)
+{
+    if ((address & (FLASH_PAGE_SIZE-1)) != 0)
+    {
+        BootDebugPrintE("Range not page aligned");
+        return NACK_WRITE_MISALIGNED_ERROR;
+    }
 
-    // one final ack or nack based on success
-    if (bs->pageEraseFailureCount != 0)
-        NACK(NACK_ERASE_FAILED); // send an error reply
-    else
+    // sizes are at most 64M, so the sums cannot wrap
+    if (size == 0 || address > BOOT_END ||
+        !((FLASH_START <= address && address + size <= FLASH_END) ||
+          (BOOT_START  <= address && address + size <= BOOT_END))
+       )
     {
-        ACK(ACK_ERASE_DONE);
+        BootDebugPrintE("Range outside flash");
+        return NACK_WRITE_OUT_OF_BOUNDS;
     }
+    return ACK_OK;
 }
 
+// erase only the listed page ranges of FLASH
+BOOT_CODE static void BootCommandRangeErase(Boot_t * bs)
+{
+    // on entry, the 'P' command byte is already read...
 
-// write the data in bs fields: buffer, writeSize, writeAddress
-// return ACK_OK on success, else a NACK_ code for the error
-BOOT_CODE static uint32_t BootWriteFlash(Boot_t * bs)
+    // get the count byte
+    while (!BootUARTReadByte(bs, bs->buffer))
+    {
+        // do nothing
+    }
+
+    // ranges and CRC after the count
+    bs->readMax = 1 + 6*bs->buffer[0] + 4;
+    if (bs->buffer[0] == 0 || bs->readMax > BUFFER_SIZE)
+    {
+        BootDebugPrintE("Bad range count");
+        NACK(NACK_PACKET_SIZE_TOO_LARGE);
+        return;
+    }
+
+    bs->readPos = 1;
+    while (bs->readPos < bs->readMax)
+    {
+        if (BootUARTReadByte(bs, &(bs->buffer[bs->readPos])))
+            bs->readPos++;
+    }
+
+    bs->computedCrc = BootCrc32AddBytes(bs->buffer, bs->readMax - 4, 0);
+    BootReadBigEndian(&(bs->transmittedCrc), bs->buffer + bs->readMax - 4, 4);
+    if (bs->computedCrc != bs->transmittedCrc)
+    {
+        BootDebugPrintE("CRC mismatch");
+        NACK(NACK_CRC_MISMATCH);
+        return;
+    }
+
+    // check every range before erasing any
+    for (bs->readPos = 1; bs->readPos < bs->readMax - 4; bs->readPos += 6)
+    {
+        BootReadBigEndian(&(bs->writeAddress), bs->buffer + bs->readPos, 4);
+        BootReadBigEndian(&(bs->writeSize), bs->buffer + bs->readPos + 4, 2);
+        bs->writeSize *= FLASH_PAGE_SIZE;
+
+        bs->flashWriteResult = BootPageRangeCheck(bs->writeAddress, bs->writeSize);
+        if (bs->flashWriteResult != ACK_OK)
+        {
+            NACK(bs->flashWriteResult);
+            return;
+        }
+    }
+
+    BootDebugPrintE("Erasing ranges....");
+
+    BootEraseStart(bs);
+#ifdef USE_JOURNAL
+    BootJournalStart(bs, true);
+#endif
+
+    for (bs->readPos = 1; bs->readPos < bs->readMax - 4; bs->readPos += 6)
+    {
+        BootReadBigEndian(&(bs->writeAddress), bs->buffer + bs->readPos, 4);
+        BootReadBigEndian(&(bs->writeSize), bs->buffer + bs->readPos + 4, 2);
+        bs->writeSize *= FLASH_PAGE_SIZE;
+        // protected pages are skipped in here as for a full erase
+        BootEraseHelper(bs);
+    }
+
+    BootEraseFinish(bs);
+}
+
+#ifdef USE_LAZY_ERASE
+// erase any pages in writeAddress, writeSize not yet erased since the lazy
+// erase command. The BOOT_START page is left to its own handling
+// return ACK_OK on success, NACK_WRITE_OUT_OF_BOUNDS for a page outside
+// program flash and boot flash, else NACK_ERASE_FAILED
+BOOT_CODE static uint32_t BootLazyErase(Boot_t * bs)
 {
-    // check writing is allowed (required an erase first)
-    if (bs->flashErased == false)
+    uint32_t page;
+    for (bs->curAddress = bs->writeAddress & ~(FLASH_PAGE_SIZE-1);
+         bs->curAddress < bs->writeAddress + bs->writeSize;
+         bs->curAddress += FLASH_PAGE_SIZE)
     {
-        // failed, since erase not done
-        BootDebugPrintE("Write requires erase first");
-        return NACK_WRITE_WITHOUT_ERASE;
+        if (bs->curAddress == BOOT_START)
+            continue;
+
+        // bit for this page, checked to lie in the table before use
+        if (BootPageRangeCheck(bs->curAddress, FLASH_PAGE_SIZE) != ACK_OK)
+            return NACK_WRITE_OUT_OF_BOUNDS;
+        if (bs->curAddress < BOOT_START)
+            page = (bs->curAddress - FLASH_START)/FLASH_PAGE_SIZE;
+        else
+            page = (FLASH_SIZE + bs->curAddress - BOOT_START)/FLASH_PAGE_SIZE;
+        if (LAZY_ERASE_MAX_PAGES <= page)
+        {
+            BootDebugPrintE("Page outside lazy erase table");
+            return NACK_WRITE_OUT_OF_BOUNDS;
+        }
+
+        if ((bs->erasedPages[page/32] & (1U<<(page&31))) == 0)
+        {
+#ifdef USE_BLANK_CHECK
+            if (!BootPageBlank(bs->curAddress) && !BootNVMemErasePage(bs,bs->curAddress))
+#else
+            if (!BootNVMemErasePage(bs,bs->curAddress))
+#endif
+            {
+                BootDebugPrintE("Lazy erase failed");
+                return NACK_ERASE_FAILED;
+            }
+            bs->erasedPages[page/32] |= 1U<<(page&31);
+        }
+    }
+    return ACK_OK;
+}
+
+// mark all pages not yet erased, for BootWriteFlash to erase each page the
+// first time it is written
+BOOT_CODE static void BootLazyEraseStart(Boot_t * bs)
+{
+    for (bs->readPos = 0; bs->readPos < LAZY_ERASE_MAX_PAGES/32; ++bs->readPos)
+        bs->erasedPages[bs->readPos] = 0;
+    bs->lazyErase = true;
+
+#ifdef USE_JOURNAL
+    // which pages were erased is lost with the link, so nothing to resume
+    BootJournalStart(bs, false);
+#endif
+
+#ifdef USE_FAST_BOOT
+    // a blank first application page keeps the listen window open, so clear
+    // it now in case this flash is interrupted
+    bs->writeAddress = FLASH_START + BOOTLOADER_SIZE;
+    bs->writeSize = FLASH_PAGE_SIZE;
+    if (BootLazyErase(bs) != ACK_OK)
+        bs->pageEraseFailureCount++;
+#endif
+}
+
+// start lazy erasing, where BootWriteFlash erases each page the first
+// time it is written. Replies as a full erase would, without the page replies
+BOOT_CODE static void BootCommandLazyErase(Boot_t * bs)
+{
+    if (LAZY_ERASE_MAX_PAGES < (FLASH_SIZE+BOOT_SIZE)/FLASH_PAGE_SIZE)
+    {
+        BootDebugPrintE("Too many pages for lazy erase");
+        NACK(NACK_ERASE_FAILED);
+        return;
+    }
+
+    BootEraseStart(bs);
+    BootLazyEraseStart(bs);
+    BootEraseFinish(bs);
+}
+#endif
+
+// compare the words at the physical flash address with the buffer words,
+// reading flash uncached. return true if all match
+BOOT_CODE static bool BootFlashMatches(uint32_t physicalAddress, const uint32_t * data, uint32_t words)
+{
+    const uint32_t * flash = (const uint32_t *)(uintptr_t)PHYSICAL_TO_LOGICAL_ADDRESS(physicalAddress);
+    while (words > 0)
+    {
+        if (*flash++ != *data++)
+            return false;
+        words--;
     }
+    return true;
+}
 
-    // check length (must be page length? or multiple?)
-    // only allow at most one page for now
-    if (FLASH_PAGE_SIZE < bs->writeSize || bs->writeSize <= 0 || (bs->writeSize&3)!=0)
+// check the write in bs fields writeSize, writeAddress may be done, without
+// touching flash. The BOOT_START page has further checks in BootWriteFlash
+// return ACK_OK if so, else a NACK_ code for the error
+BOOT_CODE static uint32_t BootWriteCheck(Boot_t * bs)
+{
+    // check length, at most the packet size given in the info
+    if (MAX_PACKET_SIZE < bs->writeSize || bs->writeSize <= 0 || (bs->writeSize&3)!=0)
     {
         // failed, too large write
         BootDebugPrintE("Write too large or zero or not multiple of 4");
@@ -1680,6 +3423,51 @@ BOOT_CODE static uint32_t BootWriteFlash(Boot_t * bs)
         return NACK_WRITE_OUT_OF_BOUNDS;
     }
 
+#ifdef USE_STAGING
+    // a staged image may not write over its own stream, nor boot flash,
+    // where power lost mid copy could leave no way into the bootloader
+    if (bs->stagedRead != 0 && (FLASH_END < bs->writeAddress + bs->writeSize ||
+        BootOverlap(bs->writeAddress, bs->writeAddress + bs->writeSize,
+        STAGING_START, STAGING_START + STAGING_SIZE) > 0))
+    {
+        BootDebugPrintE("Staged write outside application flash");
+        return NACK_WRITE_OUT_OF_BOUNDS;
+    }
+#endif
+
+    // do not overwrite cfg - requires special writing mode - can do if careful
+    // currently redundant, but left in for future error catching
+    if (
+        BootOverlap(bs->writeAddress, bs->writeAddress + bs->writeSize,
+        CONFIGURATION_START, CONFIGURATION_END) > 0)
+    {
+        // failed, overwriting configuration bits
+        BootDebugPrintE("Cannot write over configuration");
+        return NACK_WRITE_OVER_CONFIGURATION;
+    }
+    return ACK_OK;
+}
+
+// write the data in bs fields: buffer, writeSize, writeAddress
+// each row or word is compared with the buffer right after it is programmed,
+// and programmed again up to WRITE_RETY_MAX times if it does not match
+// return ACK_OK on success, else a NACK_ code for the error
+BOOT_CODE static uint32_t BootWriteFlash(Boot_t * bs)
+{
+    bool programmed;
+
+    // check writing is allowed (required an erase first)
+    if (bs->flashErased == false)
+    {
+        // failed, since erase not done
+        BootDebugPrintE("Write requires erase first");
+        return NACK_WRITE_WITHOUT_ERASE;
+    }
+
+    bs->flashWriteResult = BootWriteCheck(bs);
+    if (bs->flashWriteResult != ACK_OK)
+        return bs->flashWriteResult;
+
     // special BOOT_START page handling
     // if the address is the start of the boot page, and the write contains
     // code to jump into the bootloader, erase the page.
@@ -1699,71 +3487,117 @@ BOOT_CODE static uint32_t BootWriteFlash(Boot_t * bs)
         // Check the address for bootloader code that jumps into the
         // BootloaderEntry. This is used before overwriting the BOOT FLASH
         // to ensure it looks like the bootloader will be called
-        if (!BootDetectBootloaderShim((uint32_t*)&(bs->buffer)))
+        if (!BootDetectBootloaderShim((uint32_t*)(bs->buffer)))
         {
             // failed, does not contain the bootloader header needed
             BootDebugPrintE("Bootloader shim missing");
             return NACK_WRITE_BOOT_MISSING;
         }
 
-        if (!BootNVMemErasePage(bs,bs->writeAddress))
-        { // failure to erase page
-            // failed, erase no good
-            BootDebugPrintE("Bootloader erase failed!");
-            return NACK_ERASE_FAILED;
+        // a resent packet must not erase boot page writes that followed it
+        if (!bs->bootPageErased)
+        {
+            if (!BootNVMemErasePage(bs,bs->writeAddress))
+            { // failure to erase page
+                // failed, erase no good
+                BootDebugPrintE("Bootloader erase failed!");
+                return NACK_ERASE_FAILED;
+            }
+            bs->bootPageErased = true;
         }
     }
-
-    // do not overwrite cfg - requires special writing mode - can do if careful
-    // currently redundant, but left in for future error catching
-    if (
+    else if (!bs->bootPageErased &&
         BootOverlap(bs->writeAddress, bs->writeAddress + bs->writeSize,
-        CONFIGURATION_START, CONFIGURATION_END) > 0)
+        BOOT_START, BOOT_START + FLASH_PAGE_SIZE) > 0)
     {
-        // failed, overwriting configuration bits
-        BootDebugPrintE("Cannot write over configuration");
-        return NACK_WRITE_OVER_CONFIGURATION;
+        // the rest of the BOOT_START page can only be written after the
+        // packet at BOOT_START erased it, else the erase would wipe it. The
+        // flasher sends that packet first, or resends these after it
+        BootDebugPrintE("Boot page not erased yet");
+        return NACK_WRITE_BOOT_MISSING;
+    }
+
+#ifdef USE_JOURNAL
+    BootJournalRange(bs);
+#endif
+
+#ifdef USE_LAZY_ERASE
+    // all checks passed, so the pages may be erased
+    if (bs->lazyErase)
+    {
+        bs->flashWriteResult = BootLazyErase(bs);
+        if (bs->flashWriteResult != ACK_OK)
+            return bs->flashWriteResult;
     }
+#endif
 
     // write FLASH loop
+    STAT_EVENT(bs, EVENT_PROGRAM, bs->writeAddress);
 
     // address to write
     bs->curAddress = bs->writeAddress;
     bs->writeFailureCount = 0;
+    bs->flashWriteResult = ACK_OK;
+#ifdef USE_WRITE_WINDOW
+    bs->readbackCrc = 0;
+#endif
     while (bs->curAddress < bs->writeAddress + bs->writeSize)
-    { // write largest chunk possible        
+    { // write largest chunk possible, in bytes in readPos
+        bs->readPos = 4;
         if (((bs->curAddress & (FLASH_ROW_SIZE-1))==0) && (FLASH_ROW_SIZE <= bs->writeAddress + bs->writeSize - bs->curAddress))
-        { // row aligned and long enough
-            //BootUARTWriteByte('R');
+            bs->readPos = FLASH_ROW_SIZE; // row aligned and long enough
 
-            if (BootNVMemWriteRow(bs,
-                bs->curAddress,
-                (uint32_t*)(LOGICAL_TO_PHYSICAL_ADDRESS(((uint32_t)(bs->buffer + (bs->curAddress - bs->writeAddress)))))
-                ) == false)
+        for (bs->writeRetryCounter = 0; bs->writeRetryCounter < WRITE_RETY_MAX; ++bs->writeRetryCounter)
+        {
+            if (bs->writeRetryCounter != 0)
+                STAT_COUNT(bs, COUNT_RETRIES);
+            if (bs->readPos == FLASH_ROW_SIZE)
+                programmed = BootNVMemWriteRow(bs,
+                    bs->curAddress,
+                    (uint32_t*)(LOGICAL_TO_PHYSICAL_ADDRESS(((uintptr_t)(bs->buffer + (bs->curAddress - bs->writeAddress)))))
+                    );
+            else
+                programmed = BootNVMemWriteWord(bs,bs->curAddress,
+                    *((uint32_t*)(bs->buffer + bs->curAddress - bs->writeAddress))
+                    );
+            if (!programmed)
             {
                 ERROR('-');
-                bs->writeFailureCount++;
+                bs->flashWriteResult = NACK_WRITES_FAILED;
+                continue;
             }
-            bs->curAddress  += FLASH_ROW_SIZE;
-        }
-        else
-        { // long enough for word write
-            // BootUARTWriteByte('W');
-            if (BootNVMemWriteWord(bs,bs->curAddress,
-                    *((uint32_t*)(bs->buffer + bs->curAddress - bs->writeAddress))
-                    ) == false)
+
+            STAT_START(bs, STAT_VERIFY);
+            programmed = BootFlashMatches(bs->curAddress,
+                (uint32_t*)(bs->buffer + bs->curAddress - bs->writeAddress),
+                bs->readPos/4);
+            STAT_STOP(bs, STAT_VERIFY);
+            if (!programmed)
             {
-                ERROR('-');
-                bs->writeFailureCount++;
+                BootDebugPrintE("Compare flash to buffer failed");
+                bs->flashWriteResult = NACK_COMPARE_FAILED;
+            }
+            else
+            {
+                bs->flashWriteResult = ACK_OK;
+                break;
             }
-            bs->curAddress  += 4;
         }
-    }
+        if (bs->flashWriteResult != ACK_OK)
+        {
+            BootDebugPrintE("Writes failed");
+            bs->writeFailureCount++;
+            return bs->flashWriteResult;
+        }
 
-    if (bs->writeFailureCount != 0)
-    {
-        BootDebugPrintE("Writes failed");
-        return NACK_WRITES_FAILED;
+#ifdef USE_WRITE_WINDOW
+        STAT_START(bs, STAT_CRC);
+        bs->readbackCrc = BootCrc32AddBytes(
+            (const uint8_t *)(uintptr_t)PHYSICAL_TO_LOGICAL_ADDRESS(bs->curAddress),
+            bs->readPos, bs->readbackCrc);
+        STAT_STOP(bs, STAT_CRC);
+#endif
+        bs->curAddress += bs->readPos;
     }
 
     return ACK_OK; // success
@@ -1802,259 +3636,1418 @@ BOOT_CODE static uint32_t BootWriteFlash(Boot_t * bs)
  * bytes (P-4)-(P-1)  : 4 byte CRC32K of unencrypted data and address and length
  * A packet with payload length 0 (no address, no CRC, nothing) marks the end of
  * the packets.
+ *
+ * If the info lists compression, a set top bit in the 16-bit length marks a
+ * compressed payload, the low 15 bits being P. The P-10 data bytes are then
+ * an LZ77 stream expanding to the L bytes to write, see BootDecompress. The
+ * CRC is over the payload as sent, and encryption is of the compressed
+ * payload. The stream must expand in place in a buffer of the max packet size
+ * plus 10 bytes. One that does not, or is malformed, or does not expand to L
+ * bytes gets NACK_WRITE_SIZE_ERROR.
+ *
+ * Each row or word is checked against the packet right after programming,
+ * and only a row that does not match is programmed again. Each 'W' block gets
+ * one reply, ACK_OK or the NACK reason.
+ *
+ * Sequenced write blocks, used when the flasher keeps several packets in
+ * flight, have one extra byte:
+ * byte  0           : 'S' (0x53) the sequenced write command.
+ * byte  1           : 8-bit sequence number, 0 for the first packet after an
+ *                     erase and one more for each following packet.
+ * bytes 2-3         : big endian 16-bit unsigned payload length P
+ * bytes 4-(P+3)     : P bytes of payload, exactly as above.
+ *
+ * Each 'S' block gets one reply, ACK_OK or a NACK reason, followed by the
+ * sequence number. ACK_OK is then followed by the big endian CRC32K of the L
+ * bytes read back from flash, or 0 when nothing was written, so the flasher
+ * can check unencrypted data itself. New packets must arrive in order. A packet up to
+ * WRITE_WINDOW_SIZE behind the newest one is a resend of a failed packet, and
+ * is decrypted from the keystream position it had the first time. Any other
+ * sequence number gets NACK_SEQUENCE_ERROR.
+ *
+ * Addressed write blocks, for encrypted images, carry the crypto block counter
+ * the payload was encrypted at:
+ * byte  0           : 'A' (0x41) the addressed write command.
+ * bytes 1-4         : big endian 32-bit crypto block counter C.
+ * bytes 5-6         : big endian 16-bit unsigned payload length P
+ * bytes 7-(P+6)     : P bytes of payload, exactly as above.
+ *
+ * Each payload is encrypted from the start of a 64 byte keystream block, so C
+ * is the count of keystream blocks used by the packets before it, 0 for the
+ * first one after the IV packet. Decryption starts at C, and carries on from
+ * the end of the packet, so 'A' and 'W' packets can be mixed. A failed 'A'
+ * packet can be sent again right away, keeping its place in the journal. The
+ * IV packet must still come first as a 'W' packet, and an 'A' packet before
+ * it gets NACK_SEQUENCE_ERROR. Other replies are as for 'W'. Not mixed with
+ * 'S' packets.
+ *
+ * A write packet whose bytes stop for RECEIVE_BYTE_MS, or that takes longer
+ * than RECEIVE_PACKET_MS in all, times out. The bootloader drops bytes until
+ * the line has been quiet for RECEIVE_BYTE_MS, then replies
+ * NACK_RECEIVE_TIMEOUT and the big endian 16-bit count of bytes it read after
+ * the command byte, with no sequence number even for 'S' packets. The packet
+ * is forgotten, so it, and any 'S' packets sent after it, can go again at
+ * once. A flasher unsure of where the bootloader is resynchronizes the same
+ * way: it stops sending until every packet sent has a reply, since a packet
+ * cut short ends in this NACK with the bootloader waiting for a command.
  * */
 
-// write incoming flash packet
-BOOT_CODE static void BootCommandWrite(Boot_t * bs)
+// send the outcome of a write packet. Sequenced packets follow the ACK or
+// NACK with their sequence number so the flasher can match them up, and an
+// ACK_OK with the readback CRC
+BOOT_CODE static void BootWriteReply(Boot_t * bs, bool sequenced, uint8_t reply)
 {
-    // on entry, the 'W' command byte is already read...
-
-    // get two length bytes
-    bs->readPos = 0;
-    while (bs->readPos < 2)
+    STAT_EVENT(bs, EVENT_PACKET_END, reply);
+#ifdef USE_STATS
+    if ((reply & 0xF0) == 0xE0)
+        bs->statCounts[COUNT_NACKS]++;
+#endif
+#ifdef USE_STAGING
+    bs->stagedReply = reply;
+    if (bs->stagedRead != 0)
+        return; // copying a staged image, nobody to reply to
+#endif
+    BootUARTWriteByte(reply);
+#ifdef USE_WRITE_WINDOW
+    if (sequenced)
     {
-        if (BootUARTReadByte(&bs->buffer[bs->readPos]))
-            bs->readPos++;
+        WRITE(bs->sequenceNumber);
+        if (reply == ACK_OK)
+        {
+            WRITE((uint8_t)(bs->readbackCrc>>24));
+            WRITE((uint8_t)(bs->readbackCrc>>16));
+            WRITE((uint8_t)(bs->readbackCrc>>8));
+            WRITE((uint8_t)(bs->readbackCrc));
+        }
     }
+#endif
+#ifdef USE_JOURNAL
+    BootJournalPacket(bs, reply);
+#endif
+}
 
-    // compute length of payload and reset the counter
-    bs->readMax = 256*bs->buffer[0] + bs->buffer[1];
-    bs->readPos = 0;  // start back at buffer start
+#ifdef USE_WRITE_WINDOW
+// place the 'S' packet just read into the packet sequence, setting the
+// packetCounter it would have had as a 'W' packet
+// return ACK_OK if it is in the window, else NACK_SEQUENCE_ERROR
+BOOT_CODE static uint32_t BootWindowPacket(Boot_t * bs)
+{
+    // how far behind the next new packet this one is
+    uint32_t behind = (uint8_t)(bs->nextSequence - bs->sequenceNumber);
+
+    if (behind == 0)
+    { // the next new packet
+        bs->retransmission = false;
+        bs->nextSequence++;
+        bs->packetCounter = bs->nextSequence;
+#ifdef USE_CRYPTO
+        bs->windowCounter[bs->packetCounter % WRITE_WINDOW_SIZE] = bs->crypto.state[12];
+#endif
+        return ACK_OK;
+    }
 
-    // check size
-    if (bs->readMax >= BUFFER_SIZE)
+    if (behind <= WRITE_WINDOW_SIZE && behind <= bs->nextSequence)
+    { // resend of one of the last few packets
+        bs->retransmission = true;
+        bs->packetCounter = bs->nextSequence - behind + 1;
+        return ACK_OK;
+    }
+
+    BootDebugPrintE("Sequence outside window");
+    return NACK_SEQUENCE_ERROR;
+}
+#endif
+
+#ifdef USE_COUNTER_PACKETS
+// place the 'A' packet just read, with its crypto block counter in
+// writeAddress, and move the keystream there. The same counter as the packet
+// before, if that was an 'A' packet, is it sent again, and it keeps its
+// packetCounter so the journal stays in step
+// return ACK_OK, or NACK_SEQUENCE_ERROR if the IV packet has not come
+BOOT_CODE static uint32_t BootCounterPacket(Boot_t * bs)
+{
+    if (bs->packetCounter == 0)
     {
-        BootDebugPrintE("Packet length larger than buffer");
-        NACK(NACK_PACKET_SIZE_TOO_LARGE);
-        return;
+        BootDebugPrintE("Addressed packet before IV");
+        return NACK_SEQUENCE_ERROR;
     }
+    if (bs->counterPacket != bs->packetCounter || bs->packetBlockCounter != bs->writeAddress)
+    { // a new packet
+        bs->packetCounter++;
+        bs->counterPacket = bs->packetCounter;
+        bs->packetBlockCounter = bs->writeAddress;
+    }
+    bs->crypto.state[12] = bs->packetBlockCounter;
+    bs->crypto.state[13] = 0;
+    return ACK_OK;
+}
+#endif
 
-    // see if was last packet
-    if (bs->readMax == 0)
+#ifdef USE_RECEIVE_TIMEOUT
+// start timing a write packet, and note its placement to put back if it
+// times out
+BOOT_CODE static void BootReceiveStart(Boot_t * bs)
+{
+    BootStartTimer(&(bs->timeoutTimerMs), TICKS_PER_MILLISECOND);
+    BootStartTimer(&(bs->byteTimerMs), TICKS_PER_MILLISECOND);
+    bs->receiveTimeout = false;
+    bs->receivedCount = 0;
+    bs->savedPacketCounter = bs->packetCounter;
+#ifdef USE_WRITE_WINDOW
+    bs->savedSequence = bs->nextSequence;
+#endif
+#ifdef USE_CRYPTO
+    bs->savedBlockCounter = bs->crypto.state[12];
+#endif
+}
+
+// read byte of the current write packet if one is ready, as BootUARTReadByte.
+// Sets receiveTimeout once none has come for RECEIVE_BYTE_MS, or the packet
+// has taken RECEIVE_PACKET_MS
+BOOT_CODE static bool BootReadPacketByte(Boot_t * bs, uint8_t * byte)
+{
+    if (BootUARTReadByte(bs, byte))
     {
-        BootDebugPrintE("Last packet seen");
-        bs->writesFinished = true;
-        // final
-        ACK(ACK_OK);        
-        return;
+        bs->receivedCount++;
+        BootStartTimer(&(bs->byteTimerMs), TICKS_PER_MILLISECOND);
+        return true;
     }
+    if (BootUpdateTimer(&(bs->byteTimerMs)) >= RECEIVE_BYTE_MS ||
+        BootUpdateTimer(&(bs->timeoutTimerMs)) >= RECEIVE_PACKET_MS)
+        bs->receiveTimeout = true;
+    return false;
+}
 
-    // read rest of packet
-    while (bs->readPos < bs->readMax)
+// the current write packet timed out. Put back its placement, drop bytes
+// until the line is quiet so the next command starts clean, and send
+// NACK_RECEIVE_TIMEOUT with the count of bytes read
+BOOT_CODE static void BootReceiveResync(Boot_t * bs)
+{
+    BootDebugPrintE("Receive timeout");
+    bs->packetCounter = bs->savedPacketCounter;
+#ifdef USE_WRITE_WINDOW
+    bs->nextSequence = bs->savedSequence;
+#endif
+#ifdef USE_CRYPTO
+    bs->crypto.state[12] = bs->savedBlockCounter;
+#endif
+#if defined(USE_RX_DMA) || defined(USE_RAM_NVM)
+    bs->rxOverflow = false; // the packet is answered here
+#endif
+
+    BootStartTimer(&(bs->byteTimerMs), TICKS_PER_MILLISECOND);
+    while (BootUpdateTimer(&(bs->byteTimerMs)) < RECEIVE_BYTE_MS)
     {
-        if (BootUARTReadByte(&(bs->buffer[bs->readPos])))
-            bs->readPos++;
+        if (BootUARTReadByte(bs, bs->buffer))
+            BootStartTimer(&(bs->byteTimerMs), TICKS_PER_MILLISECOND);
     }
 
-    // increment packets received
-    bs->packetCounter++;
+    STAT_COUNT(bs, COUNT_NACKS);
+    NACK(NACK_RECEIVE_TIMEOUT);
+    WRITE((uint8_t)(bs->receivedCount>>8));
+    WRITE((uint8_t)(bs->receivedCount));
+}
 
+// true while the current write packet is still arriving
+#define RECEIVING(bs) (!(bs)->receiveTimeout)
+#else
+#define BootReadPacketByte(bs, byte) BootUARTReadByte(bs, byte)
+#define RECEIVING(bs) true
+#endif
 
-    // payload now in buffer 0-(P-1)
-#ifdef DEBUG_BOOTLOADER
-    BootDebugPrint("Write packet length ");
-    BootPrintSerialHex(bs->readMax);
-    ENDLINE();
+#ifdef USE_STREAM_RECEIVE
+// read the readMax byte write packet payload into the buffer, leaving the CRC
+// of all but the last 4 bytes in computedCrc. Each 64 byte chunk is
+// decrypted, if decrypt is set, and added to the CRC as soon as it arrives
+BOOT_CODE static void BootReceivePayload(Boot_t * bs, bool decrypt)
+{
+    int chunkStart = 0, crcEnd;
+#ifdef USE_CRYPTO
+    bool keystreamReady = !decrypt;
 #endif
 
+    bs->computedCrc = 0;
+    bs->readPos = 0;
+    while (chunkStart < bs->readMax && RECEIVING(bs))
+    {
+        if (bs->readPos < bs->readMax && BootReadPacketByte(bs, &(bs->buffer[bs->readPos])))
+            bs->readPos++;
 #ifdef USE_CRYPTO
-    // decrypt if needed before testing checksums
-    if (bs->packetCounter != 1)
-    { // was not the crypto IV packet, so decrypt
+        else if (!keystreamReady)
+        { // nothing waiting, so get the keystream for this chunk ready
+            STAT_START(bs, STAT_DECRYPT);
+            BootCryptoKeystream(&(bs->crypto), CRYPTO_ROUNDS);
+            STAT_STOP(bs, STAT_DECRYPT);
+            keystreamReady = true;
+        }
+#endif
 
-        BootDebugPrintE("Decrypting packet");
+        if (bs->readPos - chunkStart == 64 || bs->readPos == bs->readMax)
+        { // chunk complete
+#ifdef USE_CRYPTO
+            if (decrypt)
+            {
+                STAT_START(bs, STAT_DECRYPT);
+                if (!keystreamReady)
+                    BootCryptoKeystream(&(bs->crypto), CRYPTO_ROUNDS);
+                BootCryptoXor(&(bs->crypto), bs->buffer + chunkStart,
+                        bs->buffer + chunkStart, bs->readPos - chunkStart);
+                STAT_STOP(bs, STAT_DECRYPT);
+                keystreamReady = false;
+            }
+#endif
+            // the transmitted CRC is not part of the CRC
+            crcEnd = bs->readPos < bs->readMax - 4 ? bs->readPos : bs->readMax - 4;
+            STAT_START(bs, STAT_CRC);
+            if (chunkStart < crcEnd)
+                bs->computedCrc = BootCrc32AddBytes(bs->buffer + chunkStart,
+                        crcEnd - chunkStart, bs->computedCrc);
+            STAT_STOP(bs, STAT_CRC);
+            chunkStart = bs->readPos;
+        }
+    }
+}
+#endif
+
+#ifdef USE_CRYPTO
+// set up decryption from the internal key and the 8 byte IV at the start of
+// the buffer, with the block counter at 0
+BOOT_CODE static void BootCryptoStart(Boot_t * bs)
+{
+    // write password into buffer
+    // stored as key, word 0 first (lowest address), each stored
+    // big endian into a byte array as the key
+
+#define WRITEKEY(ptr,val) (ptr)[3] = (uint8_t)val; \
+    (ptr)[2] = (uint8_t)((val)>>8);            \
+    (ptr)[1] = (uint8_t)((val)>>16);           \
+    (ptr)[0] = (uint8_t)((val)>>24)
+
+    WRITEKEY(bs->buffer+ 8, PASSWORD_WORD0);
+    WRITEKEY(bs->buffer+12, PASSWORD_WORD1);
+    WRITEKEY(bs->buffer+16, PASSWORD_WORD2);
+    WRITEKEY(bs->buffer+20, PASSWORD_WORD3);
+    WRITEKEY(bs->buffer+24, PASSWORD_WORD4);
+    WRITEKEY(bs->buffer+28, PASSWORD_WORD5);
+    WRITEKEY(bs->buffer+32, PASSWORD_WORD6);
+    WRITEKEY(bs->buffer+36, PASSWORD_WORD7);
+#undef WRITEKEY // clean up to avoid errors
+
+    // Set the 32 byte key
+    // Set the initialization vector, 64 bits
+    BootCryptoSetKeyAndInitializationVector(
+        &(bs->crypto),
+        bs->buffer + 8, // 32 byte key (from internal values)
+        32*8,           // key length in bits
+        bs->buffer      // 8 byte IV
+    );
+}
+#endif
+
+#ifdef USE_COMPRESSION
+// top bit of a write packet length, set if the payload is compressed
+#define PACKET_COMPRESSED 0x8000
+
+/*
+ * The compressed data is the LZ77 stream made by LZ77Compressor in the flasher:
+ * byte 0     : bits 0-3 the length bits N, bit 4 set for 16-bit pairs, else
+ *              8-bit pairs
+ * then items, with a selection byte before each group of eight, bit i set if
+ * item i is a literal byte, else a pair. A pair is 1 byte, or 2 bytes little
+ * endian, with the run length less 2 (less 3 for 16-bit pairs) in the low N
+ * bits and the offset back less 1 in the rest.
+ */
+
+// expand the LZ77 stream of length bytes at the start of the size byte
+// buffer, in place. The stream is moved to the end of the buffer first, and
+// the output grows from the start, never over stream bytes still unread.
+// return the expanded length, or 0 if the stream is malformed or will not fit
+BOOT_CODE static uint32_t BootDecompress(uint8_t * buffer, uint32_t length, uint32_t size)
+{
+    uint32_t in = size, out = 0, lengthBits, lengthMin, pair, run, offset;
+    uint8_t selection = 0, bit = 8;
+    bool pair16;
+
+    if (length < 2 || size < length)
+        return 0;
+
+    // move the stream up, from the end since the two may overlap
+    while (length > 0)
+        buffer[--in] = buffer[--length];
+
+    lengthBits = buffer[in] & 15;
+    pair16 = (buffer[in] & 16) != 0;
+    in++;
+    if (lengthBits < 1 || lengthBits >= (pair16 ? 16 : 8))
+        return 0;
+    lengthMin = pair16 ? 3 : 2;
+
+    while (in < size)
+    {
+        if (bit == 8)
+        { // selection bits for the next eight items
+            selection = buffer[in++];
+            bit = 0;
+            continue;
+        }
+        if (((selection >> bit++) & 1) != 0)
+        { // literal byte
+            buffer[out++] = buffer[in++];
+            continue;
+        }
+
+        // run length, offset pair
+        pair = buffer[in++];
+        if (pair16)
+        {
+            if (in == size)
+                return 0;
+            pair |= buffer[in++] << 8;
+        }
+        run = (pair & ((1 << lengthBits) - 1)) + lengthMin;
+        offset = (pair >> lengthBits) + 1;
+        if (offset > out || out + run > in)
+            return 0; // before the start, or over unread stream bytes
+        while (run > 0)
+        {
+            buffer[out] = buffer[out - offset];
+            out++;
+            run--;
+        }
+    }
+    return out;
+}
+#endif
+
+// write incoming flash packet
+// sequenced is true for 'S' packets, counted is true for 'A' packets, and
+// both are false for 'W' packets
+BOOT_CODE static void BootCommandWrite(Boot_t * bs, bool sequenced, bool counted)
+{
+    // on entry, the 'W', 'S', or 'A' command byte is already read...
+
+#ifdef USE_RECEIVE_TIMEOUT
+    BootReceiveStart(bs);
+#endif
+
+#ifdef USE_WRITE_WINDOW
+    bs->retransmission = false;
+    bs->readbackCrc = 0;
+    if (sequenced)
+    {
+        while (RECEIVING(bs) && !BootReadPacketByte(bs, &(bs->sequenceNumber)))
+        {
+            // do nothing
+        }
+    }
+#endif
+
+#ifdef USE_COUNTER_PACKETS
+    if (counted)
+    { // get the crypto block counter the payload starts at
+        bs->readPos = 0;
+        while (bs->readPos < 4 && RECEIVING(bs))
+        {
+            if (BootReadPacketByte(bs, &bs->buffer[bs->readPos]))
+                bs->readPos++;
+        }
+        BootReadBigEndian(&(bs->writeAddress), bs->buffer, 4);
+    }
+#endif
+
+    // get two length bytes
+    bs->readPos = 0;
+    while (bs->readPos < 2 && RECEIVING(bs))
+    {
+        if (BootReadPacketByte(bs, &bs->buffer[bs->readPos]))
+            bs->readPos++;
+    }
+
+#ifdef USE_RECEIVE_TIMEOUT
+    if (bs->receiveTimeout)
+    { // header cut short
+        BootReceiveResync(bs);
+        return;
+    }
+#endif
+
+    // compute length of payload and reset the counter
+    bs->readMax = 256*bs->buffer[0] + bs->buffer[1];
+#ifdef USE_COMPRESSION
+    bs->compressedPacket = (bs->readMax & PACKET_COMPRESSED) != 0;
+    bs->readMax &= ~PACKET_COMPRESSED;
+#endif
+    bs->readPos = 0;  // start back at buffer start
+    STAT_EVENT(bs, EVENT_PACKET_START, bs->readMax);
+    STAT_COUNT(bs, COUNT_PACKETS);
+
+    // check size
+    if (bs->readMax >= BUFFER_SIZE)
+    {
+        BootDebugPrintE("Packet length larger than buffer");
+        BootWriteReply(bs, sequenced, NACK_PACKET_SIZE_TOO_LARGE);
+        return;
+    }
+
+    // see if was last packet
+    if (bs->readMax == 0)
+    {
+        BootDebugPrintE("Last packet seen");
+        bs->writesFinished = true;
+        // final
+        BootWriteReply(bs, sequenced, ACK_OK);
+#ifdef USE_JOURNAL
+        // finished, so nothing left to resume
+        if (bs->journalOn)
+        {
+            bs->journalOn = false;
+            BootNVMemErasePage(bs, JOURNAL_START);
+        }
+#endif
+        return;
+    }
+
+    // increment packets received, before reading the payload so the
+    // streaming receive knows how to decrypt it
+    bs->flashWriteResult = ACK_OK;
+#ifdef USE_WRITE_WINDOW
+    if (sequenced)
+        bs->flashWriteResult = BootWindowPacket(bs);
+    else
+#endif
+#ifdef USE_COUNTER_PACKETS
+    if (counted)
+        bs->flashWriteResult = BootCounterPacket(bs);
+    else
+#endif
+    bs->packetCounter++;
+
+#ifdef USE_STREAM_RECEIVE
+#if defined(USE_CRYPTO) && defined(USE_WRITE_WINDOW)
+    if (bs->retransmission)
+    { // decrypt from where this packet started the first time
+        bs->liveCounter = bs->crypto.state[12];
+        bs->crypto.state[12] = bs->windowCounter[bs->packetCounter % WRITE_WINDOW_SIZE];
+    }
+#endif
+
+    // read rest of packet, decrypting all but the crypto IV packet
+    BootReceivePayload(bs, bs->flashWriteResult == ACK_OK && bs->packetCounter != 1);
+
+#if defined(USE_CRYPTO) && defined(USE_WRITE_WINDOW)
+    if (bs->retransmission)
+        bs->crypto.state[12] = bs->liveCounter;
+#endif
+#else
+    // read rest of packet
+    while (bs->readPos < bs->readMax && RECEIVING(bs))
+    {
+        if (BootReadPacketByte(bs, &(bs->buffer[bs->readPos])))
+            bs->readPos++;
+    }
+#endif
+
+#ifdef USE_RECEIVE_TIMEOUT
+    if (bs->receiveTimeout)
+    { // payload cut short, forget the packet
+        BootReceiveResync(bs);
+        return;
+    }
+#endif
+
+#ifdef DEBUG_TURNAROUND
+    bs->lastByteTicks = BootReadTimer();
+#endif
+
+#if defined(USE_WRITE_WINDOW) || defined(USE_COUNTER_PACKETS)
+    if (bs->flashWriteResult != ACK_OK)
+    { // sequence number outside the window, or no IV yet
+        BootWriteReply(bs, sequenced, bs->flashWriteResult);
+        return;
+    }
+#endif
+
+
+    // payload now in buffer 0-(P-1)
+#ifdef DEBUG_BOOTLOADER
+    BootDebugPrint("Write packet length ");
+    BootPrintSerialHex(bs->readMax);
+    ENDLINE();
+#endif
+
+#if defined(USE_CRYPTO) && !defined(USE_STREAM_RECEIVE)
+    // decrypt if needed before testing checksums
+    if (bs->packetCounter != 1)
+    { // was not the crypto IV packet, so decrypt
+
+        BootDebugPrintE("Decrypting packet");
 
         //BootPrintMemory("Encrypted bytes: ", bs->buffer, 16);
         //BootPrintMemory("Encryptor state ", bs->crypto.state, 64);
 
+#ifdef USE_WRITE_WINDOW
+        if (bs->retransmission)
+        { // decrypt from where this packet started the first time
+            bs->liveCounter = bs->crypto.state[12];
+            bs->crypto.state[12] = bs->windowCounter[bs->packetCounter % WRITE_WINDOW_SIZE];
+        }
+#endif
+
+#ifdef DEBUG_BOOTLOADER
+        bs->curAddress = BootReadTimer();
+#endif
+
         // note encrypt and decrypt are the same function
+        STAT_START(bs, STAT_DECRYPT);
         BootCryptoDecrypt(
             &(bs->crypto),
             bs->buffer,  // the output message
             bs->readMax, // message length
             bs->buffer,  // the cipher bytes
             CRYPTO_ROUNDS);
+        STAT_STOP(bs, STAT_DECRYPT);
+
+#ifdef DEBUG_BOOTLOADER
+        // core timer ticks at half the system clock
+        BootDebugPrint("Decrypt cycles: ");
+        BootPrintSerialInt((BootReadTimer() - bs->curAddress)*2);
+        ENDLINE();
+#endif
+
+#ifdef USE_WRITE_WINDOW
+        if (bs->retransmission)
+            bs->crypto.state[12] = bs->liveCounter;
+#endif
 
         //BootPrintMemory("Decrypted bytes: ", bs->buffer, 16);
     }
 
 #endif
 
-    // verify packet checksum
-    bs->computedCrc = 0;
-    for (bs->readPos = 0; bs->readPos <= bs->readMax-4-1; bs->readPos++)
+    // verify packet checksum
+#ifndef USE_STREAM_RECEIVE
+    STAT_START(bs, STAT_CRC);
+    bs->computedCrc = BootCrc32AddBytes(bs->buffer, bs->readMax-4, 0);
+    STAT_STOP(bs, STAT_CRC);
+#endif
+
+#ifdef DEBUG_BOOTLOADER
+    BootDebugPrint("Computed checksum     : ");
+    BootPrintSerialHex(bs->computedCrc);
+    ENDLINE();
+#endif
+
+    // read transmitted CRC
+    BootReadBigEndian(&(bs->transmittedCrc),bs->buffer+bs->readMax-4,4);
+
+#ifdef DEBUG_BOOTLOADER
+    BootDebugPrint("Transmitted checksum  : ");
+    BootPrintSerialHex(bs->transmittedCrc);
+    ENDLINE();
+#endif
+
+#if defined(USE_RX_DMA) || defined(USE_RAM_NVM)
+    if (bs->rxOverflow)
+    { // some of the packet was lost, which the CRC may not catch
+        bs->rxOverflow = false;
+        BootDebugPrintE("Receive ring overflow");
+        BootWriteReply(bs, sequenced, NACK_CRC_MISMATCH);
+        return;
+    }
+#endif
+
+    if (bs->computedCrc != bs->transmittedCrc)
+    { // crc mismatch
+        BootDebugPrintE("CRC mismatch");
+        BootWriteReply(bs, sequenced, NACK_CRC_MISMATCH);
+        return;
+    }
+
+#ifdef USE_CRYPTO
+    if (bs->packetCounter == 1)
+    { // packet contains 8 byte decryption initialization vector (IV)
+
+        BootDebugPrintE("Crypto info packet read");
+
+        BootCryptoStart(bs);
+
+        // ack success
+        BootWriteReply(bs, sequenced, ACK_OK);
+        return;
+    }
+#endif
+
+
+    // get write size and address
+    BootReadBigEndian(&(bs->writeSize),bs->buffer+bs->readMax-4-2,2);
+    BootReadBigEndian(&(bs->writeAddress),bs->buffer+bs->readMax-4-6,4);
+
+#ifdef DEBUG_BOOTLOADER
+    BootDebugPrint("Writing ");
+    BootPrintSerialHex(bs->writeSize);
+    BootDebugPrint(" to address ");
+    BootPrintSerialHex(bs->writeAddress);
+    ENDLINE();
+#endif
+
+#ifdef USE_COMPRESSION
+    if (bs->compressedPacket &&
+        BootDecompress(bs->buffer, bs->readMax - 10, BUFFER_SIZE) != bs->writeSize)
+    { // bad stream, or not the length to write
+        BootDebugPrintE("Decompress failed");
+        BootWriteReply(bs, sequenced, NACK_WRITE_SIZE_ERROR);
+        return;
+    }
+#endif
+
+#ifdef USE_STAGING
+    if (bs->stagedCheck)
+    { // checking a staged stream before anything is erased
+        BootWriteReply(bs, sequenced, BootWriteCheck(bs));
+        return;
+    }
+#endif
+
+    // program and verify, and send the one reply
+    bs->flashWriteResult = BootWriteFlash(bs);
+    BootWriteReply(bs, sequenced, bs->flashWriteResult);
+
+#ifdef DEBUG_TURNAROUND
+    // core timer ticks at half the system clock
+    bs->lastByteTicks = BootReadTimer() - bs->lastByteTicks;
+    BOOTSTRING(turnaroundText, "Turnaround cycles: ");
+    BootPrintSerial(turnaroundText);
+    BootPrintSerialInt(bs->lastByteTicks*2);
+    ENDLINE();
+#endif
+}
+
+#ifdef USE_STAGING
+// return true if the staging region holds a stream not yet copied
+BOOT_CODE static bool BootStagedReady()
+{
+    const uint32_t * header = (const uint32_t *)PHYSICAL_TO_LOGICAL_ADDRESS(STAGING_START);
+    return header[0] == STAGED_MAGIC && header[3] == 0xFFFFFFFF;
+}
+
+// run the staged stream of length bytes through the write command, reading
+// packets from flash instead of the UART. With stagedCheck set they are only
+// decoded and checked
+// return true if every packet passed and the stream ended with the zero
+// length packet
+BOOT_CODE static bool BootRunStaged(Boot_t * bs, const uint8_t * stream, uint32_t length)
+{
+    bs->stagedRead = stream;
+    bs->stagedEnd = stream + length;
+    bs->stagedReply = ACK_OK;
+    while (bs->stagedReply == ACK_OK && !bs->writesFinished)
+    {
+        // a 'W', the payload length, then the whole payload in the stream
+        if (bs->stagedEnd - bs->stagedRead < 3 || bs->stagedRead[0] != 'W' ||
+            bs->stagedEnd - bs->stagedRead - 3 < 256*(bs->stagedRead[1] & 0x7F) + bs->stagedRead[2])
+        {
+            BootDebugPrintE("Staged stream malformed");
+            break;
+        }
+        bs->stagedRead++;
+        BootCommandWrite(bs, false, false);
+        if (bs->stagedRead > bs->stagedEnd)
+        {
+            BootDebugPrintE("Staged packet overran the stream");
+            bs->stagedReply = NACK_PACKET_SIZE_TOO_LARGE;
+        }
+    }
+    bs->stagedRead = 0;
+    return bs->writesFinished && bs->stagedReply == ACK_OK;
+}
+
+// copy the staged image into place by running its packets through the write
+// command. Every packet is first decoded and checked without writing, so a
+// stream that would fail part way, say by writing boot flash, is refused
+// before anything is erased. The stream is left as is until the end, so if
+// power is lost the copy is redone on the next reset, lazy erase clearing
+// each page again before it is written. A copy that fails once erasing has
+// started is also left to be tried again, since the application may be gone.
+// Sets bootResult, and returns true on success
+BOOT_CODE static bool BootCommitStaged(Boot_t * bs)
+{
+    const uint32_t * header = (const uint32_t *)PHYSICAL_TO_LOGICAL_ADDRESS(STAGING_START);
+    const uint8_t * stream = (const uint8_t *)PHYSICAL_TO_LOGICAL_ADDRESS(STAGING_START + STAGED_HEADER_SIZE);
+    uint32_t length = header[1];
+
+    bootResult = BOOT_RESULT_STAGED_FAILED;
+
+    // the whole stream must check out before anything is erased
+    BootEraseStart(bs);
+    bs->stagedCheck = true;
+    if (length > STAGING_SIZE - STAGED_HEADER_SIZE ||
+        BootCrc32AddBytes(stream, length, 0) != header[2] ||
+        !BootRunStaged(bs, stream, length))
+    {
+        bs->stagedCheck = false;
+        // refused with the application untouched, so do not try again
+        BootNVMemWriteWord(bs, STAGING_START + 12, 0);
+        return false;
+    }
+    bs->stagedCheck = false;
+
+    BootEraseStart(bs);
+    BootLazyEraseStart(bs);
+    bs->flashErased = true;
+    if (BootRunStaged(bs, stream, length) && bs->pageEraseFailureCount == 0)
+    {
+        bootResult = BOOT_RESULT_STAGED;
+        // copied, so do not copy again
+        BootNVMemWriteWord(bs, STAGING_START + 12, 0);
+    }
+
+    return bootResult == BOOT_RESULT_STAGED;
+}
+#endif
+
+// compute and output CRC32 for all flash
+BOOT_CODE static void BootCommandCRC(Boot_t * bs)
+{
+#ifdef DEBUG_BOOTLOADER
+    uint32_t startTicks = BootReadTimer();
+#endif
+
+    // main flash
+    bs->computedCrc = BootCrc32AddBytes((const uint8_t*)FLASH_START_LOGICAL, FLASH_SIZE, 0);
+
+    // BOOT flash
+    bs->computedCrc = BootCrc32AddBytes((const uint8_t*)BOOT_START_LOGICAL, BOOT_SIZE, bs->computedCrc);
+
+#ifdef DEBUG_BOOTLOADER
+    // core timer ticks at half the system clock, so report CPU cycles
+    startTicks = BootReadTimer() - startTicks;
+    BootDebugPrint("CRC cycles: ");
+    BootPrintSerialInt(startTicks*2);
+    BootDebugPrint(", cycles per byte x100: ");
+    BootPrintSerialInt(startTicks*200/(FLASH_SIZE+BOOT_SIZE));
+    ENDLINE();
+#endif
+
+    BOOTSTRING(allCrcText, "CRC of all flash: ");
+    BootPrintSerial(allCrcText);
+    BootPrintSerialHex(bs->computedCrc);
+    ENDLINE();
+
+    // final ACK
+    ACK(ACK_OK);
+
+}
+
+
+// send a big endian value in binary, adding it to the reply CRC
+// kept in transmittedCrc
+BOOT_CODE static void BootWriteBinary(Boot_t * bs, uint32_t value, int32_t bytes)
+{
+    while (bytes > 0)
+    {
+        bytes--;
+        WRITE((uint8_t)(value>>(8*bytes)));
+        bs->transmittedCrc = BootCrc32AddByte((uint8_t)(value>>(8*bytes)), bs->transmittedCrc);
+    }
+}
+
+// send the CRC32K of each page in writeAddress, writeSize
+BOOT_CODE static void BootManifestRange(Boot_t * bs)
+{
+    for (bs->curAddress = PHYSICAL_TO_LOGICAL_ADDRESS(bs->writeAddress);
+         bs->curAddress < PHYSICAL_TO_LOGICAL_ADDRESS(bs->writeAddress + bs->writeSize); )
+    {
+        bs->computedCrc = BootCrc32AddBytes((const uint8_t*)(uintptr_t)bs->curAddress, FLASH_PAGE_SIZE, 0);
+        bs->curAddress += FLASH_PAGE_SIZE;
+        BootWriteBinary(bs, bs->computedCrc, 4);
+    }
+}
+
+/*
+ * A manifest command has the following format
+ * byte  0           : 'M' (0x4D) the manifest command.
+ * bytes 1-4         : big endian 32-bit physical address of a page
+ * bytes 5-6         : big endian 16-bit count of pages N, or 0 for all
+ *                     program flash pages followed by all boot flash pages
+ *
+ * A range not passing the 'P' checks gets a single NACK. Otherwise the reply
+ * is ACK_OK followed by binary:
+ * bytes 0-1         : big endian 16-bit count of pages N
+ * next 4N bytes     : big endian CRC32K of each page, in address order
+ * last 4 bytes      : big endian CRC32K of the count and page CRCs
+ *
+ * The flasher compares these with the pages of an image, to only send
+ * the pages that differ.
+ */
+
+// read a page address and page count into writeAddress, writeSize,
+// as used by 'M' and 'K'. A count of 0 leaves writeSize 0 for all pages.
+// return ACK_OK, else the NACK code for a bad range
+BOOT_CODE static uint32_t BootReadPageRange(Boot_t * bs)
+{
+    bs->readPos = 0;
+    while (bs->readPos < 6)
+    {
+        if (BootUARTReadByte(bs, &bs->buffer[bs->readPos]))
+            bs->readPos++;
+    }
+    BootReadBigEndian(&(bs->writeAddress), bs->buffer, 4);
+    BootReadBigEndian(&(bs->writeSize), bs->buffer + 4, 2);
+
+    if (bs->writeSize == 0)
+        return ACK_OK;
+    bs->writeSize *= FLASH_PAGE_SIZE;
+    return BootPageRangeCheck(bs->writeAddress, bs->writeSize);
+}
+
+// send a table of per page CRCs
+BOOT_CODE static void BootCommandManifest(Boot_t * bs)
+{
+    // on entry, the 'M' command byte is already read...
+
+    bs->flashWriteResult = BootReadPageRange(bs);
+    if (bs->flashWriteResult != ACK_OK)
+    {
+        NACK(bs->flashWriteResult);
+        return;
+    }
+
+    ACK(ACK_OK);
+    bs->transmittedCrc = 0;
+
+    if (bs->writeSize != 0)
+    {
+        BootWriteBinary(bs, bs->writeSize/FLASH_PAGE_SIZE, 2);
+        BootManifestRange(bs);
+    }
+    else
+    {
+        BootWriteBinary(bs, (FLASH_SIZE + BOOT_SIZE)/FLASH_PAGE_SIZE, 2);
+        bs->writeAddress = FLASH_START;
+        bs->writeSize    = FLASH_SIZE;
+        BootManifestRange(bs);
+        bs->writeAddress = BOOT_START;
+        bs->writeSize    = BOOT_SIZE;
+        BootManifestRange(bs);
+    }
+
+    // CRC of the reply, sent outside it
+    bs->computedCrc = bs->transmittedCrc;
+    BootWriteBinary(bs, bs->computedCrc, 4);
+}
+
+#ifdef USE_BINARY_MODE
+/*
+ * A binary info command is the single byte 'F' (0x46). The reply is ACK_OK
+ * followed by binary:
+ * bytes 0-1         : big endian 16-bit length N of the records
+ * next N bytes      : records, each a type byte, a length byte L, then L
+ *                     bytes of value, big endian for numbers. The INFO_
+ *                     types are the 'I' info lines, and the flasher skips
+ *                     types it does not know
+ * last 4 bytes      : big endian CRC32K of the length and records
+ *
+ * Until the next 'I', erases send only the ACK_PAGE_ERASED,
+ * ACK_PAGE_PROTECTED or NACK_ERASE_FAILED byte for each page, with no
+ * address text and no "Erase finished" line. They end with NACK_ERASE_FAILED
+ * if any page failed, then always ACK_ERASE_DONE.
+ */
+
+// add a record with a big endian value to the buffer at readPos
+BOOT_CODE static void BootInfoValue(Boot_t * bs, uint8_t type, uint32_t value, int32_t bytes)
+{
+    bs->buffer[bs->readPos++] = type;
+    bs->buffer[bs->readPos++] = bytes;
+    while (bytes > 0)
+    {
+        bytes--;
+        bs->buffer[bs->readPos++] = (uint8_t)(value>>(8*bytes));
+    }
+}
+
+// add a record with the text to the buffer at readPos
+BOOT_CODE static void BootInfoText(Boot_t * bs, uint8_t type, const char * text)
+{
+    int start = bs->readPos;
+    bs->buffer[bs->readPos++] = type;
+    bs->buffer[bs->readPos++] = 0;
+    while (*text != 0)
+        bs->buffer[bs->readPos++] = *text++;
+    bs->buffer[start+1] = bs->readPos - start - 2;
+}
+
+// send the info as binary records, and switch to binary replies
+BOOT_CODE static void BootCommandBinaryInfo(Boot_t * bs)
+{
+    // on entry, the 'F' command byte is already read...
+    int i;
+
+    // build the records in the buffer to know their length
+    bs->readPos = 0;
+    BootInfoText(bs, INFO_VERSION, BootloaderVersion());
+
+    BootInfoValue(bs, INFO_DEVICE_ID, DEVIDbits.DEVID, 4);
+    BootInfoValue(bs, INFO_REVISION, DEVIDbits.VER, 1);
+    BootInfoValue(bs, INFO_BOOT_SIZE, BOOTLOADER_SIZE, 4);
+    BootInfoValue(bs, INFO_PAGE_SIZE, FLASH_PAGE_SIZE, 2);
+    BootInfoValue(bs, INFO_ROW_SIZE, FLASH_ROW_SIZE, 2);
+    BootInfoValue(bs, INFO_PACKET_SIZE, MAX_PACKET_SIZE, 4);
+#ifdef USE_WRITE_WINDOW
+    BootInfoValue(bs, INFO_WRITE_WINDOW, WRITE_WINDOW_SIZE, 1);
+#endif
+#ifdef USE_BAUD_CHANGE
+    BootInfoValue(bs, INFO_BAUD_RATE, SYS_CLOCK/(4*(U1BRG+1)), 4);
+#endif
+#ifdef USE_COMPRESSION
+    BootInfoText(bs, INFO_COMPRESSION, compressionText);
+#endif
+
+    bs->buffer[bs->readPos] = INFO_COMMANDS;
+    bs->buffer[bs->readPos+1] = BootCommandLetters(bs->buffer + bs->readPos + 2);
+    bs->readPos += 2 + bs->buffer[bs->readPos+1];
+
+    bs->binaryMode = true;
+
+    ACK(ACK_OK);
+    bs->transmittedCrc = 0;
+    BootWriteBinary(bs, bs->readPos, 2);
+    for (i = 0; i < bs->readPos; ++i)
+        BootWriteBinary(bs, bs->buffer[i], 1);
+
+    // CRC of the reply, sent outside it
+    bs->computedCrc = bs->transmittedCrc;
+    BootWriteBinary(bs, bs->computedCrc, 4);
+}
+#endif
+
+#ifdef USE_BLANK_CHECK
+// add a bit per page in writeAddress, writeSize to the bitmap byte in bits,
+// set if the page is not blank, sending each byte as its eighth bit is added.
+// count is the number of bits already in the byte
+BOOT_CODE static void BootBlankRange(Boot_t * bs, uint32_t * bits, uint32_t * count)
+{
+    for (bs->curAddress = bs->writeAddress;
+         bs->curAddress < bs->writeAddress + bs->writeSize;
+         bs->curAddress += FLASH_PAGE_SIZE)
     {
-#if 0 // DEBUG_MESSAGES
-        // show initial and final bytes, for debugging
-        int i = bs->readPos;
-        if (i < 5 || i > bs->readMax-4-1 - 5)
+        if (!BootPageBlank(bs->curAddress))
+            *bits |= 1U<<*count;
+        if (++*count == 8)
         {
-        BootDebugPrint("Check byte ");
-        BootPrintSerialHex(i);
-        BootDebugPrint(" -> ");
-        BootPrintSerialHex(bs->buffer[bs->tempInt1]);
-        ENDLINE();
+            BootWriteBinary(bs, *bits, 1);
+            *bits  = 0;
+            *count = 0;
         }
-#endif
-        bs->computedCrc = BootCrc32AddByteBitwise(bs->buffer[bs->readPos], bs->computedCrc);
     }
+}
 
-#ifdef DEBUG_BOOTLOADER
-    BootDebugPrint("Computed checksum     : ");
-    BootPrintSerialHex(bs->computedCrc);
-    ENDLINE();
-#endif
-
-    // read transmitted CRC
-    BootReadBigEndian(&(bs->transmittedCrc),bs->buffer+bs->readMax-4,4);
+/*
+ * A blank check command has the following format
+ * byte  0           : 'K' (0x4B) the blank check command.
+ * bytes 1-4         : big endian 32-bit physical address of a page
+ * bytes 5-6         : big endian 16-bit count of pages N, or 0 for all
+ *                     program flash pages followed by all boot flash pages
+ *
+ * A range not passing the 'P' checks gets a single NACK. Otherwise the reply
+ * is ACK_OK followed by binary:
+ * bytes 0-1         : big endian 16-bit count of pages N
+ * next (N+7)/8 bytes: bitmap, bit i&7 of byte i/8 set if page i is not blank
+ * last 4 bytes      : big endian CRC32K of the count and bitmap
+ *
+ * Pages are read a word at a time, stopping at the first programmed word,
+ * so checking erased flash costs about one read per word and a programmed
+ * page usually only a few. The flasher uses it to confirm an erase, and to
+ * re-erase only the pages that did not come back blank.
+ */
 
-#ifdef DEBUG_BOOTLOADER
-    BootDebugPrint("Transmitted checksum  : ");
-    BootPrintSerialHex(bs->transmittedCrc);
-    ENDLINE();
-#endif
+// send a bitmap of the pages that are not blank
+BOOT_CODE static void BootCommandBlankCheck(Boot_t * bs)
+{
+    // on entry, the 'K' command byte is already read...
+    uint32_t bits = 0, count = 0;
 
-    if (bs->computedCrc != bs->transmittedCrc)
-    { // crc mismatch
-        BootDebugPrintE("CRC mismatch");
-        NACK(NACK_CRC_MISMATCH);
+    bs->flashWriteResult = BootReadPageRange(bs);
+    if (bs->flashWriteResult != ACK_OK)
+    {
+        NACK(bs->flashWriteResult);
         return;
     }
 
-#ifdef USE_CRYPTO
-    if (bs->packetCounter == 1)
-    { // packet contains 8 byte decryption initialization vector (IV)
+    ACK(ACK_OK);
+    bs->transmittedCrc = 0;
 
-        BootDebugPrintE("Crypto info packet read");
+    if (bs->writeSize != 0)
+    {
+        BootWriteBinary(bs, bs->writeSize/FLASH_PAGE_SIZE, 2);
+        BootBlankRange(bs, &bits, &count);
+    }
+    else
+    {
+        BootWriteBinary(bs, (FLASH_SIZE + BOOT_SIZE)/FLASH_PAGE_SIZE, 2);
+        bs->writeAddress = FLASH_START;
+        bs->writeSize    = FLASH_SIZE;
+        BootBlankRange(bs, &bits, &count);
+        bs->writeAddress = BOOT_START;
+        bs->writeSize    = BOOT_SIZE;
+        BootBlankRange(bs, &bits, &count);
+    }
+    if (count != 0)
+        BootWriteBinary(bs, bits, 1);
 
-        // write password into buffer
-        // stored as key, word 0 first (lowest address), each stored
-        // big endian into a byte array as the key
+    // CRC of the reply, sent outside it
+    bs->computedCrc = bs->transmittedCrc;
+    BootWriteBinary(bs, bs->computedCrc, 4);
+}
+#endif
 
-#define WRITEKEY(ptr,val) (ptr)[3] = (uint8_t)val; \
-        (ptr)[2] = (uint8_t)((val)>>8);            \
-        (ptr)[1] = (uint8_t)((val)>>16);           \
-        (ptr)[0] = (uint8_t)((val)>>24)
-
-        WRITEKEY(bs->buffer+ 8, PASSWORD_WORD0);
-        WRITEKEY(bs->buffer+12, PASSWORD_WORD1);
-        WRITEKEY(bs->buffer+16, PASSWORD_WORD2);
-        WRITEKEY(bs->buffer+20, PASSWORD_WORD3);
-        WRITEKEY(bs->buffer+24, PASSWORD_WORD4);
-        WRITEKEY(bs->buffer+28, PASSWORD_WORD5);
-        WRITEKEY(bs->buffer+32, PASSWORD_WORD6);
-        WRITEKEY(bs->buffer+36, PASSWORD_WORD7);
-#undef WRITEKEY // clean up to avoid errors
-        
-        // Set the 32 byte key
-        // Set the initialization vector, 64 bits
-        BootCryptoSetKeyAndInitializationVector(
-            &(bs->crypto),
-            bs->buffer + 8, // 32 byte key (from internal values)
-            32*8,           // key length in bits
-            bs->buffer      // 8 byte IV
-        );
+#ifdef USE_JOURNAL
+/*
+ * A journal command has the following format
+ * byte  0           : 'J' (0x4A) the journal command.
+ * bytes 1-4         : big endian 32-bit session ID, which the flasher makes
+ *                     from the write packets it is about to send
+ * bytes 5-8         : big endian CRC32K of bytes 1-4
+ *
+ * A CRC mismatch gets NACK_CRC_MISMATCH. Otherwise the next 'E' or 'P' erase
+ * journals its writes under the session ID, and the reply is ACK_OK followed
+ * by binary:
+ * bytes 0-3         : big endian count of write packets the session had
+ *                     committed, 0 if the journal is for another session
+ * bytes 4-7         : big endian CRC32K of bytes 0-3
+ *
+ * A resume command has the same format, with 'U' (0x55) and the count from
+ * the 'J' reply in place of the session ID. Writing then carries on as if
+ * it had never stopped, the next write packet being number count+1, with
+ * sequence number count. Without a 'J' naming the session just before, or
+ * if its journal does not end at that count, the reply is
+ * NACK_SEQUENCE_ERROR, else ACK_OK.
+ */
 
-        // ack success
-        ACK(ACK_OK);
+// read the 32-bit value and CRC of a 'J' or 'U' command into writeAddress
+// return ACK_OK, else NACK_CRC_MISMATCH
+BOOT_CODE static uint32_t BootReadJournalValue(Boot_t * bs)
+{
+    bs->readPos = 0;
+    while (bs->readPos < 8)
+    {
+        if (BootUARTReadByte(bs, &bs->buffer[bs->readPos]))
+            bs->readPos++;
+    }
+    BootReadBigEndian(&(bs->writeAddress), bs->buffer, 4);
+    BootReadBigEndian(&(bs->transmittedCrc), bs->buffer + 4, 4);
+
+    bs->computedCrc = BootCrc32AddBytes(bs->buffer, 4, 0);
+    if (bs->computedCrc != bs->transmittedCrc)
+    {
+        BootDebugPrintE("CRC mismatch");
+        return NACK_CRC_MISMATCH;
+    }
+    return ACK_OK;
+}
+
+// name the session for the next erase, and send how far it got before
+BOOT_CODE static void BootCommandJournal(Boot_t * bs)
+{
+    // on entry, the 'J' command byte is already read...
+    const uint32_t * record;
+
+    bs->flashWriteResult = BootReadJournalValue(bs);
+    if (bs->flashWriteResult != ACK_OK)
+    {
+        NACK(bs->flashWriteResult);
         return;
     }
-#endif
+    bs->sessionId = bs->writeAddress;
+    bs->sessionSet = true;
+    record = BootJournalLast(bs);
 
+    ACK(ACK_OK);
+    bs->transmittedCrc = 0;
+    BootWriteBinary(bs, record != 0 ? record[0] & ~JOURNAL_BOOT_PAGE : 0, 4);
 
-    // get write size and address
-    BootReadBigEndian(&(bs->writeSize),bs->buffer+bs->readMax-4-2,2);
-    BootReadBigEndian(&(bs->writeAddress),bs->buffer+bs->readMax-4-6,4);
+    // CRC of the reply, sent outside it
+    bs->computedCrc = bs->transmittedCrc;
+    BootWriteBinary(bs, bs->computedCrc, 4);
+}
 
-#ifdef DEBUG_BOOTLOADER
-    BootDebugPrint("Writing ");
-    BootPrintSerialHex(bs->writeSize);
-    BootDebugPrint(" to address ");
-    BootPrintSerialHex(bs->writeAddress);
-    ENDLINE();
-#endif
+// return true if the journal range record covers any of the word at address
+BOOT_CODE static bool BootJournalCovers(const uint32_t * range, uint32_t address)
+{
+    return (range[0] & JOURNAL_RANGE) != 0 && range[1] != 0xFFFFFFFF &&
+        BootOverlap(address, address + 4,
+            range[0] & ~JOURNAL_RANGE, (range[0] & ~JOURNAL_RANGE) + range[1]) > 0;
+}
 
-    // loop on writing a few times in case first pass fails
-    bs->writeRetryCounter = 0;
+// undo the writes of the packets journaled after the count record, which may
+// be partly programmed and are sent again. Each page they touch is erased and
+// programmed back without their words, keeping the committed packets sharing
+// the page, between an undo record and the count record again. As in
+// BootWriteFlash, the BOOT_START page is only erased to be written with the
+// bootloader shim. Without it, the packet that wrote the shim is not
+// committed, nor is any other on the page, so the page is left for that
+// packet to erase when sent again. Uses the packet buffer, unused until the
+// next write packet
+// return ACK_OK, else NACK_SEQUENCE_ERROR if the journal has no room for the
+// undo records, NACK_ERASE_FAILED or NACK_WRITES_FAILED
+BOOT_CODE static uint32_t BootJournalUndo(Boot_t * bs, const uint32_t * record)
+{
+    const uint32_t * range, * other, * end = JOURNAL + bs->journalFree/4;
+    uint32_t * page = (uint32_t *)bs->buffer;
+    uint32_t word;
+    bool touched, undoing = false;
 
-    do 
+    for (range = record + 2; range < end; range += 2)
     {
-        bs->flashWriteResult = BootWriteFlash(bs);
-        if (bs->flashWriteResult != ACK_OK)
+        if ((range[0] & JOURNAL_RANGE) == 0 || range[1] == 0xFFFFFFFF)
+            continue;
+        for (bs->curAddress = (range[0] & ~JOURNAL_RANGE) & ~(FLASH_PAGE_SIZE-1);
+             bs->curAddress < (range[0] & ~JOURNAL_RANGE) + range[1];
+             bs->curAddress += FLASH_PAGE_SIZE)
         {
-            BootDebugPrintE("Flash write failed ");
-            // here is the reason
-            NACK(bs->flashWriteResult);
-            if (bs->writeRetryCounter > WRITE_RETY_MAX)
+            // copy the page, blanking the words of every undone packet
+            touched = false;
+            for (word = 0; word < FLASH_PAGE_SIZE/4; ++word)
+            {
+                page[word] = ((const uint32_t *)(uintptr_t)PHYSICAL_TO_LOGICAL_ADDRESS(bs->curAddress))[word];
+                for (other = record + 2; other < end && page[word] != 0xFFFFFFFF; other += 2)
+                {
+                    if (BootJournalCovers(other, bs->curAddress + word*4))
+                    {
+                        page[word] = 0xFFFFFFFF;
+                        touched = true;
+                    }
+                }
+            }
+            if (!touched)
+                continue; // already undone, or never reached
+
+            if (bs->curAddress == BOOT_START && !BootDetectBootloaderShim(page))
             {
-                return; // had enough, so bail
+                bs->bootPageErased = false;
+                continue;
             }
-        }
 
-        // check what was written
-        BootDebugPrintE("Comparing flash to buffer....");
-        for (bs->readPos = 0; bs->readPos < bs->writeSize; bs->readPos++)
-        {
-            bs->curAddress = bs->writeAddress+bs->readPos;
-            bs->curAddress |= 0x80000000; // physical to logical
-            if (bs->buffer[bs->readPos] != (*((uint8_t*)(bs->curAddress))))
+            if (!undoing)
             {
-                bs->flashWriteResult = NACK_COMPARE_FAILED;
-    #ifdef DEBUG_BOOTLOADER
-                BootDebugPrint("Compare flash to buffer failed. Address ");
-                BootPrintSerialHex(bs->curAddress);
-                BootDebugPrint(", ");
-                BootPrintSerialInt((uint32_t)bs->buffer[bs->readPos]);
-                BootDebugPrint(" != ");
-                BootPrintSerialInt((uint32_t) (*((uint8_t*)(bs->curAddress))) );
-                ENDLINE();
-    #endif
-                NACK(NACK_COMPARE_FAILED);
-                if (bs->writeRetryCounter > WRITE_RETY_MAX)
+                // a reset from here until the count record is written again
+                // may lose committed words, so must not resume
+                if (bs->journalFree + 16 > FLASH_PAGE_SIZE)
                 {
-                    return; // had enough, so bail
+                    BootDebugPrintE("No journal room to undo");
+                    return NACK_SEQUENCE_ERROR;
                 }
+                if (!BootJournalWrite(bs, JOURNAL_UNDO, 0))
+                    return NACK_WRITES_FAILED;
+                undoing = true;
+            }
 
+            if (!BootNVMemErasePage(bs, bs->curAddress))
+            {
+                BootDebugPrintE("Undo erase failed");
+                return NACK_ERASE_FAILED;
+            }
+            for (word = 0; word < FLASH_PAGE_SIZE/4; word += FLASH_ROW_SIZE/4)
+            {
+                if (BootFlashMatches(bs->curAddress + word*4, page + word, FLASH_ROW_SIZE/4))
+                    continue; // nothing kept in this row
+                if (!BootNVMemWriteRow(bs, bs->curAddress + word*4,
+                        (uint32_t*)(LOGICAL_TO_PHYSICAL_ADDRESS((uintptr_t)(page + word)))) ||
+                    !BootFlashMatches(bs->curAddress + word*4, page + word, FLASH_ROW_SIZE/4))
+                {
+                    BootDebugPrintE("Undo write failed");
+                    return NACK_WRITES_FAILED;
+                }
             }
         }
-        bs->writeRetryCounter++;
-    } while (bs->writeRetryCounter < WRITE_RETY_MAX &&
-             bs->flashWriteResult != ACK_OK);
-
-    // final ACK
-    ACK(ACK_OK);
+    }
+    if (undoing && !BootJournalWrite(bs, record[0], record[1]))
+        return NACK_WRITES_FAILED;
+    return ACK_OK;
 }
 
-// compute and output CRC32 for all flash
-BOOT_CODE static void BootCommandCRC(Boot_t * bs)
+// carry on the journaled session after its last committed packet, with the
+// flash erased and the keystream where they were. Writes of later packets
+// are undone first, since they are sent again
+BOOT_CODE static void BootCommandResume(Boot_t * bs)
 {
-    bs->computedCrc = 0;
+    // on entry, the 'U' command byte is already read...
+    const uint32_t * record;
 
-    // main flash
-    for (bs->curAddress = FLASH_START_LOGICAL;
-            bs->curAddress < FLASH_START_LOGICAL+FLASH_SIZE; ++ bs->curAddress)
+    bs->flashWriteResult = BootReadJournalValue(bs);
+    if (bs->flashWriteResult != ACK_OK)
+    {
+        NACK(bs->flashWriteResult);
+        return;
+    }
+    record = BootJournalLast(bs);
+    if (record == 0 || (record[0] & ~JOURNAL_BOOT_PAGE) != bs->writeAddress)
     {
-        bs->computedCrc = BootCrc32AddByteBitwise(*((uint8_t*)bs->curAddress), bs->computedCrc);
+        BootDebugPrintE("No journal to resume");
+        NACK(NACK_SEQUENCE_ERROR);
+        return;
     }
 
-    // BOOT flash
-    for (bs->curAddress = BOOT_START_LOGICAL;
-            bs->curAddress < BOOT_START_LOGICAL+BOOT_SIZE; ++ bs->curAddress)
+    BootEraseStart(bs);
+    bs->bootPageErased = (record[0] & JOURNAL_BOOT_PAGE) != 0;
+    bs->flashWriteResult = BootJournalUndo(bs, record);
+    if (bs->flashWriteResult != ACK_OK)
     {
-        bs->computedCrc = BootCrc32AddByteBitwise(*((uint8_t*)bs->curAddress), bs->computedCrc);
+        NACK(bs->flashWriteResult);
+        return;
     }
 
+    bs->flashErased = true;
+    bs->packetCounter = bs->writeAddress;
+#ifdef USE_WRITE_WINDOW
+    bs->nextSequence = bs->writeAddress;
+#endif
 
-    BOOTSTRING(allCrcText, "CRC of all flash: ");
-    BootPrintSerial(allCrcText);
-    BootPrintSerialHex(bs->computedCrc);
-    ENDLINE();
+#ifdef USE_CRYPTO
+    // the IV packet is the first packet, so is in every record
+    BootCryptoUnpack(bs->buffer, 0, JOURNAL[2]);
+    BootCryptoUnpack(bs->buffer, 4, JOURNAL[3]);
+    BootCryptoStart(bs);
+    bs->crypto.state[12] = record[1];
+#endif
+
+    bs->journalCount = bs->writeAddress;
+    bs->journalAcked = 0;
+    bs->journalRecord[0] = record[0];
+    bs->journalRecord[1] = record[1];
+    bs->journalOn = true;
+    bs->sessionSet = false;
+
+    ACK(ACK_OK);
+}
+#endif
+
+#ifdef USE_STATS
+/*
+ * A stats command is the single byte 'T' (0x54). The reply is ACK_OK
+ * followed by binary, everything since the last erase command:
+ * bytes 0-3         : big endian core timer ticks per millisecond
+ * byte  4           : number of phases P
+ * next 4P bytes     : big endian core timer ticks spent in each phase, in
+ *                     STAT_ order: receive wait, decrypt, CRC, erase,
+ *                     program, verify
+ * next 8 bytes      : big endian pages erase attempts, then erase failures
+ * next byte         : number of counts C
+ * next 4C bytes     : big endian COUNT_ values: write packets, rows, words,
+ *                     write retries, NACKs
+ * next byte         : number of events E, at most STATS_EVENTS
+ * next 8E bytes     : events oldest first, each a big endian core timer,
+ *                     then the type byte, then a big endian 24-bit value
+ * last 4 bytes      : big endian CRC32K of all the above
+ *
+ * Receive wait is the time reads found no byte, including between commands.
+ * With USE_STREAM_RECEIVE the keystream made while waiting counts as both
+ * wait and decrypt. Erase includes pages erased lazily by writes. Phase
+ * times wrap like the core timer, after about 3 minutes at 48 MHz.
+ */
+
+// send the phase times, counts, and events
+BOOT_CODE static void BootCommandStats(Boot_t * bs)
+{
+    // on entry, the 'T' command byte is already read...
+    uint32_t i, events;
 
-    // final ACK
     ACK(ACK_OK);
+    bs->transmittedCrc = 0;
+
+    BootWriteBinary(bs, TICKS_PER_MILLISECOND, 4);
+    BootWriteBinary(bs, STAT_PHASES, 1);
+    for (i = 0; i < STAT_PHASES; ++i)
+        BootWriteBinary(bs, bs->statTicks[i], 4);
+    BootWriteBinary(bs, bs->pageEraseAttemptCount, 4);
+    BootWriteBinary(bs, bs->pageEraseFailureCount, 4);
+    BootWriteBinary(bs, STAT_COUNTS, 1);
+    for (i = 0; i < STAT_COUNTS; ++i)
+        BootWriteBinary(bs, bs->statCounts[i], 4);
+
+    events = bs->eventCount < STATS_EVENTS ? bs->eventCount : STATS_EVENTS;
+    BootWriteBinary(bs, events, 1);
+    for (i = bs->eventCount - events; i != bs->eventCount; ++i)
+    {
+        BootWriteBinary(bs, bs->eventTicks[i & (STATS_EVENTS-1)], 4);
+        BootWriteBinary(bs, bs->eventData[i & (STATS_EVENTS-1)], 4);
+    }
 
+    // CRC of the reply, sent outside it
+    bs->computedCrc = bs->transmittedCrc;
+    BootWriteBinary(bs, bs->computedCrc, 4);
 }
+#endif
+
+#ifdef USE_BAUD_CHANGE
+// change baud rate on request from the flasher
+// the new rate must be within about 3% of the requested one
+BOOT_CODE static void BootCommandBaud(Boot_t * bs)
+{
+    // on entry, the 'R' command byte is already read...
+
+    // get four rate bytes, big endian
+    bs->readPos = 0;
+    while (bs->readPos < 4)
+    {
+        if (BootUARTReadByte(bs, &bs->buffer[bs->readPos]))
+            bs->readPos++;
+    }
+    uint32_t rate =
+        (bs->buffer[0]<<24) | (bs->buffer[1]<<16) |
+        (bs->buffer[2]<< 8) | (bs->buffer[3]    );
+
+    // same clock divider math as BootUARTInit, rounded
+    uint32_t divider = 0, actual = 0;
+    if (rate != 0)
+        divider = (SYS_CLOCK + 2*rate)/(4*rate);
+    if (divider != 0)
+        actual = SYS_CLOCK/(4*divider);
+    if (divider == 0 || divider > 0x10000 || // U1BRG is 16 bits
+        divider - 1 == U1BRG ||
+        32*(actual > rate ? actual - rate : rate - actual) > rate)
+    {
+        BootDebugPrintE("Baud rate unchanged");
+        ACK(ACK_OK);
+        return;
+    }
+
+    ACK(ACK_BAUD_CHANGE);
+    BootUARTFlush(); // let the ACK leave at the old rate
+
+    uint32_t oldDivider = U1BRG; // to go back to
+    U1BRG = divider - 1;
+
+#ifdef USE_RX_DMA
+    // drop anything garbled by the switch
+    BootRxDmaDrop(bs);
+#endif
+#ifdef USE_RAM_NVM
+    bs->rxTail = bs->rxHead;
+#endif
+
+    // flasher confirms with ACK_OK at the new rate
+    BootStartTimer(&(bs->timeoutTimerMs), TICKS_PER_MILLISECOND);
+    while (BootUpdateTimer(&(bs->timeoutTimerMs)) < BAUD_CONFIRM_MS)
+    {
+        if (BootUARTReadByte(bs, bs->buffer) && bs->buffer[0] == ACK_OK)
+        {
+            ACK(ACK_OK);
+            return;
+        }
+    }
 
+    // no answer, go back, dropping what arrived at the wrong rate
+    U1BRG = oldDivider;
+#ifdef USE_RX_DMA
+    BootRxDmaDrop(bs);
+#endif
+#ifdef USE_RAM_NVM
+    bs->rxTail = bs->rxHead;
+#endif
+    BootDebugPrintE("Baud rate not confirmed");
+    NACK(NACK_SEQUENCE_ERROR);
+}
+#endif
 
 /*
  * Command Loop - this is a loop, in client/server mode, Flasher sends command,
@@ -2066,11 +5059,28 @@ BOOT_CODE static void BootRunCommandLoop(Boot_t * bs)
     // set the packet counter back to zero
     bs->packetCounter = 0;
     bs->writesFinished = false;
+    bs->bootPageErased = false;
+#ifdef USE_WRITE_WINDOW
+    bs->nextSequence = 0;
+#endif
+#ifdef USE_COUNTER_PACKETS
+    bs->counterPacket = 0;
+#endif
+#ifdef USE_LAZY_ERASE
+    bs->lazyErase = false;
+#endif
+#ifdef USE_JOURNAL
+    bs->sessionSet = false;
+    bs->journalOn = false;
+#endif
+#ifdef USE_BINARY_MODE
+    bs->binaryMode = false;
+#endif
     
     while (1)
     {
         // get command on timeout
-        while (!BootUARTReadByte(bs->buffer))
+        while (!BootUARTReadByte(bs, bs->buffer))
         {
             // do nothing
         }
@@ -2081,25 +5091,74 @@ BOOT_CODE static void BootRunCommandLoop(Boot_t * bs)
                 // BootDebugPrintE("Information command");
                 BootCommandInfo(bs);
                 break;
+#ifdef USE_BINARY_MODE
+            case 'F' : // information as binary
+                BootCommandBinaryInfo(bs);
+                break;
+#endif
             case 'E' : // erase
                 //BootDebugPrintE("Erase command");
                 BootCommandErase(bs);
-                bs->packetCounter = 0;
-                bs->writesFinished = false;
                 break;
+            case 'P' : // erase page ranges
+                BootCommandRangeErase(bs);
+                break;
+#ifdef USE_LAZY_ERASE
+            case 'L' : // erase pages as written
+                BootCommandLazyErase(bs);
+                break;
+#endif
             case 'C' : // CRC everything
                 BootCommandCRC(bs);
                 break;
+            case 'M' : // CRC each page
+                BootCommandManifest(bs);
+                break;
+#ifdef USE_JOURNAL
+            case 'J' : // name the session, get its progress
+                BootCommandJournal(bs);
+                break;
+            case 'U' : // resume the journaled session
+                BootCommandResume(bs);
+                break;
+#endif
+#ifdef USE_BLANK_CHECK
+            case 'K' : // find pages not blank
+                BootCommandBlankCheck(bs);
+                break;
+#endif
+#ifdef USE_STATS
+            case 'T' : // phase times and events
+                BootCommandStats(bs);
+                break;
+#endif
             case 'W' : // write
                 //BootDebugPrintE("Write command");
-                BootCommandWrite(bs);
+                BootCommandWrite(bs, false, false);
+                break;
+#ifdef USE_WRITE_WINDOW
+            case 'S' : // sequenced write
+                BootCommandWrite(bs, true, false);
+                break;
+#endif
+#ifdef USE_COUNTER_PACKETS
+            case 'A' : // addressed write
+                BootCommandWrite(bs, false, true);
                 break;
+#endif
+#ifdef USE_BAUD_CHANGE
+            case 'R' : // baud rate
+                BootCommandBaud(bs);
+                break;
+#endif
             case 'Q' : // quit
                 //BootDebugPrintE("Quit command");
                 return;
             case ACK_OK :// ACK - late entry? if so, ACK back to resync
                 ACK(ACK_OK);
                 break;
+            case 0 : // break from a flasher still trying to connect
+                break;
             default :
 #ifdef DEBUG_BOOTLOADER
                 BootDebugPrint("DEVICE: Unknown command ");
@@ -2112,19 +5171,111 @@ BOOT_CODE static void BootRunCommandLoop(Boot_t * bs)
     }
 }
 
+#ifdef USE_AUTOBAUD
+// time the next low pulse on the receive pin. ACK_OK (0xFC) goes out LSB first,
+// so the start bit and two zero bits make a pulse 3 bit times long.
+// return the pulse length in core timer ticks, or 0 if no pulse started
+// within a millisecond or it was too long to be a sync byte
+BOOT_CODE static uint32_t BootAutobaudPulse()
+{
+    uint32_t start, width;
+
+    // start in the idle high state, else we are mid byte
+    if (AUTOBAUD_RX_PIN == 0)
+        return 0;
+
+    start = BootReadTimer();
+    while (AUTOBAUD_RX_PIN != 0)
+    {
+        if (BootReadTimer() - start > TICKS_PER_MILLISECOND)
+            return 0;
+    }
+
+    start = BootReadTimer();
+    while (AUTOBAUD_RX_PIN == 0)
+    {
+        if (BootReadTimer() - start > TICKS_PER_MILLISECOND)
+            return 0; // break or noise
+    }
+    width = BootReadTimer() - start;
+    return width;
+}
+#endif
+
+#ifdef USE_FAST_BOOT
+// decide at power on whether to open the listen window, before any other
+// hardware is set. Return true if a flasher may be present or the application
+// is missing, else false to start the application at once
+BOOT_CODE static bool BootListenNeeded()
+{
+    uint32_t start;
+    bool low = false;
+
+    FAST_BOOT_PULLUPS_ON();
+
+    start = BootReadTimer();
+    while (BootReadTimer() - start < FAST_BOOT_SETTLE_US*(TICKS_PER_MILLISECOND/1000))
+        ;
+
+    // any low sample counts, costing at worst an unneeded listen window
+    start = BootReadTimer();
+    while (BootReadTimer() - start < FAST_BOOT_SAMPLE_US*(TICKS_PER_MILLISECOND/1000))
+    {
+        if (FAST_BOOT_RX_PIN == 0)
+            low = true;
+#ifdef FAST_BOOT_STRAP_PIN
+        if (FAST_BOOT_STRAP_PIN == 0)
+            low = true;
+#endif
+    }
+
+    FAST_BOOT_PULLUPS_OFF();
+
+    if (low)
+        return true;
+
+    // stops at the first programmed word, so is quick for a present application
+    return BootPageBlank(FLASH_START + BOOTLOADER_SIZE);
+}
+#endif
+
 // see if a flash attempt is occurring
 // return true if it is, else false if none detected or timeout happens
 BOOT_CODE static bool BootDetectFlashingAttempt(Boot_t * bs)
 {
+#ifdef USE_AUTOBAUD
+    uint32_t width, widthSum = 0, widthCount = 0;
+#endif
+
     BootStartTimer(&(bs->timeoutTimerMs), TICKS_PER_MILLISECOND);
 
     while (BootUpdateTimer(&(bs->timeoutTimerMs)) < BOOT_WAIT_MS)
     {
-        if (BootUARTReadByte(bs->buffer) && bs->buffer[0] == ACK_OK)
+        if (BootUARTReadByte(bs, bs->buffer) && bs->buffer[0] == ACK_OK)
         {
             ACK(ACK_OK);
             return true;
         }
+#ifdef USE_AUTOBAUD
+        // the flasher repeats ACK_OK until answered, so sync bytes
+        // garbled at the old rate are followed by ones at the new rate
+        width = BootAutobaudPulse();
+        if (width != 0)
+        {
+            widthSum += width;
+            if (++widthCount == AUTOBAUD_SAMPLES)
+            {
+                // core timer ticks at SYS_CLOCK/2, so width = 3*(SYS_CLOCK/2)/baud,
+                // and the divider SYS_CLOCK/(4*baud) is width/6, rounded
+                width = (widthSum + 3*AUTOBAUD_SAMPLES)/(6*AUTOBAUD_SAMPLES);
+                // faster than the compiled rate is beyond the polling
+                if (width >= SYS_CLOCK/(4*DESIRED_BAUDRATE) &&
+                    width <= SYS_CLOCK/(4*AUTOBAUD_MIN_BAUDRATE))
+                    U1BRG = width - 1;
+                widthSum = widthCount = 0;
+            }
+        }
+#endif
     }
 
 #ifdef DEBUG_BOOTLOADER
@@ -2162,29 +5313,57 @@ BOOT_CODE static void BootSoftReset()
     /* set SWRST bit to arm reset */
     RSWRSTSET = 1;
     /* read RSWRST register to trigger reset */
-    unsigned int dummy;
-    dummy = RSWRST;
+    (void)RSWRST;
 
     /* prevent any unwanted code execution until reset occurs*/
     while(1);
 }
 
+#ifdef USE_HANDOFF
+// called by the application to reset into bootloader command mode, without
+// a power cycle or the listen window. Does not return
+BOOT_CODE void BootloaderRequestEntry()
+{
+    __builtin_disable_interrupts();
+    DMACONSET = 1<<12; // suspend DMA, as BootSoftReset assumes
+    BOOT_HANDOFF = BOOT_HANDOFF_MAGIC;
+    BootSoftReset();
+}
+#endif
+
 // run the bootloader
 BOOT_ENTRY FIX_ADDRESS(BOOT_LOGICAL_ADDRESS) uint8_t BootloaderEntry()
 {
+    // reasons to run after other than a power on reset
+    bool handoff = false, staged = false;
+#ifdef USE_HANDOFF
+    // application asked for the bootloader before a software reset
+    handoff = BOOT_HANDOFF == BOOT_HANDOFF_MAGIC;
+#endif
+#ifdef USE_STAGING
+    // application left an image to copy into place
+    staged = BootStagedReady();
+#endif
+
     // assume power check succeeds, set reason
     bootResult = BOOT_RESULT_POWER_EXIT;
     
     // if not power on reset, jump to user code (old boot code from application)
-    if ((RCON & 0x0003) == 0)
-        return; // jump to app code
+    if ((RCON & 0x0003) == 0 && !handoff && !staged)
+        return bootResult; // jump to app code
 
     // assume power check succeeds, set reason
     bootResult = BOOT_RESULT_ASSUMPTIONS_FAILED;
 
     // check assumptions about memory, etc., are met
     if (BootTestAssumptions() == false)
-        return; // jump to app code
+        return bootResult; // jump to app code
+
+#ifdef USE_HANDOFF
+    // the word is known reserved now, so clear it to act for one reset only
+    if (handoff)
+        BOOT_HANDOFF = 0;
+#endif
 
     // set current return code
     bootResult = BOOT_RESULT_STARTED;
@@ -2192,6 +5371,14 @@ BOOT_ENTRY FIX_ADDRESS(BOOT_LOGICAL_ADDRESS) uint8_t BootloaderEntry()
     // start timing events
     BootWriteTimer(0);
 
+#ifdef USE_FAST_BOOT
+    if (!handoff && !staged && !BootListenNeeded())
+    {
+        bootResult = BOOT_RESULT_FAST_EXIT;
+        return bootResult; // jump to app code
+    }
+#endif
+
     // keep all memory on stack to prevent linker from
     // reserving RAM. There is one global variable for the
     // application to read. It also has the effect of
@@ -2204,24 +5391,58 @@ BOOT_ENTRY FIX_ADDRESS(BOOT_LOGICAL_ADDRESS) uint8_t BootloaderEntry()
 
     Boot_t * bs = (Boot_t*)(space+5);
 
-    while (((uint32_t)(bs->buffer)) & (3))
+    while (((uintptr_t)&(bs->buffer)) & (3))
     {
         // move one byte ahead
         bs = (Boot_t*)(((uint8_t*)bs)+1);
     }
 
+#if WRITE_PACKET_PAGES > 1
+    bs->buffer = (uint8_t*)(0xA0000000 + BULK_RAM_OFFSET);
+#endif
+
+#if defined(USE_RX_DMA) || defined(USE_RAM_NVM)
+    // receive ring, filled by DMA or during flash operations
+#if WRITE_PACKET_PAGES > 1
+    uint8_t * rxRing = (uint8_t*)(0xA0000000 + BULK_RAM_OFFSET + BULK_BUFFER_SIZE);
+#else
+    uint8_t rxRing[RX_RING_SIZE];
+#endif
+#endif
+
     // 1. init listening hardware
     if (BootSetHardware())
     {
+#ifdef USE_RX_DMA
+        BootRxDmaStart(bs, rxRing);
+#endif
+#ifdef USE_RAM_NVM
+        BootRamNvmStart(bs, rxRing);
+#endif
         BootDebugPrintE("Hardware set");
         // show LED if present
         LED_ON();
 
         // needs erased before writing is allowed
         bs->flashErased = false;
+#ifdef USE_STATS
+        BootStatReset(bs);
+#endif
+#ifdef USE_STAGING
+        bs->stagedRead = 0;
+        bs->stagedCheck = false;
+
+        // a copied image starts at once, a failed copy is left to the flasher
+        if (staged)
+            staged = BootCommitStaged(bs);
+#endif
 
         // 2. See if flashing attempted
-        if (BootDetectFlashingAttempt(bs))
+        // after a handoff the flasher is already sending sync bytes, so
+        // answer at once instead of listening
+        if (handoff && !staged)
+            ACK(ACK_OK);
+        if (!staged && (handoff || BootDetectFlashingAttempt(bs)))
         {
             BootWriteVersion();
 
@@ -2240,11 +5461,27 @@ BOOT_ENTRY FIX_ADDRESS(BOOT_LOGICAL_ADDRESS) uint8_t BootloaderEntry()
     else
         bootResult = BOOT_SET_HARDWARE_FAILED;
 
+#ifdef USE_RX_DMA
+    // DMA must not write into the stack once the application owns it
+    BootRxDmaStop();
+#endif
+#ifdef USE_RAM_NVM
+    BootRamNvmStop();
+#endif
+
     // 4. zero used memory to avoid leaks. Still leaks return addresses and some stack stuff
     // count down to end on zero, which is more likely then to be the value left on the stack
     int i;
+#if WRITE_PACKET_PAGES > 1
+    for (i = BUFFER_SIZE; i > 0; i--)
+        bs->buffer[i-1] = 0;
+#endif
     for (i = sizeof(Boot_t); i > 0; i--)
         ((uint8_t*)(bs))[i-1] = 0;
+#if defined(USE_RX_DMA) || defined(USE_RAM_NVM)
+    for (i = RX_RING_SIZE; i > 0; i--)
+        rxRing[i-1] = 0;
+#endif
 
     // todo - some options
     // infinite loop till power cycle if flashed
@@ -2255,6 +5492,13 @@ BOOT_ENTRY FIX_ADDRESS(BOOT_LOGICAL_ADDRESS) uint8_t BootloaderEntry()
     BootPrintSerial(flashText03);
     ENDLINE();
 
+    // the application gets the UART, and its startup code the RAM
+    BootUARTFlush();
+#ifdef USE_TX_RING
+    for (i = TX_RING_SIZE; i > 0; i--)
+        BOOT_TX->txRing[i-1] = 0;
+#endif
+
     // reset device
     //BootDebugPrint("and resetting device...");
     //BootSoftReset();
@@ -52,6 +52,18 @@ uint8_t BootloaderEntry();
 // one return variable at bottom of ram. See the C file for values.
 extern __attribute__((section(".hcram"))) uint8_t bootResult;
 
+// reset into the bootloader command mode, for an application told to update.
+// Needs USE_HANDOFF in the C file. Does not return
+void BootloaderRequestEntry();
+
+// staged updates, needing USE_STAGING in the C file. Erase the staging
+// region, store the image stream a word at a time at its byte offset, then
+// finish with the stream length and CRC32K. The bootloader copies the image
+// into place on the next reset. Each returns true on success
+bool BootStagingErase();
+bool BootStagingWrite(uint32_t offset, uint32_t word);
+bool BootStagingFinish(uint32_t length, uint32_t crc);
+
 // check assumptions needed for proper bootloader functioning.
 // return true on success, else false
 bool BootTestAssumptions();
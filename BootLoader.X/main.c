@@ -97,14 +97,14 @@ bool UARTReadByte(uint8_t * byte)
     return false;
     } // UARTReadByte
 
-// blocking call to write byte to UART
+// write byte to UART, only waiting while the transmit FIFO is full
 void UARTWriteByteMain(char byte)
 {
 #ifdef HC_UART1
-        while (!U1STAbits.TRMT);   // wait till bit clear, then ready to transmit
+        while (U1STAbits.UTXBF);   // wait till transmit FIFO has room
         U1TXREG = byte; // write a byte
 #else
-        while (!U2STAbits.TRMT);   // wait till bit clear, then ready to transmit
+        while (U2STAbits.UTXBF);   // wait till transmit FIFO has room
         U2TXREG = byte; // write a byte
 #endif
 }
@@ -184,6 +184,66 @@ void InitializeUART(int clock)
     SetUARTClockDivider(clockDivider);
 }
 
+/*********************** staged update ****************************************/
+// define this to have the 'U' command stage an image sent by the flasher,
+// for the bootloader to copy into place on the next reset. Needs USE_STAGING
+// in BootLoader.c, and the application linked below the staging region
+// #define TEST_STAGING
+
+#ifdef TEST_STAGING
+#define STAGE_CHUNK_SIZE 1024 // must match the flasher
+
+uint8_t UARTReadByteWait()
+{
+    uint8_t byte;
+    while (!UARTReadByte(&byte))
+        ;
+    return byte;
+}
+
+// receive the stream length and CRC32K, big endian, then the stream in
+// chunks. Each chunk is stored before asking for the next, so no byte
+// arrives while the CPU stalls on flash. Resets once the image is staged
+void StageImage()
+{
+    static uint8_t chunk[STAGE_CHUNK_SIZE+3];
+    uint32_t length = 0, crc = 0, offset, count, i;
+    bool ok;
+
+    ok = BootStagingErase();
+    PrintSerialMain(ok ? "Staging ready\r\n" : "Staging failed\r\n");
+    if (!ok)
+        return;
+
+    for (i = 0; i < 4; ++i)
+        length = (length<<8) | UARTReadByteWait();
+    for (i = 0; i < 4; ++i)
+        crc = (crc<<8) | UARTReadByteWait();
+
+    for (offset = 0; offset < length; offset += count)
+    {
+        count = length - offset < STAGE_CHUNK_SIZE ? length - offset : STAGE_CHUNK_SIZE;
+        for (i = 0; i < count; ++i)
+            chunk[i] = UARTReadByteWait();
+        for (i = count; (i & 3) != 0; ++i)
+            chunk[i] = 0xFF; // pad the last word as erased flash
+        for (i = 0; i < count && ok; i += 4)
+            ok = BootStagingWrite(offset + i,
+                chunk[i] | (chunk[i+1]<<8) | (chunk[i+2]<<16) | ((uint32_t)chunk[i+3]<<24));
+        PrintSerialMain("Staged chunk\r\n");
+    }
+
+    if (ok)
+        ok = BootStagingFinish(length, crc);
+    PrintSerialMain(ok ? "Staging finished\r\n" : "Staging failed\r\n");
+    if (ok)
+    {
+        while (!U1STAbits.TRMT); // let the line go out first
+        SoftReset();
+    }
+}
+#endif
+
 /*********************** main code ********************************************/
 
 // initialize hardware
@@ -244,6 +304,10 @@ int main(void)
 {
     // BootloaderEntry();
 
+    // after a power on reset the bootloader zeroes the core timer, so this
+    // is the time from BootloaderEntry to here, crt0 startup included
+    uint32_t bootTicks = ReadCoreTimer();
+
     Initialize();
 
     sprintf(text,"\r\n\r\nHypnocube Boot Loader testing ver %s.\r\n",BootloaderVersion());
@@ -251,6 +315,9 @@ int main(void)
 
     sprintf(text,"Boot loader result %d.\r\n",(int)bootResult);
     PrintSerialMain(text);
+
+    sprintf(text,"Boot to main %lu us.\r\n",(unsigned long)(bootTicks/(TICKS_PER_MILLISECOND/1000)));
+    PrintSerialMain(text);
     
     WriteCoreTimer(0);
     while (1)
@@ -263,11 +330,20 @@ int main(void)
         }
         uint8_t byte;
         
-        if (UARTReadByte(&byte) && byte != 0xFC)
+        // skip flasher sync bytes and the breaks between them
+        if (UARTReadByte(&byte) && byte != 0xFC && byte != 0)
         {
             sprintf(text,"Main code saw command %d = %c.\r\n",(int)byte,byte);
             PrintSerialMain(text);
-            BootloaderEntry(); // call again to simplify testing
+            if (byte == 'B')
+            {
+                while (!U1STAbits.TRMT); // let the line go out first
+                BootloaderRequestEntry(); // reset into the bootloader
+            }
+#ifdef TEST_STAGING
+            if (byte == 'U')
+                StageImage();
+#endif
         }
     }
 
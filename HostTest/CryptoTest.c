@@ -0,0 +1,313 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Hypnocube, LLC
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// checks the bootloader's ChaCha against known answer vectors, the ones
+// ChaCha.cs checks the flasher with, then against a plain reference block
+// function over many keys, block counters, lengths and alignments, so the configured BootCryptoKeystream and BootCryptoXor
+// (word or byte version, see USE_FAST_CRYPTO) decrypt as the flasher
+// encrypts. Also checks BootCrc32AddBytes, at the configured
+// CRC_BITS_PER_STEP, against a bit at a time CRC32K
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "HostModel.h"
+#include "BootLoader.c" // last, its xc.h drops __attribute__
+
+#ifndef USE_CRYPTO
+#error CryptoTest needs USE_CRYPTO
+#endif
+
+// key, IV, and the first two keystream blocks, as hex
+typedef struct
+{
+    const char * key;
+    const char * iv;
+    int rounds;
+    const char * keystream;
+} Vector_t;
+
+static const Vector_t vectors[] =
+{
+    {
+        "0000000000000000000000000000000000000000000000000000000000000000",
+        "0000000000000000", 20,
+        "76b8e0ada0f13d90405d6ae55386bd28bdd219b8a08ded1aa836efcc8b770dc7"
+        "da41597c5157488d7724e03fb8d84a376a43b8f41518a11cc387b669b2ee6586"
+        "9f07e7be5551387a98ba977c732d080dcb0f29a048e3656912c6533e32ee7aed"
+        "29b721769ce64e43d57133b074d839d531ed1f28510afb45ace10a1f4b794d6f"
+    },
+    {
+        "0100000000000000000000000000000000000000000000000000000000000000",
+        "0000000000000000", 20,
+        "c5d30a7ce1ec119378c84f487d775a8542f13ece238a9455e8229e888de85bbd"
+        "29eb63d0a17a5b999b52da22be4023eb07620a54f6fa6ad8737b71eb0464dac0"
+        "10f656e6d1fd55053e50c4875c9930a33f6d0263bd14dfd6ab8c70521c19338b"
+        "2308b95cf8d0bb7d202d2102780ea3528f1cb48560f76b20f382b942500fceac"
+    },
+    {
+        "0000000000000000000000000000000000000000000000000000000000000000",
+        "0100000000000000", 20,
+        "ef3fdfd6c61578fbf5cf35bd3dd33b8009631634d21e42ac33960bd138e50d32"
+        "111e4caf237ee53ca8ad6426194a88545ddc497a0b466e7d6bbdb0041b2f586b"
+        "5305e5e44aff19b235936144675efbe4409eb7e8e5f1430f5f5836aeb49bb532"
+        "8b017c4b9dc11f8a03863fa803dc71d5726b2b6b31aa32708afe5af1d6b69058"
+    },
+    {
+        "ffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffffff",
+        "ffffffffffffffff", 20,
+        "d9bf3f6bce6ed0b54254557767fb57443dd4778911b606055c39cc25e674b836"
+        "3feabc57fde54f790c52c8ae43240b79d49042b777bfd6cb80e931270b7f50eb"
+        "5bac2acd86a836c5dc98c116c1217ec31d3a63a9451319f097f3b4d6dab07787"
+        "19477d24d24b403a12241d7cca064f790f1d51ccaff6b1667d4bbca1958c4306"
+    },
+    {
+        "5555555555555555555555555555555555555555555555555555555555555555",
+        "aaaaaaaaaaaaaaaa", 20,
+        "aff7418293f3a553894b1e7484bd1e8ede196eced5a1d6814de37091e07e076e"
+        "34bbba8107a686c982850f0a7353940d40db1ab0b5765b78b4cf473d9485a3dd"
+        "6d59fd1245da46c59ce5444087c0fbf97c0a2f7f9518850d5e6c19efdf5e2e0b"
+        "984dd9887b5c55e4fe3e37f606a484b8eca3d48ea633f55ee7a7b49d118d9249"
+    },
+    {
+        "5555555555555555555555555555555555555555555555555555555555555555",
+        "aaaaaaaaaaaaaaaa", 20,
+        "aff7418293f3a553894b1e7484bd1e8ede196eced5a1d6814de37091e07e076e"
+        "34bbba8107a686c982850f0a7353940d40db1ab0b5765b78b4cf473d9485a3dd"
+        "6d59fd1245da46c59ce5444087c0fbf97c0a2f7f9518850d5e6c19efdf5e2e0b"
+        "984dd9887b5c55e4fe3e37f606a484b8eca3d48ea633f55ee7a7b49d118d9249"
+    },
+    {
+        "00112233445566778899aabbccddeeffffeeddccbbaa99887766554433221100",
+        "0f1e2d3c4b596877", 20,
+        "87fa92061043ca5e631fedd88e8bfb84ad6b213bdee4bc806e2764935fb89097"
+        "218a897b7aead10e1b17f6802b2abdd95594903083735613d6b3531b9e0d1b67"
+        "47908c74f018f6e182138b991b9c5a957c69f23c26c8a2fbb8b0acf8e64222cc"
+        "251281a61cff673608de6490b41ca1b9f4ab754474f9afc7c35dcd65de3d745f"
+    },
+    {
+        "c46ec1b18ce8a878725a37e780dfb7351f68ed2e194c79fbc6aebee1a667975d",
+        "1ada31d5cf688221", 20,
+        "f63a89b75c2271f9368816542ba52f06ed49241792302b00b5e8f80ae9a473af"
+        "c25b218f519af0fdd406362e8d69de7f54c604a6e00f353f110f771bdca8ab92"
+        "e5fbc34e60a1d9a9db17345b0a402736853bf910b060bdf1f897b6290f01d138"
+        "ae2c4c90225ba9ea14d518f55929dea098ca7a6ccfe61227053c84e49a4a3332"
+    },
+    {
+        "00000000000000000000000000000000",
+        "0000000000000000", 8,
+        "e28a5fa4a67f8c5defed3e6fb7303486aa8427d31419a729572d777953491120"
+        "b64ab8e72b8deb85cd6aea7cb6089a101824beeb08814a428aab1fa2c816081b"
+        "8a26af448a1ba906368fd8c83831c18cec8ced811a028e675b8d2be8fce08116"
+        "5ceae9f1d1b7a975497749480569ceb83de6a0a587d4984f19925f5d338e430d"
+    },
+    {
+        "00000000000000000000000000000000",
+        "0000000000000000", 12,
+        "e1047ba9476bf8ff312c01b4345a7d8ca5792b0ad467313f1dc412b5fdce3241"
+        "0dea8b68bd774c36a920f092a04d3f95274fbeff97bc8491fcef37f85970b450"
+        "1d43b61a8f7e19fceddef368ae6bfb11101bd9fd3e4d127de30db2db1b472e76"
+        "426803a45e15b962751986ef1d9d50f598a5dcdc9fa529a28357991e784ea20f"
+    }
+};
+
+static uint32_t failures = 0;
+
+static void Check(bool passed, const char * what, int index)
+{
+    if (!passed)
+    {
+        printf("FAIL: %s, case %d\n", what, index);
+        failures++;
+    }
+}
+
+static uint32_t FromHex(const char * text, uint8_t * bytes)
+{
+    uint32_t length = 0;
+    unsigned value;
+    while (sscanf(text + 2*length, "%2x", &value) == 1)
+        bytes[length++] = value;
+    return length;
+}
+
+// xor the known keystream over zeros, a block at a time as the bootloader
+// decrypts a packet
+static void KnownAnswers(void)
+{
+    Crypto_t cs;
+    uint8_t key[32], iv[8], expected[128], stream[128];
+    uint32_t keyLength, n, i;
+
+    for (n = 0; n < sizeof(vectors)/sizeof(vectors[0]); ++n)
+    {
+        keyLength = FromHex(vectors[n].key, key);
+        FromHex(vectors[n].iv, iv);
+        FromHex(vectors[n].keystream, expected);
+
+        memset(stream, 0, sizeof(stream));
+        BootCryptoSetKeyAndInitializationVector(&cs, key, 8*keyLength, iv);
+        for (i = 0; i < sizeof(stream); i += 64)
+        {
+            BootCryptoKeystream(&cs, vectors[n].rounds);
+            BootCryptoXor(&cs, stream + i, stream + i, 64);
+        }
+        Check(memcmp(stream, expected, sizeof(stream)) == 0, "known answer", n);
+    }
+    printf("%u known answer vectors\n", n);
+}
+
+static uint32_t seed = 12345;
+static uint32_t Random(void)
+{
+    seed = seed*1103515245 + 12345;
+    return seed >> 8;
+}
+
+// one ChaCha block of the 16 word state, written out plainly as the
+// reference, since the bootloader keeps only its configured version
+#define REF_QUARTERROUND(a,b,c,d) \
+  x[a] += x[b]; x[d] = ROTATE(x[d]^x[a],16); \
+  x[c] += x[d]; x[b] = ROTATE(x[b]^x[c],12); \
+  x[a] += x[b]; x[d] = ROTATE(x[d]^x[a], 8); \
+  x[c] += x[d]; x[b] = ROTATE(x[b]^x[c], 7)
+static void ReferenceBlock(const uint32_t * input, uint8_t * output, int rounds)
+{
+    uint32_t x[16];
+    int i;
+
+    memcpy(x, input, sizeof(x));
+    for (i = rounds; i > 0; i -= 2)
+    {
+        REF_QUARTERROUND( 0, 4, 8,12);
+        REF_QUARTERROUND( 1, 5, 9,13);
+        REF_QUARTERROUND( 2, 6,10,14);
+        REF_QUARTERROUND( 3, 7,11,15);
+        REF_QUARTERROUND( 0, 5,10,15);
+        REF_QUARTERROUND( 1, 6,11,12);
+        REF_QUARTERROUND( 2, 7, 8,13);
+        REF_QUARTERROUND( 3, 4, 9,14);
+    }
+    for (i = 0; i < 16; ++i)
+    {
+        x[i] += input[i];
+        output[4*i]     = (uint8_t)x[i];
+        output[4*i + 1] = (uint8_t)(x[i] >> 8);
+        output[4*i + 2] = (uint8_t)(x[i] >> 16);
+        output[4*i + 3] = (uint8_t)(x[i] >> 24);
+    }
+}
+
+// compare against ReferenceBlock, with block counters near the 32 bit
+// carry, lengths short of a block, and buffers off word alignment
+static void Reference(void)
+{
+    Crypto_t cs, ref;
+    uint8_t key[32], iv[8], block[64];
+    uint8_t message[72], cypher[72], expected[72];
+    uint32_t n, i, length, offset;
+
+    for (n = 0; n < 1000; ++n)
+    {
+        for (i = 0; i < sizeof(key); ++i)
+            key[i] = Random();
+        for (i = 0; i < sizeof(iv); ++i)
+            iv[i] = Random();
+        for (i = 0; i < sizeof(message); ++i)
+            message[i] = Random();
+        BootCryptoSetKeyAndInitializationVector(&cs, key, n&1 ? 128 : 256, iv);
+        cs.state[12] = n%3 == 0 ? 0xFFFFFFFF : Random();
+        cs.state[13] = Random();
+        ref = cs;
+
+        length = 1 + Random()%64;
+        offset = Random()%8;
+        ReferenceBlock(ref.state, block, CRYPTO_ROUNDS);
+        for (i = 0; i < length; ++i)
+            expected[i] = message[offset + i] ^ block[i];
+
+        memcpy(cypher, message, sizeof(cypher));
+        BootCryptoKeystream(&cs, CRYPTO_ROUNDS);
+        if (n & 2) // in place, as the bootloader does
+            BootCryptoXor(&cs, cypher + offset, cypher + offset, length);
+        else
+            BootCryptoXor(&cs, message + offset, cypher + (offset^4), length);
+        Check(memcmp(cypher + (n & 2 ? offset : offset^4), expected, length) == 0, "reference", n);
+
+        // the 64 bit block counter moved on by one
+        Check(cs.state[12] == ref.state[12] + 1 &&
+            cs.state[13] == ref.state[13] + (ref.state[12] == 0xFFFFFFFF), "counter", n);
+    }
+    printf("%u reference blocks, %d rounds\n", n, CRYPTO_ROUNDS);
+}
+
+// bit at a time CRC32K, the first byte in the high bits
+static uint32_t Crc32K(const uint8_t * data, uint32_t length, uint32_t crc)
+{
+    int bit;
+    while (length-- > 0)
+    {
+        crc ^= (uint32_t)(*data++) << 24;
+        for (bit = 0; bit < 8; ++bit)
+            crc = crc & 0x80000000U ? (crc << 1)^0x741B8CD7U : crc << 1;
+    }
+    return crc;
+}
+
+// every alignment and length up to a few words, chained from a random CRC
+static void CrcReference(void)
+{
+    uint8_t data[64];
+    uint32_t i, offset, length, crc, n = 0;
+
+    for (i = 0; i < sizeof(data); ++i)
+        data[i] = Random();
+    for (offset = 0; offset < 4; ++offset)
+        for (length = 0; length + offset <= sizeof(data); ++length, ++n)
+        {
+            crc = Random();
+            Check(BootCrc32AddBytes(data + offset, length, crc) ==
+                Crc32K(data + offset, length, crc), "CRC", n);
+        }
+    printf("%u CRCs, %d bits per step\n", n, CRC_BITS_PER_STEP);
+}
+
+int main(void)
+{
+#ifdef USE_FAST_CRYPTO
+    printf("word at a time ChaCha\n");
+#else
+    printf("byte at a time ChaCha\n");
+#endif
+    KnownAnswers();
+    Reference();
+    CrcReference();
+    if (failures != 0)
+    {
+        printf("crypto test FAILED\n");
+        return 1;
+    }
+    printf("crypto test passed\n");
+    return 0;
+}
@@ -0,0 +1,571 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Hypnocube, LLC
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// register model of a PIC32MX150F128B for running the bootloader on a host
+// see HostModel.h
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#include "HostModel.h"
+#include <xc.h> // the host model one, last since it drops __attribute__
+
+// memories, physical address and size, each seen at KSEG0 and KSEG1
+#define RAM_PHYSICAL   0x00000000
+#define RAM_SIZE       0x8000
+#define FLASH_PHYSICAL 0x1D000000
+#define FLASH_SIZE     0x20000
+#define BOOT_PHYSICAL  0x1FC00000
+#define BOOT_SIZE      0xC00
+#define KSEG0          0x80000000
+#define KSEG1          0xA0000000
+
+// NVMCON bits and operations
+#define NVMCON_WRERR   (1<<13)
+#define NVMCON_LVDERR  (1<<12)
+#define NVMOP_NOP      0
+#define NVMOP_WORD     1
+#define NVMOP_ROW      3
+#define NVMOP_PAGE     4
+
+#define ROW_SIZE  128
+#define PAGE_SIZE 1024
+
+// plain registers
+volatile uint32_t U1BRG, U1MODE, U1STA, U1RXR, RPA0R, U2TXREG;
+volatile uint32_t LATACLR, TRISASET, TRISACLR, ANSELACLR, CNPUASET, CNPUACLR;
+volatile uint32_t NVMADDR, NVMDATA, NVMSRCADDR;
+volatile uint32_t BMXPFMSZ, BMXDRMSZ, BMXBOOTSZ, BMXDKPBA, BMXDUDBA, BMXDUPBA;
+volatile uint32_t RCON, RCONCLR, SYSKEY, RSWRST, RSWRSTSET;
+volatile uint32_t IFS1CLR, DMACON, DCH0CON, DCH0ECON, DCH0SSA, DCH0DSA;
+volatile uint32_t DCH0SSIZ, DCH0DSIZ, DCH0CSIZ;
+volatile __U1STAbits_t U2STAbits;
+volatile __DEVIDbits_t DEVIDbits;
+volatile __PORTAbits_t PORTAbits;
+volatile __PORTBbits_t PORTBbits;
+
+HostStats_t hostStats;
+
+// simulated time in core timer ticks, and the core timer's offset from it
+static uint64_t now, timerBase;
+
+// register writes with side effects land in these, and take effect on the
+// next access to a modeled register. TX holds NO_BYTE when empty
+#define NO_BYTE 0xFFFFFFFF
+static volatile uint32_t txWrite = NO_BYTE;
+static volatile uint32_t dmaconSet, dmaconClr, dmaIntClr;
+static volatile uint32_t nvmconSet, nvmconClr, nvmKeyWrite;
+
+// registers read through the model
+static volatile __U1STAbits_t u1staBits;
+static volatile uint32_t u1rxreg, dmaPointer, dmaInt, nvmcon;
+
+// bytes queued by the host, and when the next one finishes arriving
+static uint8_t * sendBytes;
+static uint32_t sendHead, sendCount, sendSize;
+static uint64_t rxDoneTime;
+
+// receive FIFO when DMA is off
+static uint8_t rxFifo[HOST_UART_FIFO];
+static uint32_t rxFifoCount;
+
+// transmit FIFO, then the byte in the shift register until txDoneTime
+static uint8_t txFifo[HOST_UART_FIFO];
+static uint32_t txFifoCount;
+static bool txShifting;
+static uint8_t txShiftByte;
+static uint64_t txDoneTime;
+
+// NVM unlock keys written since the last operation, and the running one
+static uint32_t nvmKeys[2], nvmKeyCount;
+static bool nvmBusy;
+static uint64_t nvmStartTime, nvmDoneTime;
+
+static void (*hostReceiver)(uint8_t byte);
+static uint32_t (*hostRingTail)(void);
+
+// core timer ticks for one byte, start bit, 8 data bits, stop bit, with the
+// high speed 4x divider BootUARTInit sets
+static uint64_t HostByteTicks(void)
+{
+    return 10ULL*4*(U1BRG + 1)/2;
+}
+
+uint8_t * HostPhysical(uint32_t address)
+{
+    return (uint8_t *)(uintptr_t)(address | KSEG1);
+}
+
+// map size bytes of a new shared memory at both the KSEG0 and KSEG1 views of
+// the physical address, filled with fill
+static void HostMap(const char * name, uint32_t physical, uint32_t size, uint8_t fill)
+{
+    size_t pages = (size + 4095) & ~4095UL;
+    int fd = memfd_create(name, 0);
+    if (fd < 0 || ftruncate(fd, pages) != 0)
+    {
+        perror("memfd");
+        exit(2);
+    }
+    uint32_t base[2] = {KSEG0 | physical, KSEG1 | physical};
+    int i;
+    for (i = 0; i < 2; ++i)
+    {
+        void * p = mmap((void *)(uintptr_t)base[i], pages, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_FIXED_NOREPLACE, fd, 0);
+        if (p != (void *)(uintptr_t)base[i])
+        {
+            fprintf(stderr, "cannot map %s at %08X\n", name, base[i]);
+            exit(2);
+        }
+    }
+    memset((void *)(uintptr_t)base[1], fill, pages);
+    close(fd);
+}
+
+void HostClearStats(void)
+{
+    memset(&hostStats, 0, sizeof(hostStats));
+}
+
+void HostModelInit(void)
+{
+    HostMap("ram", RAM_PHYSICAL, RAM_SIZE, 0);
+    HostMap("flash", FLASH_PHYSICAL, FLASH_SIZE, 0xFF);
+    HostMap("boot", BOOT_PHYSICAL, BOOT_SIZE, 0xFF);
+    HostReset();
+}
+
+void HostReset(void)
+{
+    BMXPFMSZ = FLASH_SIZE;
+    BMXDRMSZ = RAM_SIZE;
+    BMXBOOTSZ = BOOT_SIZE;
+    DEVIDbits.DEVID = 0x4A01053;
+    DEVIDbits.VER = 1;
+    RCON = 3; // power on reset
+    PORTAbits.RA4 = 1; // receive line idle
+    U1BRG = 0;
+    DMACON = DCH0CON = 0;
+    dmaPointer = dmaInt = 0;
+    nvmcon = 0;
+    nvmBusy = false;
+    nvmKeyCount = 0;
+    txWrite = NO_BYTE;
+    dmaconSet = dmaconClr = dmaIntClr = nvmconSet = nvmconClr = 0;
+    nvmKeyWrite = NO_BYTE;
+    sendHead = sendCount = 0;
+    rxFifoCount = txFifoCount = 0;
+    txShifting = false;
+    now = timerBase = 0;
+    hostReceiver = 0;
+    hostRingTail = 0;
+    HostClearStats();
+}
+
+uint64_t HostNow(void)
+{
+    return now;
+}
+
+void HostSetReceiver(void (*receiver)(uint8_t byte))
+{
+    hostReceiver = receiver;
+}
+
+void HostSetRingTail(uint32_t (*ringTail)(void))
+{
+    hostRingTail = ringTail;
+}
+
+void HostSend(const uint8_t * bytes, uint32_t length)
+{
+    if (sendCount + length > sendSize)
+    {
+        sendSize = 2*(sendCount + length);
+        sendBytes = realloc(sendBytes, sendSize);
+    }
+    if (sendHead == sendCount)
+    { // line idle, so the first byte starts now
+        sendHead = sendCount = 0;
+        rxDoneTime = now + HostByteTicks();
+    }
+    memcpy(sendBytes + sendCount, bytes, length);
+    sendCount += length;
+}
+
+// a byte from the host has arrived, hand it to the DMA or the FIFO
+static void HostDeliver(uint8_t byte)
+{
+    hostStats.rxBytes++;
+    if (nvmBusy)
+        hostStats.rxBytesDuringNvm++;
+
+    if ((DMACON & (1<<15)) && (DCH0CON & (1<<7)))
+    { // DMA channel 0 moves it into the ring
+        uint32_t size = DCH0DSIZ != 0 ? DCH0DSIZ : 65536;
+        HostPhysical(DCH0DSA)[dmaPointer] = byte;
+        dmaPointer = (dmaPointer + 1) % size;
+        if (dmaPointer == size/2)
+            dmaInt |= 1<<4; // first half filled
+        else if (dmaPointer == 0)
+            dmaInt |= 1<<5; // second half filled
+        if (hostRingTail != 0)
+        {
+            uint32_t fill = (dmaPointer + size - hostRingTail()) % size;
+            if (fill == 0)
+                hostStats.ringOverflows++; // caught up with the reader
+            if (fill > hostStats.maxRingFill)
+                hostStats.maxRingFill = fill;
+        }
+        return;
+    }
+
+    if (rxFifoCount == HOST_UART_FIFO)
+    {
+        u1staBits.OERR = 1;
+        hostStats.rxOverruns++;
+        return;
+    }
+    rxFifo[rxFifoCount++] = byte;
+}
+
+// start the NVM operation in nvmcon, if unlocked
+static void HostNvmStart(void)
+{
+    uint32_t us;
+    bool unlocked = nvmKeyCount >= 2 &&
+        nvmKeys[0] == 0xAA996655 && nvmKeys[1] == 0x556699AA;
+    nvmKeyCount = 0;
+
+    if (!unlocked || (nvmcon & NVMCON_WREN) == 0)
+    {
+        nvmcon = (nvmcon & ~NVMCON_WR) | NVMCON_WRERR;
+        hostStats.nvmErrors++;
+        return;
+    }
+
+    switch (nvmcon & 15)
+    {
+        case NVMOP_WORD : us = HOST_WORD_PROGRAM_US; break;
+        case NVMOP_ROW  : us = HOST_ROW_PROGRAM_US; break;
+        case NVMOP_PAGE : us = HOST_PAGE_ERASE_US; break;
+        default         : us = 1; break;
+    }
+    nvmBusy = true;
+    nvmStartTime = now;
+    nvmDoneTime = now + us*HOST_TICKS_PER_US;
+}
+
+// true if size bytes at the physical address are all program or boot flash
+static bool HostInFlash(uint32_t address, uint32_t size)
+{
+    return
+        (FLASH_PHYSICAL <= address && address + size <= FLASH_PHYSICAL + FLASH_SIZE) ||
+        (BOOT_PHYSICAL  <= address && address + size <= BOOT_PHYSICAL + BOOT_SIZE);
+}
+
+// program size bytes at the flash address, return false if outside flash
+static bool HostProgram(uint32_t address, const uint8_t * data, uint32_t size)
+{
+    uint32_t i;
+    if (!HostInFlash(address, size))
+        return false;
+    uint8_t * flash = HostPhysical(address);
+    for (i = 0; i < size; i += 4)
+    {
+        if (*(uint32_t *)(flash + i) != 0xFFFFFFFF)
+            hostStats.nvmOverwrites++;
+        *(uint32_t *)(flash + i) &= *(const uint32_t *)(data + i);
+    }
+    return true;
+}
+
+// the running NVM operation is done, change flash
+static void HostNvmFinish(void)
+{
+    bool ok = true;
+    uint32_t word = NVMDATA;
+
+    nvmBusy = false;
+    hostStats.nvmBusyTicks += nvmDoneTime - nvmStartTime;
+    switch (nvmcon & 15)
+    {
+        case NVMOP_NOP :
+            nvmcon &= ~(NVMCON_WRERR | NVMCON_LVDERR);
+            break;
+        case NVMOP_WORD :
+            hostStats.nvmWords++;
+            ok = (NVMADDR & 3) == 0 && HostProgram(NVMADDR, (uint8_t *)&word, 4);
+            break;
+        case NVMOP_ROW :
+            hostStats.nvmRows++;
+            ok = (NVMADDR & (ROW_SIZE - 1)) == 0 && NVMSRCADDR + ROW_SIZE <= RAM_SIZE &&
+                HostProgram(NVMADDR, HostPhysical(NVMSRCADDR), ROW_SIZE);
+            break;
+        case NVMOP_PAGE :
+            hostStats.nvmErases++;
+            ok = (NVMADDR & (PAGE_SIZE - 1)) == 0 && HostInFlash(NVMADDR, PAGE_SIZE);
+            if (ok)
+                memset(HostPhysical(NVMADDR), 0xFF, PAGE_SIZE);
+            break;
+        default :
+            ok = false;
+            break;
+    }
+    nvmcon &= ~NVMCON_WR;
+    if (!ok)
+    {
+        nvmcon |= NVMCON_WRERR;
+        hostStats.nvmErrors++;
+    }
+}
+
+// the shift register is free, start the next queued byte
+static void HostTxNext(uint64_t time)
+{
+    if (txShifting || txFifoCount == 0)
+        return;
+    txShiftByte = txFifo[0];
+    memmove(txFifo, txFifo + 1, --txFifoCount);
+    txShifting = true;
+    txDoneTime = time + HostByteTicks();
+}
+
+// apply the register writes waiting since the last access
+static void HostApplyWrites(void)
+{
+    if (txWrite != NO_BYTE)
+    {
+        if (txFifoCount == HOST_UART_FIFO)
+            hostStats.txOverflows++;
+        else
+            txFifo[txFifoCount++] = (uint8_t)txWrite;
+        txWrite = NO_BYTE;
+        HostTxNext(now);
+    }
+    if (dmaconSet != 0 || dmaconClr != 0)
+    {
+        DMACON = (DMACON | dmaconSet) & ~dmaconClr;
+        dmaconSet = dmaconClr = 0;
+    }
+    if (dmaIntClr != 0)
+    {
+        dmaInt &= ~dmaIntClr;
+        dmaIntClr = 0;
+    }
+    if (nvmKeyWrite != NO_BYTE)
+    {
+        nvmKeys[0] = nvmKeys[1];
+        nvmKeys[1] = nvmKeyWrite;
+        if (nvmKeyCount < 2)
+            nvmKeyCount++;
+        nvmKeyWrite = NO_BYTE;
+    }
+    if (nvmconClr != 0)
+    {
+        nvmcon &= ~nvmconClr;
+        nvmconClr = 0;
+    }
+    if (nvmconSet != 0)
+    {
+        uint32_t set = nvmconSet;
+        nvmconSet = 0;
+        nvmcon |= set & ~NVMCON_WR;
+        if ((set & NVMCON_WR) && !nvmBusy)
+        {
+            nvmcon |= NVMCON_WR;
+            HostNvmStart();
+        }
+    }
+}
+
+// run the line and the NVM controller up to the current time, in order
+static void HostRun(void)
+{
+    while (1)
+    {
+        uint64_t next = UINT64_MAX;
+        int event = 0;
+        if (sendHead < sendCount && rxDoneTime < next)
+        {
+            next = rxDoneTime;
+            event = 1;
+        }
+        if (txShifting && txDoneTime < next)
+        {
+            next = txDoneTime;
+            event = 2;
+        }
+        if (nvmBusy && nvmDoneTime < next)
+        {
+            next = nvmDoneTime;
+            event = 3;
+        }
+        if (next > now)
+            break;
+
+        if (event == 1)
+        {
+            HostDeliver(sendBytes[sendHead++]);
+            rxDoneTime += HostByteTicks();
+        }
+        else if (event == 2)
+        {
+            uint8_t byte = txShiftByte;
+            txShifting = false;
+            hostStats.txBytes++;
+            HostTxNext(txDoneTime);
+            if (hostReceiver != 0)
+            {
+                uint64_t saved = now;
+                now = next; // replies are sent from when the byte came
+                hostReceiver(byte);
+                now = saved;
+            }
+        }
+        else
+            HostNvmFinish();
+    }
+}
+
+// an access to a modeled register
+static void HostStep(void)
+{
+    HostApplyWrites();
+    now += HOST_ACCESS_TICKS;
+    HostRun();
+}
+
+void HostFlush(void)
+{
+    HostApplyWrites();
+    while (sendHead < sendCount || txShifting || txFifoCount != 0 || nvmBusy)
+    {
+        now += HOST_ACCESS_TICKS;
+        HostRun();
+    }
+}
+
+volatile __U1STAbits_t * HostU1STAbits(void)
+{
+    HostStep();
+    u1staBits.URXDA = rxFifoCount != 0;
+    u1staBits.UTXBF = txFifoCount == HOST_UART_FIFO;
+    u1staBits.TRMT  = txFifoCount == 0 && !txShifting;
+    u1staBits.RIDLE = sendHead == sendCount;
+    return &u1staBits;
+}
+
+volatile uint32_t * HostU1RXREG(void)
+{
+    HostStep();
+    if (rxFifoCount != 0)
+    {
+        u1rxreg = rxFifo[0];
+        memmove(rxFifo, rxFifo + 1, --rxFifoCount);
+    }
+    return &u1rxreg;
+}
+
+volatile uint32_t * HostU1TXREG(void)
+{
+    HostStep();
+    return &txWrite;
+}
+
+volatile uint32_t * HostDCH0DPTR(void)
+{
+    HostStep();
+    return &dmaPointer;
+}
+
+volatile uint32_t * HostDCH0INT(void)
+{
+    HostStep();
+    return &dmaInt;
+}
+
+volatile uint32_t * HostDCH0INTCLR(void)
+{
+    HostStep();
+    return &dmaIntClr;
+}
+
+volatile uint32_t * HostDMACONSET(void)
+{
+    HostStep();
+    return &dmaconSet;
+}
+
+volatile uint32_t * HostDMACONCLR(void)
+{
+    HostStep();
+    return &dmaconClr;
+}
+
+volatile uint32_t * HostNVMCON(void)
+{
+    HostStep();
+    return &nvmcon;
+}
+
+volatile uint32_t * HostNVMCONSET(void)
+{
+    HostStep();
+    return &nvmconSet;
+}
+
+volatile uint32_t * HostNVMCONCLR(void)
+{
+    HostStep();
+    return &nvmconClr;
+}
+
+volatile uint32_t * HostNVMKEY(void)
+{
+    HostStep();
+    return &nvmKeyWrite;
+}
+
+uint32_t HostCoreTimer(void)
+{
+    HostStep();
+    return (uint32_t)(now - timerBase);
+}
+
+void HostSetCoreTimer(uint32_t ticks)
+{
+    HostStep();
+    timerBase = now - ticks;
+}
+
+// the model has no interrupts, so the status to restore is all off
+uint32_t HostDisableInterrupts(void)
+{
+    return 0;
+}
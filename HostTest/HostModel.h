@@ -0,0 +1,121 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Hypnocube, LLC
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * File:   HostModel.h
+ *
+ * Register level model of the parts of a PIC32MX150F128B the bootloader
+ * uses, for running BootLoader.c on a Linux host:
+ *   - RAM, program flash and boot flash mapped at their KSEG0 and KSEG1
+ *     addresses, so the bootloader's fixed addresses work unchanged
+ *   - the core timer, counting simulated time at SYS_CLOCK/2
+ *   - UART1, with the far end of the line played by the test through
+ *     HostSend and a receive callback, bytes taking ten bit times at the
+ *     rate set in U1BRG, and 4 byte receive and transmit FIFOs
+ *   - DMA channel 0 moving received bytes into the ring set up in
+ *     BootRxDmaStart
+ *   - the NVM controller, with the unlock sequence, word, row and page
+ *     operations taking their datasheet times, and programming only
+ *     clearing bits as flash does
+ *
+ * Simulated time moves on by HOST_ACCESS_TICKS for each access to a modeled
+ * register. Computing costs nothing, so the model shows what overlaps with
+ * what, not how long the PIC32 takes to decrypt or CRC.
+ */
+
+#ifndef HOSTMODEL_H
+#define	HOSTMODEL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// must match BootLoader.c, core timer ticks at half the system clock
+#define HOST_SYS_CLOCK 48000000L
+#define HOST_TICKS_PER_US (HOST_SYS_CLOCK/2000000)
+
+// core timer ticks for each access to a modeled register
+#define HOST_ACCESS_TICKS 2
+
+// NVM operation times, PIC32MX1xx datasheet typical figures
+#define HOST_WORD_PROGRAM_US   20
+#define HOST_ROW_PROGRAM_US  2000
+#define HOST_PAGE_ERASE_US  20000
+
+// UART FIFO depth, as BootLoader.c assumes
+#define HOST_UART_FIFO 4
+
+// totals since HostModelInit or HostClearStats
+typedef struct
+{
+    // bytes delivered to the device, and those that arrived while an NVM
+    // operation was running
+    uint32_t rxBytes, rxBytesDuringNvm;
+    // bytes lost to a full receive FIFO, or written over in the DMA ring
+    // before the bootloader read them (needs HostSetRingTail)
+    uint32_t rxOverruns, ringOverflows;
+    // most bytes waiting in the DMA ring
+    uint32_t maxRingFill;
+    // bytes the device sent, and ones written with the FIFO full
+    uint32_t txBytes, txOverflows;
+    // NVM word writes, row writes, page erases, and failed operations
+    uint32_t nvmWords, nvmRows, nvmErases, nvmErrors;
+    // words programmed that were not blank, so did not take their value
+    uint32_t nvmOverwrites;
+    // core timer ticks with an NVM operation running
+    uint64_t nvmBusyTicks;
+} HostStats_t;
+
+extern HostStats_t hostStats;
+
+// map the memories, erase flash, and reset
+void HostModelInit(void);
+
+// a power on reset, the registers back to their reset state, simulated time
+// back to 0, and anything being sent dropped. Memory is kept
+void HostReset(void);
+
+// clear hostStats
+void HostClearStats(void);
+
+// simulated core timer ticks since HostModelInit
+uint64_t HostNow(void);
+
+// queue bytes for the device, sent back to back at the current baud rate
+void HostSend(const uint8_t * bytes, uint32_t length);
+
+// set the function called with each byte the device sends, as its stop bit
+// ends. It may call HostSend
+void HostSetReceiver(void (*receiver)(uint8_t byte));
+
+// set the function giving the DMA ring index the bootloader reads next, so
+// ring use and overflows are tracked
+void HostSetRingTail(uint32_t (*ringTail)(void));
+
+// run simulated time until everything queued in both directions is sent
+void HostFlush(void);
+
+// host pointer for a physical PIC32 address
+uint8_t * HostPhysical(uint32_t address);
+
+#endif	/* HOSTMODEL_H */
@@ -0,0 +1,125 @@
+﻿#if false
+The MIT License (MIT)
+
+Copyright (c) 2015 Hypnocube, LLC
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+
+#endif
+using System;
+using System.Collections.Generic;
+using System.IO;
+
+namespace Hypnocube.PICFlasher
+{
+    /// <summary>
+    /// Makes images from hex files as the flasher does, without a device, so
+    /// what MakeImage does to real images can be checked on the host. For
+    /// each hex file it prints the row and word writes the bootloader makes
+    /// for the image before and after the blocks are row aligned, then makes
+    /// the image again LZ77 compressed and appends each compressed packet to
+    /// the blocks file for LZTest to expand, in records of
+    ///   4 bytes  : little endian payload length P
+    ///   P bytes  : the payload, the stream then address, length L and CRC
+    ///   4 bytes  : little endian data length L
+    ///   L bytes  : the data the stream must expand to
+    /// Usage: ImageTest picType bootSize packetSize blocks.bin files.hex...
+    /// where bootSize is the program flash the bootloader reserves, and
+    /// packetSize the write packet data size, both as the info command
+    /// reports them, such as 0x3000 and 4096
+    /// </summary>
+    static class ImageTest
+    {
+        static int Main(string[] args)
+        {
+            PicDefs.PicType picType;
+            uint bootLength, packetSize;
+            if (args.Length < 5 || !PicDefs.TryParse(args[0], out picType) ||
+                !UInt32.TryParse(args[1].Replace("0x", ""), System.Globalization.NumberStyles.HexNumber, null, out bootLength) ||
+                !UInt32.TryParse(args[2], out packetSize))
+            {
+                Console.WriteLine("Usage: ImageTest picType bootSize packetSize blocks.bin files.hex...");
+                return 2;
+            }
+            var picDef = PicDefs.GetPicDetails(picType);
+            Func<List<byte>, ulong, ulong> trim = (data, address) => Trim(picDef, bootLength, data, address);
+
+            var failed = false;
+            using (var blocks = new BinaryWriter(File.Create(args[3])))
+            {
+                for (var i = 4; i < args.Length; ++i)
+                {
+                    Console.WriteLine("{0}:", args[i]);
+                    var image = new MakeImage().CreateFromFile(args[i], picDef, trim, null, packetSize, false, bootLength);
+                    var compressed = new MakeImage().CreateFromFile(args[i], picDef, trim, null, packetSize, true, bootLength);
+                    if (image == null || compressed == null || image.Blocks.Count != compressed.Blocks.Count)
+                    {
+                        failed = true;
+                        continue;
+                    }
+
+                    // the packets match up, both images having the blocks in order
+                    for (var n = 0; n < image.Blocks.Count; ++n)
+                    {
+                        var packed = compressed.Blocks[n];
+                        if ((packed[1] & 0x80) == 0)
+                            continue;
+                        var block = image.Blocks[n];
+                        var length = (block[block.Length - 6] << 8) | block[block.Length - 5];
+                        blocks.Write(packed.Length - 3);
+                        blocks.Write(packed, 3, packed.Length - 3);
+                        blocks.Write(length);
+                        blocks.Write(block, 3, length);
+                    }
+                }
+            }
+            return failed ? 1 : 0;
+        }
+
+        /// <summary>
+        /// Trim the data to program flash after the bootloader and to boot
+        /// flash before the configuration page, as the flasher does
+        /// </summary>
+        static ulong Trim(PicDefs.PicDef picDef, uint bootLength, List<byte> data, ulong address)
+        {
+            var start = address;
+            var end = address + (ulong) data.Count;
+            var regions = new[]
+            {
+                Tuple.Create((ulong) picDef.FlashStart + bootLength, (ulong) picDef.FlashStart + picDef.FlashSize),
+                Tuple.Create((ulong) picDef.BootStart,
+                    (ulong) picDef.BootStart + ((picDef.BootSize - 1) & ~(picDef.FlashPageSize - 1)))
+            };
+            foreach (var region in regions)
+            {
+                if (start < region.Item2 && region.Item1 < end)
+                {
+                    var from = Math.Max(start, region.Item1);
+                    var to = Math.Min(end, region.Item2);
+                    var kept = data.GetRange((int) (from - start), (int) (to - from));
+                    data.Clear();
+                    data.AddRange(kept);
+                    return from;
+                }
+            }
+            data.Clear();
+            return 0;
+        }
+    }
+}
@@ -0,0 +1,140 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Hypnocube, LLC
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// expands, with the bootloader's BootDecompress, the compressed write
+// packets ImageTest made from hex files with the flasher's LZ77Compressor,
+// in a buffer of the max packet size plus 10 bytes, the room the flasher
+// leaves for expanding in place. Each must give the packet's data. Also
+// checks malformed streams are refused. Run with the blocks file ImageTest
+// wrote, or with no file for the malformed streams only
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "HostModel.h"
+#include "BootLoader.c" // last, its xc.h drops __attribute__
+
+#ifndef USE_COMPRESSION
+#error LZTest needs USE_COMPRESSION
+#endif
+
+#define EXPAND_SIZE (MAX_PACKET_SIZE + 10)
+
+// a stream and what BootDecompress must return for it
+typedef struct
+{
+    uint8_t stream[8];
+    uint32_t length;
+    const char * name;
+} Malformed_t;
+
+static const Malformed_t malformed[] =
+{
+    {{3}, 1, "too short"},
+    {{0, 0xFF, 1, 2, 3}, 5, "no length bits"},
+    {{8, 0xFF, 1, 2, 3}, 5, "too many length bits"},
+    {{3, 0x00, 0x10}, 3, "pair before the start"},
+    {{3, 0x01, 0x41, 0x07}, 4, "pair runs over the unread stream"},
+    {{0x13, 0x00, 0x10}, 3, "16-bit pair cut short"},
+};
+
+// the malformed streams expand to 0, in a buffer just holding them
+static bool Malformed(void)
+{
+    static uint8_t buffer[8];
+    uint32_t i, out;
+    bool ok = true;
+    for (i = 0; i < sizeof(malformed)/sizeof(malformed[0]); ++i)
+    {
+        memcpy(buffer, malformed[i].stream, malformed[i].length);
+        out = BootDecompress(buffer, malformed[i].length, malformed[i].length);
+        if (out != 0)
+        {
+            printf("FAIL: %s stream expanded to %u bytes\n", malformed[i].name, out);
+            ok = false;
+        }
+    }
+    printf("%u malformed streams\n", i);
+    return ok;
+}
+
+static bool ReadLength(FILE * file, uint32_t * length)
+{
+    uint8_t bytes[4];
+    if (fread(bytes, 1, 4, file) != 4)
+        return false;
+    *length = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | ((uint32_t)bytes[3] << 24);
+    return true;
+}
+
+// expand each packet in the ImageTest blocks file
+static bool Expand(const char * filename)
+{
+    static uint8_t buffer[EXPAND_SIZE], data[EXPAND_SIZE];
+    uint32_t payload, length, declared, out, packets = 0, failed = 0;
+    uint64_t streamBytes = 0, dataBytes = 0;
+    FILE * file = fopen(filename, "rb");
+    if (file == NULL)
+    {
+        printf("FAIL: cannot open %s\n", filename);
+        return false;
+    }
+
+    while (ReadLength(file, &payload))
+    {
+        if (payload < 12 || payload > EXPAND_SIZE || fread(buffer, 1, payload, file) != payload ||
+            !ReadLength(file, &length) || length > EXPAND_SIZE || fread(data, 1, length, file) != length)
+        {
+            printf("FAIL: %s is corrupt\n", filename);
+            fclose(file);
+            return false;
+        }
+
+        // the length in the payload is the one the bootloader checks against
+        declared = (buffer[payload - 6] << 8) | buffer[payload - 5];
+        out = BootDecompress(buffer, payload - 10, EXPAND_SIZE);
+        if (declared != length || out != length || memcmp(buffer, data, length) != 0)
+        {
+            printf("FAIL: packet %u expands to %u bytes, wanted %u\n", packets, out, length);
+            failed++;
+        }
+        packets++;
+        streamBytes += payload - 10;
+        dataBytes += length;
+    }
+    fclose(file);
+
+    printf("%u compressed packets, %llu stream bytes expanding to %llu\n",
+        packets, (unsigned long long)streamBytes, (unsigned long long)dataBytes);
+    return failed == 0;
+}
+
+int main(int argc, char ** argv)
+{
+    bool ok = Malformed();
+    if (argc > 1)
+        ok &= Expand(argv[1]);
+    printf("%s\n", ok ? "LZ test passed" : "LZ test FAILED");
+    return ok ? 0 : 1;
+}
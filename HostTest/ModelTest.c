@@ -0,0 +1,803 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Hypnocube, LLC
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+// runs the bootloader command loop against the register model, with this
+// file playing the flasher: connect, erase, send an image as windowed 'S'
+// write packets, and quit. Checks flash holds the image, and reports how
+// much of the image arrived while flash was being programmed or erased
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "HostModel.h"
+#include "BootLoader.c" // last, its xc.h drops __attribute__
+
+#ifdef USE_RAM_NVM
+#error the model cannot run the MIPS flash routine USE_RAM_NVM copies to RAM
+#endif
+
+// image written, pseudo random with some blank stretches, from the first
+// application page
+#define IMAGE_SIZE   0xC000
+#define PACKET_DATA  MAX_PACKET_SIZE
+#define MAX_PACKETS  (3 + IMAGE_SIZE/PACKET_DATA)
+
+#ifdef USE_WRITE_WINDOW
+#define WINDOW WRITE_WINDOW_SIZE
+#else
+#define WINDOW 1
+#endif
+
+static uint8_t image[IMAGE_SIZE];
+static uint32_t imageAddress;
+
+// the flasher side
+static struct
+{
+    enum { SYNC, NAMING, RESUME, ERASE, WRITE, FINAL, DONE, FAILED } state;
+    uint8_t eraseCommand;
+
+    // 'S' packets, the IV packet first when encrypted, then the final one,
+    // and the flash each writes
+    uint8_t * packet[MAX_PACKETS];
+    uint32_t packetLength[MAX_PACKETS];
+    uint32_t packetAddress[MAX_PACKETS], packetData[MAX_PACKETS];
+    uint32_t packetCount;
+
+    // name the session with 'J' first, and resume it with 'U' instead of
+    // erasing. The link drops once the packets before stopAt are acked
+    bool journal, resume;
+    uint32_t journalCount, stopAt;
+
+    // packets acknowledged, the next new one to send, and replies due
+    bool acked[MAX_PACKETS];
+    uint32_t nextPacket, oldestUnacked, inFlight;
+    uint32_t window, nacks;
+
+    // the first send of this packet, if not 0, has a byte flipped on the line
+    uint32_t corruptPacket;
+
+    uint8_t reply[12];
+    uint32_t replyLength;
+} flasher;
+
+static Boot_t boot;
+
+static void Fail(const char * message)
+{
+    printf("FAIL: %s\n", message);
+    flasher.state = FAILED;
+    // quit, so the command loop returns
+    HostSend((const uint8_t *)"Q", 1);
+}
+
+static void PutBigEndian(uint8_t * bytes, uint32_t value, int count)
+{
+    while (count-- > 0)
+    {
+        bytes[count] = (uint8_t)value;
+        value >>= 8;
+    }
+}
+
+// make an 'S' packet with sequence number and payload
+static void MakePacket(const uint8_t * payload, uint32_t length)
+{
+    uint32_t n = flasher.packetCount++;
+    uint8_t * p = malloc(length + 4);
+    p[0] = 'S';
+    p[1] = (uint8_t)n;
+    PutBigEndian(p + 2, length, 2);
+    memcpy(p + 4, payload, length);
+    flasher.packet[n] = p;
+    flasher.packetLength[n] = length + 4;
+}
+
+// build the image and the packets carrying it, as the flasher would, with
+// one more packet writing boot flash after the image if bootBlock is set
+static void MakePackets(bool bootBlock)
+{
+    static uint8_t payload[PACKET_DATA + 10];
+    uint32_t i, offset, length, crc;
+    uint32_t seed = 12345;
+
+    imageAddress = FLASH_START + BOOTLOADER_SIZE;
+    for (i = 0; i < IMAGE_SIZE; ++i)
+    {
+        seed = seed*1103515245 + 12345;
+        image[i] = (uint8_t)(seed >> 16);
+        if ((i & 0x1FFF) >= 0x1C00)
+            image[i] = 0xFF; // blank stretch, still written
+    }
+
+    memset(&flasher, 0, sizeof(flasher));
+    flasher.window = WINDOW;
+
+#ifdef USE_CRYPTO
+    Crypto_t cs;
+    uint8_t key[32], iv[12] = {1, 2, 3, 4, 5, 6, 7, 8};
+    uint32_t words[8] = {
+        PASSWORD_WORD0, PASSWORD_WORD1, PASSWORD_WORD2, PASSWORD_WORD3,
+        PASSWORD_WORD4, PASSWORD_WORD5, PASSWORD_WORD6, PASSWORD_WORD7};
+    for (i = 0; i < 8; ++i)
+        PutBigEndian(key + 4*i, words[i], 4);
+    BootCryptoSetKeyAndInitializationVector(&cs, key, 256, iv);
+    PutBigEndian(iv + 8, BootCrc32AddBytes(iv, 8, 0), 4);
+    MakePacket(iv, 12);
+#endif
+
+    for (offset = 0; offset < IMAGE_SIZE + (bootBlock ? 4 : 0); offset += length)
+    {
+        length = IMAGE_SIZE - offset < PACKET_DATA ? IMAGE_SIZE - offset : PACKET_DATA;
+        if (offset < IMAGE_SIZE)
+        {
+            memcpy(payload, image + offset, length);
+            PutBigEndian(payload + length, imageAddress + offset, 4);
+        }
+        else
+        { // a word in the second boot flash page
+            length = 4;
+            memset(payload, 0, length);
+            PutBigEndian(payload + length, BOOT_START + FLASH_PAGE_SIZE, 4);
+        }
+        flasher.packetAddress[flasher.packetCount] = imageAddress + offset;
+        flasher.packetData[flasher.packetCount] = length;
+        PutBigEndian(payload + length + 4, length, 2);
+        crc = BootCrc32AddBytes(payload, length + 6, 0);
+        PutBigEndian(payload + length + 6, crc, 4);
+#ifdef USE_CRYPTO
+        // each packet starts a new keystream block
+        for (i = 0; i < length + 10; i += 64)
+        {
+            BootCryptoKeystream(&cs, CRYPTO_ROUNDS);
+            BootCryptoXor(&cs, payload + i, payload + i,
+                    length + 10 - i < 64 ? length + 10 - i : 64);
+        }
+#endif
+        MakePacket(payload, length + 10);
+    }
+
+    MakePacket(payload, 0); // end of packets
+}
+
+// send new packets while the window has room
+static void SendPackets()
+{
+    while (flasher.inFlight < flasher.window && flasher.nextPacket < flasher.packetCount - 1 &&
+           flasher.nextPacket < flasher.oldestUnacked + flasher.window &&
+           (flasher.stopAt == 0 || flasher.nextPacket < flasher.stopAt))
+    {
+        uint8_t * packet = flasher.packet[flasher.nextPacket];
+        uint32_t length = flasher.packetLength[flasher.nextPacket];
+        if (flasher.nextPacket == flasher.corruptPacket && flasher.corruptPacket != 0)
+        { // garbled on the way, the flasher still holds the good copy
+            uint8_t garbled[PACKET_DATA + 14];
+            memcpy(garbled, packet, length);
+            garbled[length/2] ^= 0x10;
+            HostSend(garbled, length);
+        }
+        else
+            HostSend(packet, length);
+        flasher.nextPacket++;
+        flasher.inFlight++;
+    }
+    if (flasher.oldestUnacked == flasher.packetCount - 1 && flasher.state == WRITE)
+    { // all acknowledged, send the end of packets
+        flasher.state = FINAL;
+        HostSend(flasher.packet[flasher.packetCount - 1], flasher.packetLength[flasher.packetCount - 1]);
+        flasher.inFlight++;
+    }
+}
+
+// the reply to a write packet is complete
+static void WriteReply()
+{
+    uint32_t n = flasher.oldestUnacked;
+    // the packet the sequence number is for, at most a window back
+    while ((uint8_t)n != flasher.reply[1])
+    {
+        if (++n == flasher.packetCount)
+        {
+            Fail("reply for a packet not sent");
+            return;
+        }
+    }
+    flasher.inFlight--;
+
+    if (flasher.reply[0] != ACK_OK)
+    {
+        flasher.nacks++;
+        if (flasher.nacks > 10)
+        {
+            Fail("too many NACKs");
+            return;
+        }
+        HostSend(flasher.packet[n], flasher.packetLength[n]);
+        flasher.inFlight++;
+        return;
+    }
+
+    flasher.acked[n] = true;
+    while (flasher.oldestUnacked < flasher.packetCount && flasher.acked[flasher.oldestUnacked])
+        flasher.oldestUnacked++;
+
+    if (flasher.state == FINAL || flasher.oldestUnacked == flasher.stopAt)
+    { // done, or the link drops
+        flasher.state = DONE;
+        HostSend((const uint8_t *)"Q", 1);
+        return;
+    }
+    SendPackets();
+}
+
+// send a 'J' or 'U' command with its value
+static void SendJournalValue(uint8_t command, uint32_t value)
+{
+    uint8_t bytes[9] = {command};
+    PutBigEndian(bytes + 1, value, 4);
+    PutBigEndian(bytes + 5, BootCrc32AddBytes(bytes + 1, 4, 0), 4);
+    HostSend(bytes, 9);
+}
+
+// each byte the bootloader sends
+static void FlasherReceive(uint8_t byte)
+{
+    uint32_t i;
+    switch (flasher.state)
+    {
+        case SYNC :
+            if (byte == ACK_OK && flasher.journal)
+            {
+                flasher.state = NAMING;
+                SendJournalValue('J', 0x12345678);
+            }
+            else if (byte == ACK_OK)
+            {
+                flasher.state = ERASE;
+                HostSend(&flasher.eraseCommand, 1);
+            }
+            break;
+        case NAMING :
+            // ACK_OK, the committed count, and its CRC
+            flasher.reply[flasher.replyLength++] = byte;
+            if (flasher.reply[0] != ACK_OK)
+                Fail("journal refused");
+            else if (flasher.replyLength == 9)
+            {
+                flasher.replyLength = 0;
+                for (i = 1; i < 5; ++i)
+                    flasher.journalCount = (flasher.journalCount << 8) | flasher.reply[i];
+                if (flasher.resume && flasher.journalCount != 0)
+                {
+                    flasher.state = RESUME;
+                    SendJournalValue('U', flasher.journalCount);
+                }
+                else
+                { // all the packets again
+                    memset(flasher.acked, 0, sizeof(flasher.acked));
+                    flasher.nextPacket = flasher.oldestUnacked = 0;
+                    flasher.state = ERASE;
+                    HostSend(&flasher.eraseCommand, 1);
+                }
+            }
+            break;
+        case RESUME :
+            if (byte != ACK_OK)
+            {
+                Fail("resume refused");
+                break;
+            }
+            // carry on after the committed packets
+            for (i = 0; i < flasher.journalCount; ++i)
+                flasher.acked[i] = true;
+            flasher.nextPacket = flasher.oldestUnacked = flasher.journalCount;
+            flasher.state = WRITE;
+            SendPackets();
+            break;
+        case ERASE :
+            // text and page ACKs, until the final reply
+            if (byte == ACK_ERASE_DONE)
+            {
+                flasher.state = WRITE;
+                SendPackets();
+            }
+            else if (byte == NACK_ERASE_FAILED)
+                Fail("erase failed");
+            break;
+        case WRITE :
+        case FINAL :
+            flasher.reply[flasher.replyLength++] = byte;
+            if (flasher.reply[0] == NACK_RECEIVE_TIMEOUT)
+            {
+                if (flasher.replyLength == 3)
+                    Fail("receive timeout");
+                break;
+            }
+            if (flasher.replyLength == (flasher.reply[0] == ACK_OK ? 6 : 2))
+            {
+                WriteReply();
+                flasher.replyLength = 0;
+            }
+            break;
+        default :
+            break;
+    }
+}
+
+static uint32_t RingTail()
+{
+#ifdef USE_RX_DMA
+    return boot.rxTail;
+#else
+    return 0;
+#endif
+}
+
+// connect and run the flasher set up in flasher, with the packets made by
+// MakePackets. Unless the link is set to drop, checks flash holds the image
+static bool Connect(const char * name)
+{
+    Boot_t * bs = &boot;
+    uint32_t i;
+    bool ok = true;
+
+    HostReset();
+    HostSetReceiver(FlasherReceive);
+    HostSetRingTail(RingTail);
+
+    // as BootloaderEntry sets up
+    memset(bs, 0, sizeof(Boot_t));
+#if WRITE_PACKET_PAGES > 1
+    bs->buffer = (uint8_t*)(0xA0000000 + BULK_RAM_OFFSET);
+#endif
+#ifdef USE_RX_DMA
+#if WRITE_PACKET_PAGES > 1
+    uint8_t * rxRing = (uint8_t*)(0xA0000000 + BULK_RAM_OFFSET + BULK_BUFFER_SIZE);
+#else
+    static uint8_t rxRing[RX_RING_SIZE];
+#endif
+#endif
+    BootSetHardware();
+#ifdef USE_RX_DMA
+    BootRxDmaStart(bs, rxRing);
+#endif
+    bs->flashErased = false;
+#ifdef USE_STATS
+    BootStatReset(bs);
+#endif
+
+    uint64_t start = HostNow();
+    HostSend((const uint8_t[]){ACK_OK}, 1);
+    if (!BootDetectFlashingAttempt(bs))
+    {
+        printf("FAIL: no connection\n");
+        return false;
+    }
+    BootRunCommandLoop(bs);
+    HostFlush();
+    uint64_t ticks = HostNow() - start;
+#ifdef USE_RX_DMA
+    BootRxDmaStop();
+#endif
+
+    if (flasher.state != DONE)
+        ok = false;
+    for (i = 0; i < IMAGE_SIZE && flasher.stopAt == 0; ++i)
+    {
+        if (HostPhysical(imageAddress)[i] != image[i])
+        {
+            printf("FAIL: flash differs at %08X\n", imageAddress + i);
+            ok = false;
+            break;
+        }
+    }
+
+    // one byte time at the connected rate
+    uint64_t byteTicks = 10ULL*4*(U1BRG + 1)/2;
+    uint64_t lineTicks = hostStats.rxBytes*byteTicks;
+    printf("%s: %u packets, window %u, %u bytes at %u baud\n", name,
+        flasher.packetCount, flasher.window, hostStats.rxBytes,
+        (unsigned)(SYS_CLOCK/(4*(U1BRG + 1))));
+    printf("  time %.1f ms: line busy %.1f ms, flash busy %.1f ms (%u erases, %u rows, %u words)\n",
+        ticks/(double)TICKS_PER_MILLISECOND, lineTicks/(double)TICKS_PER_MILLISECOND,
+        hostStats.nvmBusyTicks/(double)TICKS_PER_MILLISECOND,
+        hostStats.nvmErases, hostStats.nvmRows, hostStats.nvmWords);
+    printf("  %u bytes (%.0f%%) arrived during flash operations, most waiting %u\n",
+        hostStats.rxBytesDuringNvm, 100.0*hostStats.rxBytesDuringNvm/hostStats.rxBytes,
+        hostStats.maxRingFill);
+    printf("  %u NACKs, %u overruns, %u ring overflows, %u flash errors, %u words programmed twice\n",
+        flasher.nacks, hostStats.rxOverruns, hostStats.ringOverflows,
+        hostStats.nvmErrors, hostStats.nvmOverwrites);
+
+    if ((flasher.nacks != 0 && flasher.corruptPacket == 0) ||
+        hostStats.rxOverruns != 0 || hostStats.ringOverflows != 0 ||
+        hostStats.nvmErrors != 0 || hostStats.nvmOverwrites != 0 || hostStats.txOverflows != 0)
+        ok = false;
+#ifdef USE_RX_DMA
+    if (flasher.window > 1 && hostStats.rxBytesDuringNvm == 0)
+    {
+        printf("FAIL: no bytes received while flash was busy\n");
+        ok = false;
+    }
+#endif
+    return ok;
+}
+
+static void FreePackets()
+{
+    uint32_t i;
+    for (i = 0; i < flasher.packetCount; ++i)
+        free(flasher.packet[i]);
+}
+
+// one flashing session, erasing with the given command
+static bool Session(uint8_t eraseCommand, const char * name)
+{
+    bool ok;
+    MakePackets(false);
+    flasher.eraseCommand = eraseCommand;
+    ok = Connect(name);
+    FreePackets();
+    return ok;
+}
+
+#ifdef USE_WRITE_WINDOW
+// the same session sending one packet at a time, for the time the window saves
+static bool StopAndWait(void)
+{
+    bool ok;
+    MakePackets(false);
+    flasher.eraseCommand = 'E';
+    flasher.window = 1;
+    ok = Connect("stop and wait");
+    FreePackets();
+    return ok;
+}
+#endif
+
+// a packet garbled on the line with others in flight behind it. It must be
+// NACKed and, when encrypted, decrypted again from its own keystream block
+// when resent, so flash still ends up holding the image
+static bool Corrupted(void)
+{
+    bool ok;
+    MakePackets(false);
+    flasher.eraseCommand = 'E';
+    flasher.corruptPacket = 3;
+    ok = Connect("packet garbled, resent");
+    if (flasher.nacks == 0)
+    {
+        printf("FAIL: garbled packet not NACKed\n");
+        ok = false;
+    }
+    FreePackets();
+    return ok;
+}
+
+#ifdef USE_JOURNAL
+// a journaled flash whose link drops while a packet is being programmed,
+// modeled by programming half of it and journaling its range as the
+// bootloader would. Resuming must undo that half before the packet is sent
+// again, so no word is programmed twice. With undoCutShort, a reset also came
+// while the undo had the page erased, so the committed words sharing it are
+// gone, and the flasher must be told to start over
+static bool Resume(bool undoCutShort)
+{
+    uint32_t n, free, half;
+    uint32_t * journal = (uint32_t *)HostPhysical(JOURNAL_START);
+    bool ok;
+
+    MakePackets(false);
+    flasher.eraseCommand = 'E';
+    flasher.journal = true;
+    flasher.stopAt = flasher.packetCount/2;
+    ok = Connect("journaled, link dropped");
+
+    n = flasher.stopAt;
+    for (free = JOURNAL_HEADER_SIZE/4; free < FLASH_PAGE_SIZE/4 && journal[free] != 0xFFFFFFFF; free += 2)
+        ;
+    journal[free] = flasher.packetAddress[n] | JOURNAL_RANGE;
+    journal[free + 1] = flasher.packetData[n];
+    half = flasher.packetData[n]/2;
+    memcpy(HostPhysical(flasher.packetAddress[n]),
+        image + flasher.packetAddress[n] - imageAddress, half);
+    if (undoCutShort)
+    {
+        journal[free + 2] = JOURNAL_UNDO;
+        journal[free + 3] = 0;
+        memset(HostPhysical(flasher.packetAddress[n] & ~(FLASH_PAGE_SIZE-1)), 0xFF, FLASH_PAGE_SIZE);
+    }
+
+    flasher.state = SYNC;
+    flasher.resume = true;
+    flasher.stopAt = 0;
+    flasher.journalCount = 0;
+    flasher.inFlight = 0;
+    ok &= Connect(undoCutShort ? "undo cut short, flashed again" : "resumed");
+    printf("  resumed after %u of %u packets\n", flasher.journalCount, flasher.packetCount);
+    ok &= flasher.journalCount == (undoCutShort ? 0 : n);
+    FreePackets();
+    return ok;
+}
+#endif
+
+#ifdef USE_STAGING
+// stage the packets made by MakePackets as the application would, as a
+// stream of 'W' packets, then have the bootloader copy it as at reset
+// return the BootCommitStaged result
+static bool Stage(bool bootBlock)
+{
+    Boot_t * bs = &boot;
+    uint8_t stream[STAGING_SIZE];
+    uint32_t n, length = 0, offset, word;
+
+    MakePackets(bootBlock);
+    for (n = 0; n < flasher.packetCount; ++n)
+    {
+        stream[length++] = 'W';
+        memcpy(stream + length, flasher.packet[n] + 2, flasher.packetLength[n] - 2);
+        length += flasher.packetLength[n] - 2;
+    }
+
+    HostReset();
+    BootStagingErase();
+    for (offset = 0; offset < length; offset += 4)
+    {
+        for (word = 0, n = 4; n > 0; --n)
+            word = (word << 8) | (offset + n - 1 < length ? stream[offset + n - 1] : 0xFF);
+        BootStagingWrite(offset, word);
+    }
+    BootStagingFinish(length, BootCrc32AddBytes(stream, length, 0));
+    if (!BootStagedReady())
+    {
+        printf("FAIL: staged stream not ready\n");
+        return false;
+    }
+
+    HostClearStats();
+    memset(bs, 0, sizeof(Boot_t));
+#if WRITE_PACKET_PAGES > 1
+    bs->buffer = (uint8_t*)(0xA0000000 + BULK_RAM_OFFSET);
+#endif
+    return BootCommitStaged(bs);
+}
+
+// a good staged image replaces the application, one that would write boot
+// flash is refused before any page is erased, and both are marked done
+static bool Staging(void)
+{
+    bool ok = true, copied;
+    uint32_t i;
+
+    memset(HostPhysical(imageAddress), 0, IMAGE_SIZE); // the old application
+    copied = Stage(false);
+    printf("staged image: %s, %u erases, %u rows\n", copied ? "copied" : "refused",
+        hostStats.nvmErases, hostStats.nvmRows);
+    ok &= copied && memcmp(HostPhysical(imageAddress), image, IMAGE_SIZE) == 0;
+    ok &= !BootStagedReady();
+
+    copied = Stage(true);
+    printf("staged image writing boot flash: %s, %u erases, %u rows\n",
+        copied ? "copied" : "refused", hostStats.nvmErases, hostStats.nvmRows);
+    ok &= !copied && hostStats.nvmErases == 0 && hostStats.nvmRows == 0;
+    for (i = 0; i < IMAGE_SIZE; ++i)
+        ok &= HostPhysical(imageAddress)[i] == image[i];
+    ok &= !BootStagedReady();
+
+    // a read past the end of the stream gets a zero, not the byte after it
+    const uint8_t end[2] = {0x5A, 0xA5};
+    uint8_t byte;
+    boot.stagedRead = end;
+    boot.stagedEnd = end + 1;
+    ok &= BootUARTReadByte(&boot, &byte) && byte == 0x5A;
+    ok &= BootUARTReadByte(&boot, &byte) && byte == 0 && boot.stagedRead > boot.stagedEnd;
+    boot.stagedRead = 0;
+
+    if (!ok)
+        printf("FAIL: staged copy\n");
+    return ok;
+}
+#endif
+
+#ifdef USE_RX_DMA
+// bytes arriving while the bootloader is not reading, as during a long
+// erase. Just under a ring full reads back in order, more than that is seen
+// as an overflow and dropped, and the ring then works as before
+static bool RingOverflow(void)
+{
+    Boot_t * bs = &boot;
+    static uint8_t bytes[RX_RING_SIZE + 1];
+    uint32_t i, read = 0;
+    uint8_t byte;
+    bool ok = true;
+
+    HostReset();
+    memset(bs, 0, sizeof(Boot_t));
+#if WRITE_PACKET_PAGES > 1
+    uint8_t * rxRing = (uint8_t*)(0xA0000000 + BULK_RAM_OFFSET + BULK_BUFFER_SIZE);
+#else
+    static uint8_t rxRing[RX_RING_SIZE];
+#endif
+    BootSetHardware();
+    BootRxDmaStart(bs, rxRing);
+    for (i = 0; i < sizeof(bytes); ++i)
+        bytes[i] = (uint8_t)(i*7 + i/251);
+
+    // two laps, the second starting from the reader's last position
+    for (int lap = 0; lap < 2; ++lap)
+    {
+        HostSend(bytes, RX_RING_SIZE - 1);
+        HostFlush();
+        for (i = 0; i < RX_RING_SIZE - 1; ++i)
+            if (BootUARTReadByte(bs, &byte) && byte == bytes[i])
+                read++;
+    }
+    ok &= read == 2*(RX_RING_SIZE - 1) && !bs->rxOverflow;
+
+    HostSend(bytes, RX_RING_SIZE + 1);
+    HostFlush();
+    ok &= !BootUARTReadByte(bs, &byte) && bs->rxOverflow;
+    ok &= !BootUARTReadByte(bs, &byte); // all dropped
+    printf("receive ring: %u bytes read back, overflow %s\n",
+        read, bs->rxOverflow ? "flagged" : "missed");
+
+    bs->rxOverflow = false;
+    HostSend(bytes, RX_RING_SIZE - 1);
+    HostFlush();
+    for (i = 0; i < RX_RING_SIZE - 1; ++i)
+        ok &= BootUARTReadByte(bs, &byte) && byte == bytes[i];
+    ok &= !bs->rxOverflow;
+    BootRxDmaStop();
+
+    if (!ok)
+        printf("FAIL: receive ring overflow\n");
+    return ok;
+}
+#endif
+
+#ifdef USE_BAUD_CHANGE
+static uint8_t baudReplies[8];
+static uint32_t baudReplyCount;
+
+static void BaudReceive(uint8_t byte)
+{
+    if (baudReplyCount < sizeof(baudReplies))
+        baudReplies[baudReplyCount++] = byte;
+}
+
+// a baud rate change the flasher never confirms. The bootloader must go back
+// to the old rate and say so there
+static bool BaudNotConfirmed(void)
+{
+    Boot_t * bs = &boot;
+    const uint8_t rate[4] = {0x00, 0x1E, 0x84, 0x80}; // 2000000
+    uint32_t oldDivider;
+    bool ok;
+
+    HostReset();
+    HostSetReceiver(BaudReceive);
+    baudReplyCount = 0;
+    memset(bs, 0, sizeof(Boot_t));
+#if WRITE_PACKET_PAGES > 1
+    bs->buffer = (uint8_t*)(0xA0000000 + BULK_RAM_OFFSET);
+#endif
+#ifdef USE_RX_DMA
+#if WRITE_PACKET_PAGES > 1
+    uint8_t * rxRing = (uint8_t*)(0xA0000000 + BULK_RAM_OFFSET + BULK_BUFFER_SIZE);
+#else
+    static uint8_t rxRing[RX_RING_SIZE];
+#endif
+#endif
+    BootSetHardware();
+#ifdef USE_RX_DMA
+    BootRxDmaStart(bs, rxRing);
+#endif
+    oldDivider = U1BRG;
+
+    HostSend(rate, 4);
+    BootCommandBaud(bs);
+    BootUARTFlush();
+    HostFlush();
+#ifdef USE_RX_DMA
+    BootRxDmaStop();
+#endif
+
+    ok = U1BRG == oldDivider && baudReplyCount == 2 &&
+        baudReplies[0] == ACK_BAUD_CHANGE && baudReplies[1] == NACK_SEQUENCE_ERROR;
+    printf("baud change not confirmed: %s, %u replies\n",
+        U1BRG == oldDivider ? "old rate" : "new rate", baudReplyCount);
+    if (!ok)
+        printf("FAIL: baud change not undone\n");
+    return ok;
+}
+#endif
+
+#ifdef USE_FAST_BOOT
+// the power on check BootloaderEntry makes before starting the application
+// without the listen window: with the image in place and the line idle it
+// must not listen, with the receive line low or the first application page
+// blank it must. BootloaderEntry itself cannot run here, since its address
+// checks need the PIC32 memory map. The modeled time is the pull up settle
+// and sample delays plus register accesses, not the PIC32 instruction time
+static bool FastBoot(void)
+{
+    bool ok = true, listen;
+
+    HostReset();
+    listen = BootListenNeeded();
+    printf("power on, application present: %s after %.1f us\n",
+        listen ? "listens" : "starts it", (double)HostNow()/HOST_TICKS_PER_US);
+    ok &= !listen;
+
+    HostReset();
+    PORTAbits.RA4 = 0; // flasher holding a break
+    listen = BootListenNeeded();
+    printf("power on, receive line low: %s\n", listen ? "listens" : "starts it");
+    ok &= listen;
+
+    memset(HostPhysical(FLASH_START + BOOTLOADER_SIZE), 0xFF, FLASH_PAGE_SIZE);
+    HostReset();
+    listen = BootListenNeeded();
+    printf("power on, first page blank: %s after %.1f us\n",
+        listen ? "listens" : "starts it", (double)HostNow()/HOST_TICKS_PER_US);
+    ok &= listen;
+
+    if (!ok)
+        printf("FAIL: wrong fast boot decision\n");
+    return ok;
+}
+#endif
+
+int main()
+{
+    bool ok = true;
+    HostModelInit();
+    ok &= Session('E', "erase then write");
+#ifdef USE_LAZY_ERASE
+    // the image is there now, so each page is erased as it is first written
+    ok &= Session('L', "lazy erase");
+#endif
+#ifdef USE_WRITE_WINDOW
+    ok &= StopAndWait();
+#endif
+    ok &= Corrupted();
+#ifdef USE_JOURNAL
+    ok &= Resume(false);
+    ok &= Resume(true);
+#endif
+#ifdef USE_STAGING
+    ok &= Staging();
+#endif
+#ifdef USE_RX_DMA
+    ok &= RingOverflow();
+#endif
+#ifdef USE_BAUD_CHANGE
+    ok &= BaudNotConfirmed();
+#endif
+#ifdef USE_FAST_BOOT
+    ok &= FastBoot();
+#endif
+    printf("%s\n", ok ? "model test passed" : "model test FAILED");
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,125 @@
+/*
+The MIT License (MIT)
+
+Copyright (c) 2015 Hypnocube, LLC
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE.
+*/
+
+/*
+ * File:   xc.h
+ *
+ * Host stand in for the XC32 part header, so BootLoader.c builds with the
+ * host compiler against the register model in HostModel.c. Registers the
+ * bootloader only sets or reads back are plain variables. The UART, DMA
+ * pointer, NVM and core timer registers call into the model, which moves
+ * simulated time on and delivers bytes, programs flash and so on as a
+ * PIC32MX150F128B would. See HostModel.h.
+ */
+
+#ifndef HOST_XC_H
+#define	HOST_XC_H
+
+#include <stdint.h>
+
+#define __32MX150F128B__ 1
+
+// registers with no side effects the bootloader depends on
+#define HOST_REGISTER(name) extern volatile uint32_t name
+HOST_REGISTER(U1BRG);   HOST_REGISTER(U1MODE);  HOST_REGISTER(U1STA);
+HOST_REGISTER(U1RXR);   HOST_REGISTER(RPA0R);   HOST_REGISTER(U2TXREG);
+HOST_REGISTER(LATACLR); HOST_REGISTER(TRISASET); HOST_REGISTER(TRISACLR);
+HOST_REGISTER(ANSELACLR); HOST_REGISTER(CNPUASET); HOST_REGISTER(CNPUACLR);
+HOST_REGISTER(NVMADDR); HOST_REGISTER(NVMDATA); HOST_REGISTER(NVMSRCADDR);
+HOST_REGISTER(BMXPFMSZ); HOST_REGISTER(BMXDRMSZ); HOST_REGISTER(BMXBOOTSZ);
+HOST_REGISTER(BMXDKPBA); HOST_REGISTER(BMXDUDBA); HOST_REGISTER(BMXDUPBA);
+HOST_REGISTER(RCON);    HOST_REGISTER(RCONCLR); HOST_REGISTER(SYSKEY);
+HOST_REGISTER(RSWRST);  HOST_REGISTER(RSWRSTSET);
+HOST_REGISTER(IFS1CLR); HOST_REGISTER(DMACON); HOST_REGISTER(DCH0CON);
+HOST_REGISTER(DCH0ECON); HOST_REGISTER(DCH0SSA); HOST_REGISTER(DCH0DSA);
+HOST_REGISTER(DCH0SSIZ); HOST_REGISTER(DCH0DSIZ); HOST_REGISTER(DCH0CSIZ);
+#undef HOST_REGISTER
+
+typedef struct {
+    unsigned URXDA:1, OERR:1, FERR:1, PERR:1, RIDLE:1, ADDEN:1, URXISEL:2;
+    unsigned TRMT:1, UTXBF:1, UTXEN:1, UTXBRK:1, URXEN:1, UTXINV:1, UTXISEL:2;
+} __U1STAbits_t;
+typedef struct {
+    unsigned DEVID:28, VER:4;
+} __DEVIDbits_t;
+typedef struct {
+    unsigned RA0:1, RA1:1, RA2:1, RA3:1, RA4:1;
+} __PORTAbits_t;
+typedef struct {
+    unsigned RB0:1, RB1:1, RB2:1, RB3:1, RB4:1, RB5:1, RB6:1, RB7:1;
+} __PORTBbits_t;
+
+extern volatile __U1STAbits_t U2STAbits;
+extern volatile __DEVIDbits_t DEVIDbits;
+extern volatile __PORTAbits_t PORTAbits;
+extern volatile __PORTBbits_t PORTBbits;
+
+// registers with side effects, each access steps the model
+volatile __U1STAbits_t * HostU1STAbits(void);
+volatile uint32_t * HostU1RXREG(void);
+volatile uint32_t * HostU1TXREG(void);
+volatile uint32_t * HostDCH0DPTR(void);
+volatile uint32_t * HostDCH0INT(void);
+volatile uint32_t * HostDCH0INTCLR(void);
+volatile uint32_t * HostDMACONSET(void);
+volatile uint32_t * HostDMACONCLR(void);
+volatile uint32_t * HostNVMCON(void);
+volatile uint32_t * HostNVMCONSET(void);
+volatile uint32_t * HostNVMCONCLR(void);
+volatile uint32_t * HostNVMKEY(void);
+uint32_t HostCoreTimer(void);
+void HostSetCoreTimer(uint32_t ticks);
+uint32_t HostDisableInterrupts(void);
+
+#define U1STAbits  (*HostU1STAbits())
+#define U1RXREG    (*HostU1RXREG())
+#define U1TXREG    (*HostU1TXREG())
+#define DCH0DPTR   (*HostDCH0DPTR())
+#define DCH0INT    (*HostDCH0INT())
+#define DCH0INTCLR (*HostDCH0INTCLR())
+#define DMACONSET  (*HostDMACONSET())
+#define DMACONCLR  (*HostDMACONCLR())
+#define NVMCON     (*HostNVMCON())
+#define NVMCONSET  (*HostNVMCONSET())
+#define NVMCONCLR  (*HostNVMCONCLR())
+#define NVMKEY     (*HostNVMKEY())
+
+#define _CP0_GET_COUNT()     HostCoreTimer()
+#define _CP0_SET_COUNT(val)  HostSetCoreTimer(val)
+
+#define NVMCON_WREN (1<<14)
+#define NVMCON_WR   (1<<15)
+
+#define _UART1_RX_IRQ 40
+
+#define __builtin_disable_interrupts() HostDisableInterrupts()
+#define __builtin_mtc0(reg,sel,val) ((void)(val))
+
+// The section, address, and persistent attributes place the bootloader in
+// the PIC32 memory map. The host linker cannot honor them, and will not mix
+// code and data in one section, so they are dropped. Include every system
+// header before this one
+#define __attribute__(x)
+
+#endif	/* HOST_XC_H */
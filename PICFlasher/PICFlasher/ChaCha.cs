@@ -177,6 +177,17 @@ namespace Hypnocube.PICFlasher
             state[15] = Pack(initializationVectorBytes, 4);
         }
 
+        /// <summary>
+        /// Move the keystream to the given 64 byte block, as if that many
+        /// blocks had been used since the IV was set
+        /// </summary>
+        /// <param name="counter"></param>
+        public void SetBlockCounter(ulong counter)
+        {
+            state[12] = (uint) counter;
+            state[13] = (uint) (counter >> 32);
+        }
+
         public void Encrypt(byte[] messageBytes, byte[] cypherBytes, int rounds)
         {
             var bytes = messageBytes.Length;
@@ -64,12 +64,14 @@ namespace Hypnocube.PICFlasher
         /// else false.
         /// </summary>
         /// <param name="baudRate"></param>
+        /// <param name="fastBaudRate">rate to switch to after connecting, 0 for none</param>
         /// <param name="picName"></param>
         /// <param name="hexFilename"></param>
         /// <param name="imgFilename"></param>
         /// <param name="keyFilename"></param>
-        public bool Run(int baudRate, string picName, string hexFilename, string imgFilename, string keyFilename)
+        public bool Run(int baudRate, int fastBaudRate, string picName, string hexFilename, string imgFilename, string keyFilename)
         {
+            this.fastBaudRate = fastBaudRate;
             FlasherInterface.SetColors(FlasherMessageType.Default, true);
 
             if (!PicDefs.TryParse(picName, out picType))
@@ -110,8 +112,14 @@ namespace Hypnocube.PICFlasher
                     {
                         try
                         {
+                            // hold a break between sync bytes, so a fast booting
+                            // bootloader sees the receive line low at power on
+                            // and listens instead of starting the application
+                            serialManager.SetBreak(true);
+                            Thread.Sleep(95);
+                            serialManager.SetBreak(false);
                             WriteByte(ACK_OK);
-                            Thread.Sleep(100);
+                            Thread.Sleep(5);
                         }
                         catch (Exception ex)
                         {
@@ -129,24 +137,50 @@ namespace Hypnocube.PICFlasher
                     if (state == FlasherState.AutoInfoStart)
                     {
                         state = FlasherState.AutoInfoPending;
-                        InfoCommand();
+                        BinaryInfoCommand();
+                    }
+                    else if (state == FlasherState.AutoBaudStart)
+                    {
+                        state = FlasherState.AutoBaudPending;
+                        BaudCommand();
                     }
                     else if (state == FlasherState.AutoImageStart)
                     {
                         state = FlasherState.AutoImagePending;
                         AutoImage(hexFilename, imgFilename, key);
                     }
+                    else if (state == FlasherState.AutoManifestStart)
+                    {
+                        state = FlasherState.AutoManifestPending;
+                        ManifestCommand();
+                    }
                     else if (state == FlasherState.AutoEraseStart)
                     {
                         state = FlasherState.AutoErasePending;
-                        EraseDevice();
+                        JournalCommand();
+                    }
+                    else if (state == FlasherState.AutoBlankStart)
+                    {
+                        state = FlasherState.AutoBlankPending;
+                        BlankCheckCommand();
                     }
                     else if (state == FlasherState.AutoWriteStart)
                     {
                         state = FlasherState.AutoWritePending;
-                        WriteBlock();
+                        StartWriteTimer();
+                        if (pipelineWrites && writeWindow > 0)
+                            StartWindowWrite();
+                        else
+                            WriteBlock();
+                    }
+                    else if (state == FlasherState.AutoWritePending && windowActive)
+                    {
+                        PumpWriteWindow();
                     }
 
+                    if (baudConfirming)
+                        PumpBaudChange();
+
 
                     if (FlasherInterface.CommandAvailable)
                     {
@@ -187,6 +221,12 @@ namespace Hypnocube.PICFlasher
                             case 'c': // get CRC from device
                                 WriteCommand('C');
                                 break;
+                            case 'k': // find pages not blank on device
+                                BlankCheckCommand();
+                                break;
+                            case 't': // device time per phase and events
+                                StatsCommand(true);
+                                break;
                             case 's': // write block to flash device
                                 WriteBlock();
                                 break;
@@ -196,7 +236,26 @@ namespace Hypnocube.PICFlasher
                             case 'u' :
                                 ShowUsageHelp();
                                 break;
-                            case 'b': // jump into boot
+                            case 'r': // switch to fast baud rate
+                                BaudCommand();
+                                break;
+                            case 'd': // toggle delta writes
+                                deltaWrites = !deltaWrites;
+                                FlasherInterface.WriteLine(FlasherMessageType.Info, "Delta writes : {0}", deltaWrites);
+                                break;
+                            case 'z': // toggle lazy erase
+                                lazyErase = !lazyErase;
+                                FlasherInterface.WriteLine(FlasherMessageType.Info, "Lazy erase : {0}", lazyErase);
+                                break;
+                            case 'p': // toggle pipelined writes
+                                pipelineWrites = !pipelineWrites;
+                                FlasherInterface.WriteLine(FlasherMessageType.Info, "Pipelined writes : {0}", pipelineWrites);
+                                break;
+                            case 'a': // stage image through the application
+                                StageCommand();
+                                break;
+                            case 'b': // application resets into the bootloader
+                                // which answers the sync bytes without a listen window
                                 state = FlasherState.TryConnect;
                                 WriteCommand('B');
                                 break;
@@ -236,14 +295,22 @@ namespace Hypnocube.PICFlasher
             if (!String.IsNullOrEmpty(keyFilename))
                 FlasherInterface.WriteLine("Key filename   : {0}{1}{2}", fileColorToken, keyFilename, defaultColorToken);
             FlasherInterface.WriteLine("Bootloader code reserves 0x{0:X8} bytes", bootLength);
+            if (picDetails != null)
+                FlasherInterface.WriteLine("Write packet size : {0} bytes", PacketSize);
             FlasherInterface.WriteLine("Allow overwriting boot flash section : {0}", allowOverwriteBootFlash);
             FlasherInterface.WriteLine("Allow overwriting configuration registers : {0}", allowOverwriteConfiguration);
+            FlasherInterface.WriteLine("Pipelined writes : {0}, bootloader write window {1}", pipelineWrites, writeWindow);
+            FlasherInterface.WriteLine("Lazy erase : {0}", lazyErase);
+            FlasherInterface.WriteLine("Delta writes : {0}", deltaWrites);
+            if (fastBaudRate > 0)
+                FlasherInterface.WriteLine("Fast baud rate : {0}, bootloader rate {1}", fastBaudRate, bootBaudRate);
             FlasherInterface.WriteLine();
             FlasherInterface.RestoreColors();
         }
 
         private void StartProcessAll()
         {
+            deltaBlocks = null;
             if (state == FlasherState.Connected)
                 state = FlasherState.AutoInfoStart;
             else
@@ -252,52 +319,249 @@ namespace Hypnocube.PICFlasher
 
         private void InfoCommand()
         {
+            // 'I' switches the bootloader back to text replies
+            binaryReplies = false;
+            // older bootloaders have no write window line, and only take 'W' packets
+            writeWindow = 0;
+            // nor a command list, so assume the original commands
+            bootCommands = "ICEWQ";
+            WatchForLine("Commands", line =>
+            {
+                bootCommands = line.Split().Last();
+                return true; // remove on execution
+            });
+            // nor a baud rate line, and cannot change rate
+            bootBaudRate = 0;
+            WatchForLine("Baud rate", line =>
+            {
+                int val;
+                if (Int32.TryParse(line.Split().Last(), out val) && val > 0)
+                    bootBaudRate = val;
+                else
+                    FlasherInterface.WriteLine(FlasherMessageType.Error, "Unable to parse baud rate from line {0}", line);
+                return true; // remove on execution
+            });
+            // nor a compression line, and takes raw packets only
+            bootCompression = false;
+            WatchForLine("Compression", line =>
+            {
+                bootCompression = line.Split().Last() == "LZ77";
+                return true; // remove on execution
+            });
+            // nor a packet size line, and takes one page per packet
+            maxPacketSize = 0;
+            WatchForLine("Max packet size", line =>
+            {
+                uint val;
+                if (UInt32.TryParse(line.Split().Last(), out val) && 0 < val && val < 65536 - 10)
+                    maxPacketSize = val;
+                else
+                    FlasherInterface.WriteLine(FlasherMessageType.Error, "Unable to parse max packet size from line {0}", line);
+                return true; // remove on execution
+            });
+            WatchForLine("Write window", line =>
+            {
+                int val;
+                if (Int32.TryParse(line.Split().Last(), out val) && 0 < val && val < 128)
+                    writeWindow = val;
+                else
+                    FlasherInterface.WriteLine(FlasherMessageType.Error, "Unable to parse write window from line {0}", line);
+                return true; // remove on execution
+            });
+
             // prepare to parse the info lines, looking for the bootloader size
             WatchForLine("Bootloader size", line =>
             {
                 var success = false;
                 uint val;
                 if (!TryParseHex(line.Split().Last(), out val))
-                {
                     FlasherInterface.WriteLine(FlasherMessageType.Error, "Unable to parse boot length from line {0}", line);
-                }
                 else
+                    success = SetBootLength(val, "line");
+                FinishInfo(success);
+                return true; // remove on execution
+            });
+
+            WriteCommand('I');
+        }
+
+        /// <summary>
+        /// Check and store the bootloader size from the info
+        /// </summary>
+        /// <returns>true if usable</returns>
+        private bool SetBootLength(uint val, string source)
+        {
+            bootLength = (int) val;
+            if ((bootLength%picDetails.FlashPageSize) != 0)
+            {
+                FlasherInterface.WriteLine(FlasherMessageType.Error,
+                    "boot loader size {0}0x{1:X4}{2} parsed from {4}, not multiple of flash page size {0}0x{3:X4}{2}",
+                    FlasherInterface.ColorToken(FlasherColor.Green, FlasherColor.Black),
+                    bootLength,
+                    FlasherInterface.ColorToken(),
+                    picDetails.FlashPageSize,
+                    source
+                    );
+                return false;
+            }
+            FlasherInterface.WriteLine(FlasherMessageType.Info,
+                "boot loader size {0}0x{1:X4}{2} parsed from {3}",
+                FlasherInterface.ColorToken(FlasherColor.Green, FlasherColor.Black),
+                bootLength,
+                FlasherInterface.ColorToken(),
+                source
+                );
+            return true;
+        }
+
+        private void FinishInfo(bool success)
+        {
+            if (state == FlasherState.AutoInfoPending)
+            {
+                state = success ? FlasherState.AutoBaudStart : FlasherState.Connected;
+            }
+        }
+
+        #region Binary info
+
+        // set once 'F' is answered, when erases reply with bytes only
+        private bool binaryReplies;
+
+        // record types in the 'F' reply
+        private const byte INFO_VERSION = 1;
+        private const byte INFO_BOOT_SIZE = 4;
+        private const byte INFO_PACKET_SIZE = 7;
+        private const byte INFO_WRITE_WINDOW = 8;
+        private const byte INFO_BAUD_RATE = 9;
+        private const byte INFO_COMMANDS = 10;
+        private const byte INFO_COMPRESSION = 11;
+
+        /// <summary>
+        /// Get the info as binary records with 'F', which is quicker to send
+        /// and parse than the text, and switches the bootloader erases to
+        /// bytes only. Bootloaders without it NACK the unknown command, and
+        /// get the text 'I' instead.
+        /// </summary>
+        private void BinaryInfoCommand()
+        {
+            WatchForAckOrNack(() =>
+            {
+                if (lastReply != ACK_OK)
                 {
-                    bootLength = (int) val;
-                    if ((bootLength%picDetails.FlashPageSize) != 0)
-                    {
-                        FlasherInterface.WriteLine(FlasherMessageType.Error,
-                            "boot loader size {0}0x{1:X4}{2} parsed from line, not multiple of flash page size {0}0x{3:X4}{2}",
-                            FlasherInterface.ColorToken(FlasherColor.Green, FlasherColor.Black),
-                            bootLength,
-                            FlasherInterface.ColorToken(),
-                            picDetails.FlashPageSize
-                            );
-                    }
-                    else
-                    {
-                        FlasherInterface.WriteLine(FlasherMessageType.Info,
-                            "boot loader size {0}0x{1:X4}{2} parsed from line",
-                            FlasherInterface.ColorToken(FlasherColor.Green, FlasherColor.Black),
-                            bootLength,
-                            FlasherInterface.ColorToken()
-                            );
-                        success = true;
-                    }
-                    
+                    InfoCommand();
+                    return true; // remove on execute
                 }
+                ReadBinary(2, length =>
+                {
+                    var recordLength = (length[0] << 8) | length[1];
+                    ReadBinary(recordLength + 4, records => BinaryInfoReply(length, records));
+                });
+                return true; // remove on execute
+            });
+            WriteCommand('F');
+        }
+
+        private void BinaryInfoReply(byte[] length, byte[] records)
+        {
+            var recordLength = records.Length - 4;
+            var crc = CRC32K.Compute(length.Concat(records.Take(recordLength)).ToArray());
+            if (crc != ReadBigEndian(records, recordLength, 4))
+            {
+                FlasherInterface.WriteLine(FlasherMessageType.Warning, "Binary info corrupted, asking for text info");
+                InfoCommand();
+                return;
+            }
+
+            // same defaults as the text info for missing records
+            writeWindow = 0;
+            bootCommands = "ICEWQ";
+            bootBaudRate = 0;
+            maxPacketSize = 0;
+            bootCompression = false;
+            var success = false;
 
-                if (state == FlasherState.AutoInfoPending)
+            // type, length, value records. Unknown types are skipped
+            var pos = 0;
+            while (pos + 2 <= recordLength && pos + 2 + records[pos + 1] <= recordLength)
+            {
+                var type = records[pos];
+                var size = records[pos + 1];
+                pos += 2;
+                var val = ReadBigEndian(records, pos, Math.Min(4, (int) size));
+                switch (type)
                 {
-                    state = success ? FlasherState.AutoImageStart : FlasherState.Connected;
+                    case INFO_VERSION:
+                        FlasherInterface.WriteLine(FlasherMessageType.Info, "Bootloader {0}", 
+                            new string(records.Skip(pos).Take(size).Select(b => (char) b).ToArray()));
+                        break;
+                    case INFO_COMMANDS:
+                        bootCommands = new string(records.Skip(pos).Take(size).Select(b => (char) b).ToArray());
+                        break;
+                    case INFO_COMPRESSION:
+                        bootCompression = new string(records.Skip(pos).Take(size).Select(b => (char) b).ToArray()) == "LZ77";
+                        break;
+                    case INFO_BAUD_RATE:
+                        if (0 < val && val <= Int32.MaxValue)
+                            bootBaudRate = (int) val;
+                        else
+                            FlasherInterface.WriteLine(FlasherMessageType.Error, "Invalid baud rate {0}", val);
+                        break;
+                    case INFO_PACKET_SIZE:
+                        if (0 < val && val < 65536 - 10)
+                            maxPacketSize = val;
+                        else
+                            FlasherInterface.WriteLine(FlasherMessageType.Error, "Invalid max packet size {0}", val);
+                        break;
+                    case INFO_WRITE_WINDOW:
+                        if (0 < val && val < 128)
+                            writeWindow = (int) val;
+                        else
+                            FlasherInterface.WriteLine(FlasherMessageType.Error, "Invalid write window {0}", val);
+                        break;
+                    case INFO_BOOT_SIZE:
+                        success = SetBootLength(val, "binary info");
+                        break;
                 }
+                pos += size;
+            }
 
-                return true; // remove on execution
-            });
+            binaryReplies = true;
+            FinishInfo(success);
+        }
 
-            WriteCommand('I');
+        /// <summary>
+        /// Run done once an erase command finishes. Text replies end with an
+        /// "Erase finished" line then an ACK or NACK, and binary replies end
+        /// with ACK_ERASE_DONE, after any page reply bytes.
+        /// </summary>
+        private void WatchForEraseFinished(Action done)
+        {
+            if (binaryReplies)
+            {
+                WatchForAckOrNack(() =>
+                {
+                    if (lastReply != ACK_ERASE_DONE)
+                        return false; // keep for the next
+                    done();
+                    return true; // remove on execute
+                });
+                return;
+            }
+
+            WatchForLine("Erase finished",
+                line =>
+                {
+                    WatchForAckOrNack(() =>
+                    {
+                        done();
+                        return true; // remove on execute
+                    });
+                    return true; // remove on execute
+                });
         }
 
+        #endregion
+
         /// <summary>
         /// Try to get an image for use.
         /// If both hex file and image file present, pick most recent.
@@ -329,9 +593,31 @@ namespace Hypnocube.PICFlasher
                 FlasherInterface.WriteLine(FlasherMessageType.Error,"Needs a hex or img file!");
             }
 
+            // an image made for larger packets than this bootloader takes, or
+            // compressed for one that cannot expand packets, would have every
+            // block refused, so remake it if possible
+            string refused = null;
+            if (success && image.Blocks.Any(b => b.Length > 3 + 10 + PacketSize))
+                refused = "Image packets too large for bootloader";
+            else if (success && !bootCompression && image.Blocks.Any(IsCompressedBlock))
+                refused = "Image packets compressed, bootloader cannot expand them";
+            if (refused != null)
+            {
+                if (hexExists)
+                {
+                    FlasherInterface.WriteLine(FlasherMessageType.Warning, "{0}, remaking image", refused);
+                    success = CreateImageFromHex(hexFilename, imgFilename, key);
+                }
+                else
+                {
+                    FlasherInterface.WriteLine(FlasherMessageType.Error, "{0}, needs a hex file to remake it", refused);
+                    success = false;
+                }
+            }
+
             if (state == FlasherState.AutoImagePending)
             {
-                state = success ? FlasherState.AutoEraseStart : FlasherState.Connected;
+                state = success ? FlasherState.AutoManifestStart : FlasherState.Connected;
             }
         }
 
@@ -345,14 +631,21 @@ namespace Hypnocube.PICFlasher
             PortClosed,  // no port open
             TryConnect,  // trying to connect, port open
             Connected,   // connection found, in command loop
+            Application, // talking to the running application, no sync bytes
             
             // states during automatic flash
             AutoInfoStart,    // requires connection, launches a get info
             AutoInfoPending,  // requires connection, launches a get info
+            AutoBaudStart,    // requires connection, info, switches to fast baud if asked
+            AutoBaudPending,  // requires connection, info, switches to fast baud if asked
             AutoImageStart,   // requires connection, info, gets an image
             AutoImagePending, // requires connection, info, gets an image
+            AutoManifestStart,   // requires connection, info, image, finds pages to change
+            AutoManifestPending, // requires connection, info, image, finds pages to change
             AutoEraseStart,    // requires connection, info, image, erases flash
             AutoErasePending,  // requires connection, info, image, erases flash
+            AutoBlankStart,    // requires connection, info, image, erased, re-erases pages not blank
+            AutoBlankPending,  // requires connection, info, image, erased, re-erases pages not blank
             AutoWriteStart,    // requires connection, info, image, erased, writes image
             AutoWritePending   // requires connection, info, image, erased, writes image
 
@@ -362,6 +655,11 @@ namespace Hypnocube.PICFlasher
 
 
         private const byte ACK_OK = 0xFC;
+        private const byte NACK_SEQUENCE_ERROR = 0xEE;
+        private const byte ACK_BAUD_CHANGE = 0xF3;
+        private const byte NACK_ERASE_FAILED = 0xED;
+        private const byte NACK_RECEIVE_TIMEOUT = 0xEF;
+        private const byte ACK_ERASE_DONE = 0xF2;
 
         private int ackCount = 0;
         private int nackCount = 0;
@@ -386,8 +684,9 @@ namespace Hypnocube.PICFlasher
             "ACK_PAGE_ERASED              = 0x00",
             "ACK_PAGE_PROTECTED           = 0x01",
             "ACK_ERASE_DONE               = 0x02",
+            "ACK_BAUD_CHANGE              = 0x03",
 
-            "","","","","","","","","",
+            "","","","","","","","",
             // reserved for ACK
             // the byte that signals a positive outcome to the flashing utility
             // has nice property that becomes different values at nearby baud rates
@@ -420,9 +719,10 @@ namespace Hypnocube.PICFlasher
             "NACK_UNKNOWN_COMMAND          = 0x0C",
             // erase problems                   
             "NACK_ERASE_FAILED             = 0x0D",
-            // currently unused
-            "NACK_UNUSED1                  = 0x0E",
-            "NACK_UNUSED2                  = 0x0F"
+            // sequenced write problems
+            "NACK_SEQUENCE_ERROR           = 0x0E",
+            // write packet cut short
+            "NACK_RECEIVE_TIMEOUT          = 0x0F"
         };
 
         /// <summary>
@@ -438,6 +738,18 @@ namespace Hypnocube.PICFlasher
         {
             foreach (var b1 in data)
             {
+                if (binaryAction != null)
+                { // raw bytes requested, do not parse them
+                    binaryData.Add(b1);
+                    if (binaryData.Count == binaryCount)
+                    {
+                        var action = binaryAction;
+                        binaryAction = null;
+                        action(binaryData.ToArray());
+                    }
+                    continue;
+                }
+
                 var b = b1; // want it changeable
                 if (IsAck(b) && state == FlasherState.TryConnect)
                 {
@@ -478,6 +790,11 @@ namespace Hypnocube.PICFlasher
 
                 // see if any actions are waiting on this character
                 ProcessActions(b);
+
+                // a receive timeout is followed by a byte count, read here
+                // when no action took it so it is not taken as replies
+                if (b == NACK_RECEIVE_TIMEOUT && binaryAction == null)
+                    ReadTimeoutCount(null);
             }
         }
 
@@ -498,11 +815,18 @@ namespace Hypnocube.PICFlasher
             FlasherInterface.WriteLine("Press {0} to load image file for flashing to device", wrapCommand('l'));
             FlasherInterface.WriteLine("Press {0} to erase flash on device", wrapCommand('e'));
             FlasherInterface.WriteLine("Press {0} to compute crc on device and output it", wrapCommand('c'));
+            FlasherInterface.WriteLine("Press {0} to list pages not blank on device (needs bootloader support)", wrapCommand('k'));
+            FlasherInterface.WriteLine("Press {0} to show device time per phase and recent events (needs bootloader support)", wrapCommand('t'));
             //            FlasherInterface.WriteLine("Press {0} to read flash on device (requires bootloader support)", wrapCommand('r'));
             FlasherInterface.WriteLine("Press {0} to erase then write flash on device", wrapCommand('w'));
             FlasherInterface.WriteLine("Press {0} to show usage help", wrapCommand('u'));
+            FlasherInterface.WriteLine("Press {0} to switch to the fast baud rate (baud:fast on command line)", wrapCommand('r'));
+            FlasherInterface.WriteLine("Press {0} to toggle delta writes, sending only changed pages (unencrypted images)", wrapCommand('d'));
+            FlasherInterface.WriteLine("Press {0} to toggle lazy erase, where pages erase as written (needs bootloader support)", wrapCommand('z'));
+            FlasherInterface.WriteLine("Press {0} to toggle pipelined writes (needs bootloader write window)", wrapCommand('p'));
             FlasherInterface.WriteLine("Press {0} to write next flash packet to device", wrapCommand('s'));
-            FlasherInterface.WriteLine("Press {0} to jump into bootloader from main (only in test project)",
+            FlasherInterface.WriteLine("Press {0} to stage image through the running application, copied in on its next reset (needs test project support)", wrapCommand('a'));
+            FlasherInterface.WriteLine("Press {0} to have the application reset into the bootloader (application calls BootloaderRequestEntry on 'B')",
                 wrapCommand('b'));
             FlasherInterface.WriteLine("Press {0} for this help", wrapCommand('?'));
             FlasherInterface.WriteLine("");
@@ -545,6 +869,48 @@ namespace Hypnocube.PICFlasher
         // set from bootloader information
         int bootLength = 0;
 
+        // most data bytes in a write packet, from bootloader information,
+        // 0 for older bootloaders that take one page
+        uint maxPacketSize = 0;
+
+        // bootloader expands LZ77 compressed packets, from info
+        private bool bootCompression;
+
+        /// <summary>
+        /// True if the block is a write packet with its payload compressed,
+        /// marked by the top bit of the length
+        /// </summary>
+        private static bool IsCompressedBlock(byte[] block)
+        {
+            return block.Length >= 3 && (block[1] & 0x80) != 0;
+        }
+
+        /// <summary>
+        /// Data bytes to put in each write packet, whole pages
+        /// </summary>
+        private uint PacketSize
+        {
+            get
+            {
+                var pages = Math.Max(1, maxPacketSize/picDetails.FlashPageSize);
+                return pages*picDetails.FlashPageSize;
+            }
+        }
+
+        /// <summary>
+        /// Most ranges in one page erase command. The count, ranges, and CRC
+        /// must fit the bootloader's receive buffer, which holds at least the
+        /// largest write packet it reports, or one page for older ones
+        /// </summary>
+        private int MaxEraseRanges
+        {
+            get
+            {
+                var bufferSize = maxPacketSize != 0 ? maxPacketSize : picDetails.FlashPageSize;
+                return (int) Math.Min(255, (bufferSize - 1 - 4)/6);
+            }
+        }
+
 
         private const bool allowOverwriteBootFlash = true;
         private const bool allowOverwriteConfiguration = false;
@@ -561,11 +927,23 @@ namespace Hypnocube.PICFlasher
         ulong TrimMemory(List<byte> data, ulong address)
         {
             var tempAddress = address;
+            long programLength = picDetails.FlashSize - bootLength;
+
+            // a bootloader with the write journal keeps it in the last program
+            // flash page, and refuses writes there
+            if (bootCommands.Contains('J'))
+            {
+                programLength -= picDetails.FlashPageSize;
+                var journalStart = (ulong) (picDetails.FlashStart + picDetails.FlashSize - picDetails.FlashPageSize);
+                if (address < journalStart + picDetails.FlashPageSize && journalStart < address + (ulong) data.Count)
+                    FlasherInterface.WriteLine(FlasherMessageType.Warning,
+                        "Dropping data in the bootloader journal page 0x{0:X8}, link the application clear of it", journalStart);
+            }
 
             // start address, length memory regions allowed to overwrite
             var allowedRegions = new List<Tuple<long, long>>
             {
-                new Tuple<long, long>(picDetails.FlashStart + bootLength, picDetails.FlashSize - bootLength)
+                new Tuple<long, long>(picDetails.FlashStart + bootLength, programLength)
             };
 
             if (allowOverwriteBootFlash)
@@ -593,6 +971,24 @@ namespace Hypnocube.PICFlasher
             return tempAddress;
         }
 
+        /// <summary>
+        /// Trim memory for a staged image, which may only write program
+        /// flash after the bootloader
+        /// </summary>
+        /// <param name="data"></param>
+        /// <param name="address"></param>
+        /// <returns></returns>
+        ulong TrimStagedMemory(List<byte> data, ulong address)
+        {
+            var tempAddress = address;
+            var allowedRegions = new List<Tuple<long, long>>
+            {
+                new Tuple<long, long>(picDetails.FlashStart + bootLength, picDetails.FlashSize - bootLength)
+            };
+            ClampMemory(data, ref tempAddress, allowedRegions);
+            return tempAddress;
+        }
+
         // compute overlap of intervals [a0,a1) and [b0,b1) into [c0,c1)
         // if c0==c1, then no overlap
         static void ComputeOverlap(uint a0, uint a1,uint b0, uint b1, out uint c0, out uint c1)
@@ -667,6 +1063,7 @@ namespace Hypnocube.PICFlasher
         private bool CreateImageFromHex(string hexFilename, string imgFilename, uint [] key)
         {
             image = null;
+            deltaBlocks = null;
             var hasImageFilename = !String.IsNullOrEmpty(imgFilename);
             if (String.IsNullOrEmpty(hexFilename))
             {
@@ -680,10 +1077,12 @@ namespace Hypnocube.PICFlasher
                 hexFilename,
                 key!=null?" with encryption key":""
                 );
-            image = maker.CreateFromFile(hexFilename, picDetails, TrimMemory, key);
+            image = maker.CreateFromFile(hexFilename, picDetails, TrimMemory, key, PacketSize, bootCompression, (uint) bootLength);
             var success = true;
             if (image != null)
             {
+                imageHexFilename = hexFilename;
+                imageKey = key;
                 FlasherInterface.WriteLine(FlasherMessageType.Info,"Image created from hex correctly, {0} blocks", image.Blocks.Count);
                 if (!String.IsNullOrEmpty(imgFilename))
                 {
@@ -705,6 +1104,10 @@ namespace Hypnocube.PICFlasher
 
         private Image image; 
 
+        // hex file and key the image was made from, null for a loaded image
+        private string imageHexFilename;
+        private uint[] imageKey;
+
         void WriteCommand(char command)
         {
             WriteByte((byte) command);
@@ -719,13 +1122,19 @@ namespace Hypnocube.PICFlasher
                 FlasherInterface.WriteLine(FlasherMessageType.Error,"ERROR: load or create image first");
                 return;
             }
-            if (imageBlockIndex >= image.Blocks.Count)
+            if (imageBlockIndex >= WriteBlocks.Count)
                 imageBlockIndex = 0;
-            var b = image.Blocks[imageBlockIndex];
+            var b = CounterPacket(imageBlockIndex) ?? WriteBlocks[imageBlockIndex];
+            if (imageBlockIndex != sendingIndex)
+            {
+                sendingIndex = imageBlockIndex;
+                blockSends = 0;
+            }
+            ++blockSends;
             imageBlockIndex++;
 
             var numberToken = FlasherInterface.ColorToken(FlasherColor.Yellow, FlasherColor.Black);
-            if (imageBlockIndex == image.Blocks.Count)
+            if (imageBlockIndex == WriteBlocks.Count)
             {
                 numberToken = FlasherInterface.ColorToken(FlasherColor.Green, FlasherColor.Black);
                 if (state == FlasherState.AutoWritePending)
@@ -734,30 +1143,32 @@ namespace Hypnocube.PICFlasher
                     // set up final handler
                     WatchForAckOrNack(() =>
                     {
-
-                        FlasherInterface.WriteLine();
-                        FlasherInterface.WriteLine("ACK count {0}, NACK count {1}",ackCount,nackCount);
-                        if (nackCount == 0)
-                        {
-                            FlasherInterface.SetColors(FlasherColor.Green,FlasherColor.DarkGreen,true);
-                            FlasherInterface.WriteLine("ROM flash succeeded!");
-                            FlasherInterface.RestoreColors();
-                        }
-                        else
+                        if (lastReply == NACK_RECEIVE_TIMEOUT)
                         {
-                            FlasherInterface.SetColors(FlasherColor.Red,FlasherColor.DarkRed,true);
-                            FlasherInterface.WriteLine("ROM flash failed.");
-                            FlasherInterface.RestoreColors();
+                            ReadTimeoutCount(() =>
+                            {
+                                if (blockSends >= BlockRetryMax)
+                                {
+                                    GiveUpBlock();
+                                    return;
+                                }
+                                ++blockResends;
+                                --imageBlockIndex;
+                                state = FlasherState.AutoWritePending;
+                                WriteBlock();
+                            });
+                            return true;
                         }
-                        FlasherInterface.WriteLine();
+                        ReportFlashResult(nackCount == blockResends);
                         return true;// remove on fire
                     });
                 }
             }
             var defaultToken = FlasherInterface.ColorToken();
-            FlasherInterface.Write(FlasherMessageType.Info, "Writing block {2}{0}{3} of {2}{1}{3}", 
-                imageBlockIndex, image.Blocks.Count,
-                numberToken, defaultToken
+            FlasherInterface.Write(FlasherMessageType.Info, "Writing block {2}{0}{3} of {2}{1}{3}{4}", 
+                imageBlockIndex, WriteBlocks.Count,
+                numberToken, defaultToken,
+                blockSends > 1 ? " again" : ""
                 );
 
             if (state == FlasherState.AutoWritePending)
@@ -766,77 +1177,1267 @@ namespace Hypnocube.PICFlasher
                 // but delay a moment to give bootloader some space
                 WatchForAckOrNack(() =>
                 {
+                    if (lastReply == NACK_RECEIVE_TIMEOUT)
+                    { // the bootloader forgot the packet, so any block can go again
+                        ReadTimeoutCount(() =>
+                        {
+                            if (blockSends >= BlockRetryMax)
+                            {
+                                GiveUpBlock();
+                                return;
+                            }
+                            ++blockResends;
+                            --imageBlockIndex;
+                            WriteBlock();
+                        });
+                        return true;
+                    }
                     Thread.Sleep(100);
+                    if (IsNack(lastReply) && blockSends < BlockRetryMax && CounterPacket(imageBlockIndex - 1) != null)
+                    { // decrypts on its own, so can go again
+                        ++blockResends;
+                        --imageBlockIndex;
+                    }
                     WriteBlock();
                     return true;
                 });
             }
+            writeBytes += b.Length;
             serialManager.WriteBytes(b);
         }
 
-        private void WriteByte(byte data)
+        /// <summary>
+        /// Stop writing, the block having timed out BlockRetryMax times. The
+        /// bootloader never wrote it, so the image cannot be complete
+        /// </summary>
+        private void GiveUpBlock()
         {
-            var buffer = new[] { data };
-            serialManager.WriteBytes(buffer);
+            FlasherInterface.WriteLine(FlasherMessageType.Error, "ERROR: block {0} timed out {1} times, giving up",
+                sendingIndex + 1, BlockRetryMax);
+            state = FlasherState.Connected;
+            ReportFlashResult(false);
         }
 
+        /// <summary>
+        /// Read the count of packet bytes the bootloader got, which follows a
+        /// NACK_RECEIVE_TIMEOUT, then run the action if there is one. The
+        /// bootloader waits for the line to go quiet before the NACK, so the
+        /// packet can go again at once.
+        /// </summary>
+        private void ReadTimeoutCount(Action action)
+        {
+            ReadBinary(2, count =>
+            {
+                FlasherInterface.WriteLine(FlasherMessageType.Warning, "Bootloader timed out after {0} bytes of the packet",
+                    (count[0] << 8) | count[1]);
+                if (action != null)
+                    action();
+            });
+        }
 
-        PicDefs.PicType picType = PicDefs.PicType.None;
-        private PicDefs.PicDef picDetails = null;
+        /// <summary>
+        /// Write final flash outcome and how fast the image went over
+        /// </summary>
+        /// <param name="succeeded"></param>
+        private void ReportFlashResult(bool succeeded)
+        {
+            FlasherInterface.WriteLine();
+            FlasherInterface.WriteLine("ACK count {0}, NACK count {1}",ackCount,nackCount);
+            if (writeTimer != null)
+            {
+                writeTimer.Stop();
+                var ms = Math.Max(1, writeTimer.ElapsedMilliseconds);
+                FlasherInterface.WriteLine(FlasherMessageType.Info,
+                    "Wrote {0} bytes in {1} ms, {2:F2} KB/s, link limit {3:F2} KB/s at {4} baud",
+                    writeBytes, ms, writeBytes / 1.024 / ms,
+                    serialManager.BaudRate / 10.0 / 1024.0, serialManager.BaudRate
+                    );
+            }
+            if (succeeded)
+            {
+                FlasherInterface.SetColors(FlasherColor.Green,FlasherColor.DarkGreen,true);
+                FlasherInterface.WriteLine("ROM flash succeeded!");
+                FlasherInterface.RestoreColors();
+            }
+            else
+            {
+                FlasherInterface.SetColors(FlasherColor.Red,FlasherColor.DarkRed,true);
+                FlasherInterface.WriteLine("ROM flash failed.");
+                FlasherInterface.RestoreColors();
+            }
+            FlasherInterface.WriteLine();
 
+            // where the device spent the time
+            if (bootCommands.Contains('T'))
+                StatsCommand(false);
+        }
 
+        #region Device stats
 
-        private SerialManager serialManager;
+        private static readonly string[] statPhases = {"receive wait", "decrypt", "CRC", "erase", "program", "verify"};
+        private static readonly string[] statCounts = {"packets", "rows", "words", "retries", "NACKs"};
+        private static readonly string[] statEvents = {"", "packet start", "packet end", "erase", "program", "NACK"};
 
-        private void EraseDevice()
+        /// <summary>
+        /// Get the bootloader's time in each phase since the erase, its
+        /// counts, and optionally its recent events, and show them
+        /// </summary>
+        /// <param name="showEvents"></param>
+        private void StatsCommand(bool showEvents)
         {
+            if (!bootCommands.Contains('T'))
+            {
+                FlasherInterface.WriteLine(FlasherMessageType.Warning, "Bootloader has no stats");
+                return;
+            }
 
-            imageBlockIndex = 0;
-            nackCount = 0;
-            ackCount = 0;
-            WatchForLine("Erase finished",
-                line =>
+            // variable length, so read a section at a time, keeping all for the CRC
+            var reply = new List<byte>();
+            WatchForAckOrNack(() =>
+            {
+                if (lastReply != ACK_OK)
+                    return true; // remove on execute
+                ReadBinary(5, head =>
                 {
-                    WatchForAckOrNack(() =>
+                    reply.AddRange(head);
+                    ReadBinary(4*head[4] + 8 + 1, phases =>
                     {
-                        if (state == FlasherState.AutoErasePending)
+                        reply.AddRange(phases);
+                        ReadBinary(4*phases[phases.Length - 1] + 1, counts =>
                         {
-                            state = FlasherState.AutoWriteStart;
-                        }
-                        return true; // remove on execute
+                            reply.AddRange(counts);
+                            ReadBinary(8*counts[counts.Length - 1] + 4, events =>
+                            {
+                                reply.AddRange(events);
+                                StatsReply(reply.ToArray(), showEvents);
+                            });
+                        });
                     });
-                    return true; // remove on execute
                 });
-            WriteCommand('E');
+                return true; // remove on execute
+            });
+            WriteCommand('T');
         }
 
-        private static bool TryParseHex(string hexString, out uint val)
-        {
-            if (hexString.StartsWith("0x", StringComparison.CurrentCultureIgnoreCase))
-                hexString = hexString.Substring(2);
-            return UInt32.TryParse(hexString,
-                NumberStyles.HexNumber,
-                CultureInfo.CurrentCulture,
-                out val);
-        }
-        private uint[] LoadKey(string keyFilename)
+        private void StatsReply(byte[] reply, bool showEvents)
         {
-            if (!File.Exists(keyFilename))
+            var size = reply.Length - 4;
+            if (CRC32K.Compute(reply, 0, size) != ReadBigEndian(reply, size, 4))
             {
-                FlasherInterface.WriteLine(FlasherMessageType.Error,"ERROR: key file {0} missing. No key used", keyFilename);
-                return null;
+                FlasherInterface.WriteLine(FlasherMessageType.Error, "Stats corrupted");
+                return;
             }
-            var text = File.ReadAllText(keyFilename);
-            text = text.Replace('\n', ' ');
-            text = text.Replace('\r', ' ');
-            text = text.Replace('\t', ' ');
-            var words = text.Split(new[] {' '}, StringSplitOptions.RemoveEmptyEntries);
-            if (words.Length != 8)
+
+            var ticksPerMs = (double) Math.Max(1U, ReadBigEndian(reply, 0, 4));
+            var pos = 4;
+            var phaseCount = reply[pos++];
+            var phases = new List<string>();
+            for (var i = 0; i < phaseCount; ++i, pos += 4)
+                phases.Add(String.Format("{0} {1:F1}",
+                    i < statPhases.Length ? statPhases[i] : "phase " + i,
+                    ReadBigEndian(reply, pos, 4)/ticksPerMs));
+            FlasherInterface.WriteLine(FlasherMessageType.Info, "Device ms: {0}", String.Join(", ", phases));
+
+            var eraseAttempts = ReadBigEndian(reply, pos, 4);
+            var eraseFailures = ReadBigEndian(reply, pos + 4, 4);
+            pos += 8;
+            var countCount = reply[pos++];
+            var counts = new List<string>();
+            for (var i = 0; i < countCount; ++i, pos += 4)
+                counts.Add(String.Format("{0} {1}",
+                    ReadBigEndian(reply, pos, 4),
+                    i < statCounts.Length ? statCounts[i] : "count " + i));
+            FlasherInterface.WriteLine(FlasherMessageType.Info, "Device counts: {0}, {1} page erases, {2} failed",
+                String.Join(", ", counts), eraseAttempts, eraseFailures);
+
+            var eventCount = reply[pos++];
+            if (!showEvents || eventCount == 0)
+                return;
+            var firstTicks = ReadBigEndian(reply, pos, 4);
+            for (var i = 0; i < eventCount; ++i, pos += 8)
             {
-                FlasherInterface.WriteLine(FlasherMessageType.Error,"ERROR: key file must have 8 entries");
-                return null;
+                var type = reply[pos + 4];
+                var value = ReadBigEndian(reply, pos + 5, 3);
+                FlasherInterface.WriteLine(FlasherMessageType.Info, "  {0,10:F3} ms  {1,-12}  0x{2:X6}",
+                    unchecked(ReadBigEndian(reply, pos, 4) - firstTicks)/ticksPerMs,
+                    type < statEvents.Length ? statEvents[type] : "event " + type,
+                    value);
             }
-            // If encrypted, you need a 32 byte key, stored here as eight 32-bit values
+        }
+
+        #endregion
+
+        // bytes sent and time taken during an automatic write
+        private Stopwatch writeTimer;
+        private long writeBytes;
+
+        private void StartWriteTimer()
+        {
+            writeBytes = 0;
+            blockResends = 0;
+            writeTimer = Stopwatch.StartNew();
+        }
+
+        #region Addressed writes
+
+        // block being sent by WriteBlock, and times it has been sent
+        private int sendingIndex = -1;
+        private int blockSends;
+
+        // times WriteBlock sends a block before giving up on it
+        private const int BlockRetryMax = 5;
+
+        // NACKs answered by sending the block again
+        private int blockResends;
+
+        // keystream counters of the image blocks, for 'A' packets
+        private Image counterImage;
+        private List<uint> keystreamCounters;
+
+        /// <summary>
+        /// The image block as an 'A' packet, the 'W' packet with the crypto
+        /// block counter of its payload after the command, so the bootloader
+        /// can decrypt it without the packets before it. Null if the block 
+        /// must go as it is: not encrypted, the IV or final block, or a 
+        /// bootloader without 'A'.
+        /// </summary>
+        private byte[] CounterPacket(int index)
+        {
+            if (image == null || !image.Encrypted || WriteBlocks != image.Blocks || !bootCommands.Contains('A') ||
+                index <= 0 || index >= WriteBlocks.Count || WriteBlocks[index].Length <= 3)
+                return null;
+            if (counterImage != image)
+            {
+                counterImage = image;
+                keystreamCounters = image.KeystreamCounters();
+            }
+
+            var b = WriteBlocks[index];
+            var packet = new byte[b.Length + 4];
+            packet[0] = (byte) 'A';
+            MakeImage.WriteBigEndian(packet, 1, keystreamCounters[index], 4);
+            Array.Copy(b, 1, packet, 5, b.Length - 1);
+            return packet;
+        }
+
+        #endregion
+
+        #region Delta writes
+
+        // when possible, only send pages that differ from the device
+        private bool deltaWrites = true;
+
+        // blocks for changed pages, and their page ranges, or null to send the whole image
+        private List<byte[]> deltaBlocks;
+        private List<Tuple<uint, uint>> deltaRanges;
+
+        /// <summary>
+        /// Blocks the writes send
+        /// </summary>
+        private List<byte[]> WriteBlocks
+        {
+            get { return deltaBlocks ?? image.Blocks; }
+        }
+
+        /// <summary>
+        /// Get the per page CRC manifest from the bootloader, and keep only
+        /// image blocks for pages that differ. Encrypted blocks form one 
+        /// stream and cannot be dropped, so those images are always sent whole.
+        /// Changed pages are erased with 'P' or lazily, so the others survive.
+        /// </summary>
+        private void ManifestCommand()
+        {
+            deltaBlocks = null;
+            deltaRanges = null;
+            if (!deltaWrites || image == null || image.Encrypted || !image.PageCrcs.Any() ||
+                !bootCommands.Contains('M') || !(bootCommands.Contains('P') || (lazyErase && bootCommands.Contains('L'))))
+            {
+                FinishManifest();
+                return;
+            }
+
+            WatchForAckOrNack(() =>
+            {
+                if (lastReply != ACK_OK)
+                {
+                    FlasherInterface.WriteLine(FlasherMessageType.Warning, "Manifest refused, writing all pages");
+                    FinishManifest();
+                    return true; // remove on execute
+                }
+                ReadBinary(2, count =>
+                {
+                    var pageCount = (count[0] << 8) | count[1];
+                    ReadBinary(4*pageCount + 4, crcs => ManifestReply(count, crcs));
+                });
+                return true; // remove on execute
+            });
+
+            // all program flash then boot flash pages
+            serialManager.WriteBytes(new byte[] {(byte) 'M', 0, 0, 0, 0, 0, 0});
+        }
+
+        private void ManifestReply(byte[] count, byte[] crcs)
+        {
+            var pageCount = crcs.Length/4 - 1;
+            var crc = CRC32K.Compute(count.Concat(crcs.Take(4*pageCount)).ToArray());
+            var sentCrc = ReadBigEndian(crcs, 4*pageCount, 4);
+            var programPages = (int)(picDetails.FlashSize/picDetails.FlashPageSize);
+            if (crc != sentCrc || pageCount != (picDetails.FlashSize + picDetails.BootSize)/picDetails.FlashPageSize)
+            {
+                FlasherInterface.WriteLine(FlasherMessageType.Error, "Manifest corrupted, writing all pages");
+                FinishManifest();
+                return;
+            }
+
+            // device page CRCs by address
+            var deviceCrcs = new Dictionary<uint, uint>();
+            for (var i = 0; i < pageCount; ++i)
+            {
+                var address = i < programPages
+                    ? picDetails.FlashStart + (uint) i*picDetails.FlashPageSize
+                    : picDetails.BootStart + (uint) (i - programPages)*picDetails.FlashPageSize;
+                deviceCrcs[address] = ReadBigEndian(crcs, 4*i, 4);
+            }
+
+            var changed = new HashSet<uint>(image.PageCrcs
+                .Where(p => !deviceCrcs.ContainsKey(p.Item1) || deviceCrcs[p.Item1] != p.Item2)
+                .Select(p => p.Item1));
+
+            // a fast booting bootloader starts the application unless its first
+            // page is blank, and the image writes that page last, so resend it
+            // with any change to keep an interrupted flash recoverable
+            var resend = new HashSet<uint>(changed);
+            var applicationPages = image.PageCrcs
+                .Select(p => p.Item1)
+                .Where(p => p < picDetails.FlashStart + picDetails.FlashSize)
+                .ToList();
+            if (changed.Any() && applicationPages.Any())
+                resend.Add(applicationPages.Min());
+
+            // a block may hold several pages, and is sent if any changed.
+            // All of its pages are then erased and written
+            deltaBlocks = image.Blocks
+                .Where(b => b.Length == 3 || BlockPages(b).Any(resend.Contains))
+                .ToList();
+
+            deltaRanges = MergePages(deltaBlocks.Where(b => b.Length > 3).SelectMany(BlockPages).Distinct());
+
+            FlasherInterface.WriteLine(FlasherMessageType.Info, "{0} of {1} image pages differ, sending {2} of {3} blocks",
+                changed.Count, image.PageCrcs.Count, deltaBlocks.Count, image.Blocks.Count);
+
+            if (changed.Count == 0)
+            {
+                deltaBlocks = null;
+                deltaRanges = null;
+                FlasherInterface.SetColors(FlasherColor.Green, FlasherColor.DarkGreen, true);
+                FlasherInterface.WriteLine("Device already matches image, nothing to flash.");
+                FlasherInterface.RestoreColors();
+                if (state == FlasherState.AutoManifestPending)
+                    state = FlasherState.Connected;
+                return;
+            }
+
+            FinishManifest();
+        }
+
+        private void FinishManifest()
+        {
+            if (state == FlasherState.AutoManifestPending)
+                state = FlasherState.AutoEraseStart;
+        }
+
+        /// <summary>
+        /// Addresses of the pages an unencrypted block writes
+        /// </summary>
+        private IEnumerable<uint> BlockPages(byte[] block)
+        {
+            // address A is 10 bytes from the end, then length L
+            var address = ReadBigEndian(block, block.Length - 10, 4);
+            var length = ReadBigEndian(block, block.Length - 6, 2);
+            var pageMask = ~(picDetails.FlashPageSize - 1);
+            for (var page = address & pageMask; page < address + length; page += picDetails.FlashPageSize)
+                yield return page;
+        }
+
+        /// <summary>
+        /// Merge page addresses into (start, page count) ranges
+        /// </summary>
+        private List<Tuple<uint, uint>> MergePages(IEnumerable<uint> pages)
+        {
+            var ranges = new List<Tuple<uint, uint>>();
+            foreach (var page in pages.OrderBy(p => p))
+            {
+                var n = ranges.Count - 1;
+                if (n >= 0 && ranges[n].Item1 + ranges[n].Item2*picDetails.FlashPageSize == page)
+                    ranges[n] = new Tuple<uint, uint>(ranges[n].Item1, ranges[n].Item2 + 1);
+                else
+                    ranges.Add(new Tuple<uint, uint>(page, 1));
+            }
+            return ranges;
+        }
+
+        private static uint ReadBigEndian(byte[] buffer, int location, int bytes)
+        {
+            uint value = 0;
+            for (var i = 0; i < bytes; ++i)
+                value = (value << 8) | buffer[location + i];
+            return value;
+        }
+
+        #endregion
+
+        #region Baud rate change
+
+        // rate to switch to after connecting, 0 for none
+        private int fastBaudRate;
+
+        // bootloader rate from info, 0 if it cannot change rate
+        private int bootBaudRate;
+
+        // ms to wait for the bootloader to answer at the new rate,
+        // longer than the bootloader waits so both give up in order
+        private const int BaudConfirmMs = 1000;
+
+        // ms between confirmation ACKs at the new rate
+        private const int BaudConfirmRepeatMs = 50;
+
+        private bool baudConfirming = false;
+        private int baudPreviousRate;
+        private Stopwatch baudTimer;
+        private long baudLastSendMs;
+
+        /// <summary>
+        /// Ask the bootloader to switch to the fast baud rate. The 
+        /// bootloader answers ACK_BAUD_CHANGE, then both switch and the 
+        /// flasher sends ACK_OK until the bootloader answers ACK_OK at
+        /// the new rate. If that fails both go back to the old rate.
+        /// </summary>
+        private void BaudCommand()
+        {
+            if (fastBaudRate <= 0 || bootBaudRate <= 0 || fastBaudRate == serialManager.BaudRate)
+            {
+                if (state != FlasherState.AutoBaudPending)
+                    FlasherInterface.WriteLine(FlasherMessageType.Warning,
+                        "Baud rate not changed, needs a fast rate on the command line and bootloader info first");
+                FinishBaudChange();
+                return;
+            }
+
+            WatchForAckOrNack(() =>
+            {
+                if (lastReply == ACK_BAUD_CHANGE)
+                {
+                    baudPreviousRate = serialManager.BaudRate;
+                    serialManager.SetBaudRate(fastBaudRate);
+                    baudConfirming = true;
+                    baudTimer = Stopwatch.StartNew();
+                    baudLastSendMs = -BaudConfirmRepeatMs;
+                    WatchForAckOrNack(() =>
+                    {
+                        if (!baudConfirming)
+                            return true; // remove
+                        if (lastReply != ACK_OK)
+                            return false; // keep
+                        baudConfirming = false;
+                        bootBaudRate = fastBaudRate;
+                        FlasherInterface.WriteLine(FlasherMessageType.Info, "Baud rate now {0}", fastBaudRate);
+                        FinishBaudChange();
+                        return true; // remove
+                    });
+                }
+                else
+                {
+                    FlasherInterface.WriteLine(FlasherMessageType.Warning, "Bootloader kept baud rate {0}", serialManager.BaudRate);
+                    FinishBaudChange();
+                }
+                return true; // remove on execute
+            });
+
+            var rate = (uint) fastBaudRate;
+            serialManager.WriteBytes(new[]
+            {
+                (byte) 'R',
+                (byte) (rate >> 24), (byte) (rate >> 16), (byte) (rate >> 8), (byte) rate
+            });
+        }
+
+        /// <summary>
+        /// Send confirmations at the new rate, and go back on timeout
+        /// </summary>
+        private void PumpBaudChange()
+        {
+            var ms = baudTimer.ElapsedMilliseconds;
+            if (ms > BaudConfirmMs)
+            {
+                baudConfirming = false;
+                serialManager.SetBaudRate(baudPreviousRate);
+                FlasherInterface.WriteLine(FlasherMessageType.Warning, "Baud rate {0} failed, back to {1}", fastBaudRate, baudPreviousRate);
+                // resync at the old rate, the bootloader echoes the ACK
+                WriteByte(ACK_OK);
+                FinishBaudChange();
+            }
+            else if (ms - baudLastSendMs >= BaudConfirmRepeatMs)
+            {
+                baudLastSendMs = ms;
+                WriteByte(ACK_OK);
+            }
+        }
+
+        private void FinishBaudChange()
+        {
+            if (state == FlasherState.AutoBaudPending)
+                state = FlasherState.AutoImageStart;
+        }
+
+        #endregion
+
+        #region Sequenced writes
+
+        // number of 'S' packets the bootloader allows in flight, from info
+        // 0 when the bootloader only takes 'W' packets
+        private int writeWindow = 0;
+
+        // use 'S' packets when the bootloader supports them
+        private bool pipelineWrites = true;
+
+        // times a packet is sent before giving up on it
+        private const int WindowRetryMax = 5;
+
+        // resend packets with no reply after this long
+        private const int WindowTimeoutMs = 2000;
+
+        private bool windowActive = false;
+
+        // next image block not yet sent
+        private int windowNext;
+
+        // blocks sent without a reply yet, and when they were sent
+        private readonly SortedDictionary<int, DateTime> windowInFlight = new SortedDictionary<int, DateTime>();
+
+        // times each block has been sent
+        private readonly Dictionary<int, int> windowSends = new Dictionary<int, int>();
+
+        // order of the last send of each block, to tell which went out first
+        private readonly Dictionary<int, long> windowSendOrder = new Dictionary<int, long>();
+        private long windowSendCount;
+
+        // blocks given up on
+        private int windowFailures;
+
+        /// <summary>
+        /// Start writing the image as sequenced 'S' packets, keeping up
+        /// to writeWindow of them in flight and resending only the ones
+        /// that fail. Block i goes out with sequence number i mod 256, 
+        /// matching the bootloader count that restarts on each erase.
+        /// </summary>
+        private void StartWindowWrite()
+        {
+            if (image == null)
+            {
+                FlasherInterface.WriteLine(FlasherMessageType.Error,"ERROR: load or create image first");
+                state = FlasherState.Connected;
+                return;
+            }
+            // 0, or where a resumed flash carries on
+            windowNext = imageBlockIndex;
+            windowFailures = 0;
+            windowInFlight.Clear();
+            windowSends.Clear();
+            windowSendOrder.Clear();
+            windowActive = true;
+
+            // each reply is an ACK or NACK followed by the raw sequence byte,
+            // and an ACK_OK then has the CRC of the flash read back
+            WatchForAckOrNack(() =>
+            {
+                if (!windowActive)
+                    return true; // remove
+                var reply = lastReply;
+                if (reply == NACK_RECEIVE_TIMEOUT)
+                { // a byte count, and no sequence number
+                    ReadTimeoutCount(WindowReceiveTimeout);
+                    return false; // keep
+                }
+                ReadBinary(reply == ACK_OK ? 5 : 1,
+                    data => WindowReply(reply, data[0], reply == ACK_OK ? ReadBigEndian(data, 1, 4) : 0));
+                return false; // keep
+            });
+
+            PumpWriteWindow();
+        }
+
+        /// <summary>
+        /// Resend packets that timed out, then fill the window with new ones
+        /// </summary>
+        private void PumpWriteWindow()
+        {
+            var now = DateTime.Now;
+            var timedOut = windowInFlight
+                .Where(p => (now - p.Value).TotalMilliseconds > WindowTimeoutMs)
+                .Select(p => p.Key)
+                .ToList();
+            foreach (var index in timedOut)
+            {
+                FlasherInterface.WriteLine(FlasherMessageType.Warning, "Block {0} timed out", index + 1);
+                ResendWindowBlock(index);
+            }
+
+            while (windowActive && CanSendWindowBlock())
+                SendWindowBlock(windowNext++);
+        }
+
+        private bool CanSendWindowBlock()
+        {
+            if (windowNext >= WriteBlocks.Count)
+                return false;
+            // the first block may set up decryption, so it must land before any other
+            if (windowInFlight.ContainsKey(0))
+                return false;
+            if (windowInFlight.Count == 0)
+                return true;
+            // the zero length final block only goes once all others are done
+            if (windowNext == WriteBlocks.Count - 1)
+                return false;
+            return windowNext - windowInFlight.Keys.First() < writeWindow;
+        }
+
+        private void SendWindowBlock(int index)
+        {
+            var b = WriteBlocks[index];
+            // same as the 'W' packet with a sequence number after the command
+            var packet = new byte[b.Length + 1];
+            packet[0] = (byte) 'S';
+            packet[1] = (byte) index;
+            Array.Copy(b, 1, packet, 2, b.Length - 1);
+
+            int sends;
+            windowSends.TryGetValue(index, out sends);
+            windowSends[index] = sends + 1;
+            windowSendOrder[index] = ++windowSendCount;
+            windowInFlight[index] = DateTime.Now;
+
+            var numberToken = FlasherInterface.ColorToken(
+                index == WriteBlocks.Count - 1 ? FlasherColor.Green : FlasherColor.Yellow,
+                FlasherColor.Black);
+            var defaultToken = FlasherInterface.ColorToken();
+            FlasherInterface.WriteLine(FlasherMessageType.Info, "Writing block {2}{0}{3} of {2}{1}{3}{4}",
+                index + 1, WriteBlocks.Count,
+                numberToken, defaultToken,
+                sends > 0 ? " again" : ""
+                );
+
+            writeBytes += packet.Length;
+            serialManager.WriteBytes(packet);
+        }
+
+        private void ResendWindowBlock(int index)
+        {
+            if (windowSends[index] >= WindowRetryMax)
+            {
+                FlasherInterface.WriteLine(FlasherMessageType.Error, "ERROR: block {0} failed {1} times, giving up", index + 1, WindowRetryMax);
+                windowInFlight.Remove(index);
+                ++windowFailures;
+                if (index == WriteBlocks.Count - 1)
+                    FinishWindowWrite();
+                return;
+            }
+            SendWindowBlock(index);
+        }
+
+        /// <summary>
+        /// The bootloader gave up on a packet part way through. Replies come
+        /// in order, so that was the oldest one in flight, and any sent after
+        /// it went into it or were dropped, so they all go again in order.
+        /// </summary>
+        private void WindowReceiveTimeout()
+        {
+            if (!windowActive)
+                return;
+            foreach (var index in windowInFlight.Keys.ToList())
+                ResendWindowBlock(index);
+            if (windowActive)
+                PumpWriteWindow();
+        }
+
+        /// <summary>
+        /// Handle the reply to a sequenced packet
+        /// </summary>
+        /// <param name="reply"></param>
+        /// <param name="sequence"></param>
+        /// <param name="readbackCrc"></param>
+        private void WindowReply(byte reply, byte sequence, uint readbackCrc)
+        {
+            // window is much smaller than 256, so the sequence byte is unique in flight
+            var match = windowInFlight.Keys.Where(k => (byte) k == sequence).ToList();
+            if (!windowActive || match.Count == 0)
+                return; // late reply to a packet already resent
+
+            var index = match[0];
+            if (reply == ACK_OK)
+            {
+                windowInFlight.Remove(index);
+                var expectedCrc = ExpectedReadbackCrc(WriteBlocks[index]);
+                if (expectedCrc.HasValue && expectedCrc.Value != readbackCrc)
+                {
+                    FlasherInterface.WriteLine(FlasherMessageType.Error,
+                        "ERROR: block {0} reads back with CRC {1:X8}, expected {2:X8}",
+                        index + 1, readbackCrc, expectedCrc.Value);
+                    ++windowFailures;
+                }
+                if (index == WriteBlocks.Count - 1)
+                    FinishWindowWrite();
+            }
+            else if (reply == NACK_SEQUENCE_ERROR)
+            {
+                // a block sent before this one went missing. Replies come in
+                // order, so any sent earlier still without one never arrived.
+                // Send them again oldest first, then this one, instead of
+                // waiting for them to time out
+                var sentAt = windowSendOrder[index];
+                var lost = windowInFlight.Keys
+                    .Where(k => k != index && windowSendOrder[k] < sentAt)
+                    .ToList();
+                foreach (var k in lost)
+                    if (windowActive)
+                        ResendWindowBlock(k);
+                if (windowActive)
+                    ResendWindowBlock(index);
+            }
+            else
+                ResendWindowBlock(index);
+            if (windowActive)
+                PumpWriteWindow();
+        }
+
+        /// <summary>
+        /// CRC32K the bootloader should read back after writing the block,
+        /// over the L data bytes at the start of the payload. Null if the
+        /// data cannot be seen because the image is encrypted, or not known
+        /// to be unencrypted, or the block writes nothing.
+        /// </summary>
+        /// <param name="block"></param>
+        /// <returns></returns>
+        private uint? ExpectedReadbackCrc(byte[] block)
+        {
+            // older images do not record if they are encrypted
+            if (image == null || image.Encrypted || !image.PageCrcs.Any() || block.Length < 3 + 10)
+                return null;
+            // length L is 6 bytes from the end, before the CRC
+            var length = ReadBigEndian(block, block.Length - 6, 2);
+            if (IsCompressedBlock(block))
+            {
+                var data = LZ77Compressor.Decompress(block.Skip(3).Take(block.Length - 3 - 10).ToList());
+                return data != null && data.Count == length ? CRC32K.Compute(data.ToArray()) : (uint?) null;
+            }
+            return CRC32K.Compute(block, 3, (int) length);
+        }
+
+        private void FinishWindowWrite()
+        {
+            windowActive = false;
+            if (state == FlasherState.AutoWritePending)
+                state = FlasherState.Connected;
+            ReportFlashResult(windowFailures == 0);
+        }
+
+        #endregion
+
+        private void WriteByte(byte data)
+        {
+            var buffer = new[] { data };
+            serialManager.WriteBytes(buffer);
+        }
+
+
+        PicDefs.PicType picType = PicDefs.PicType.None;
+        private PicDefs.PicDef picDetails = null;
+
+
+
+        private SerialManager serialManager;
+
+        // command letters the bootloader lists in its info
+        private string bootCommands = "ICEWQ";
+
+        // erase each page as it is first written, if the bootloader can
+        private bool lazyErase = false;
+
+        // set when the current erase was left to the writes
+        private bool eraseDeferred;
+
+        // page ranges being erased, null for a full erase
+        private List<Tuple<uint, uint>> eraseRanges;
+        private Stopwatch eraseTimer;
+
+        /// <summary>
+        /// Choose between a lazy, range, or full erase, and so which blocks
+        /// get written
+        /// </summary>
+        private void PlanErase()
+        {
+            eraseRanges = null;
+            eraseDeferred = lazyErase && bootCommands.Contains('L');
+
+            // erase only the pages the image writes when possible. The
+            // bootloader takes as many ranges as fit in its receive buffer
+            var pageRanges = deltaRanges ?? (image != null ? image.PageRanges : null);
+            if (!eraseDeferred && pageRanges != null && pageRanges.Any() && pageRanges.Count <= MaxEraseRanges && bootCommands.Contains('P'))
+                eraseRanges = pageRanges;
+            if (deltaBlocks != null && !eraseDeferred && eraseRanges != deltaRanges)
+            {
+                // unchanged pages would be erased, so send them all
+                FlasherInterface.WriteLine(FlasherMessageType.Warning, "Cannot erase just the changed pages, writing all pages");
+                deltaBlocks = null;
+            }
+        }
+
+        private void EraseDevice()
+        {
+
+            imageBlockIndex = 0;
+            nackCount = 0;
+            ackCount = 0;
+            eraseTimer = Stopwatch.StartNew();
+            PlanErase();
+
+            WatchForEraseFinished(() =>
+            {
+                ReportEraseTime();
+                if (state == FlasherState.AutoErasePending)
+                {
+                    state = !eraseDeferred && bootCommands.Contains('K')
+                        ? FlasherState.AutoBlankStart
+                        : FlasherState.AutoWriteStart;
+                }
+            });
+
+            if (eraseDeferred)
+            {
+                // replies as a full erase, but erases nothing yet
+                WriteCommand('L');
+                return;
+            }
+
+            if (eraseRanges == null)
+            {
+                WriteCommand('E');
+                return;
+            }
+
+            // a rejected range list gets a single NACK before any page 
+            // replies, so fall back to a full erase
+            WatchForAckOrNack(() =>
+            {
+                if (IsNack(lastReply) && lastReply != NACK_ERASE_FAILED)
+                {
+                    FlasherInterface.WriteLine(FlasherMessageType.Warning, "Range erase refused, erasing all flash");
+                    eraseRanges = null;
+                    deltaBlocks = null;
+                    nackCount = 0;
+                    WriteCommand('E');
+                }
+                return true; // remove on execute
+            });
+
+            FlasherInterface.WriteLine(FlasherMessageType.Info, "Erasing {0} page ranges", eraseRanges.Count);
+            SendRangeErase(eraseRanges);
+        }
+
+        /// <summary>
+        /// Send a 'P' command erasing the page ranges
+        /// </summary>
+        private void SendRangeErase(List<Tuple<uint, uint>> ranges)
+        {
+            // 'P', count, ranges, CRC of count and ranges
+            var message = new byte[1 + 1 + 6 * ranges.Count + 4];
+            message[0] = (byte) 'P';
+            message[1] = (byte) ranges.Count;
+            for (var i = 0; i < ranges.Count; ++i)
+            {
+                MakeImage.WriteBigEndian(message, (uint) (2 + 6 * i), ranges[i].Item1, 4);
+                MakeImage.WriteBigEndian(message, (uint) (2 + 6 * i + 4), ranges[i].Item2, 2);
+            }
+            var crc32 = CRC32K.Compute(message, 1, message.Length - 1 - 4);
+            MakeImage.WriteBigEndian(message, (uint) (message.Length - 4), crc32, 4);
+            serialManager.WriteBytes(message);
+        }
+
+        #region Journal
+
+        /// <summary>
+        /// Before erasing, ask the bootloader how far an earlier flash of the
+        /// same image got. If the link dropped partway, writing carries on
+        /// after the last packet the bootloader committed instead of erasing
+        /// and starting over. Otherwise the session is named for the erase
+        /// so a drop during this flash can be resumed the same way.
+        /// </summary>
+        private void JournalCommand()
+        {
+            PlanErase();
+            if (image == null || eraseDeferred || !bootCommands.Contains('J') || !bootCommands.Contains('U'))
+            {
+                EraseDevice();
+                return;
+            }
+
+            // only a whole image flash can be resumed, a delta being made
+            // against what the dropped flash left behind
+            SendJournal(SessionId(image.Blocks), count =>
+            {
+                if (0 < count && count < image.Blocks.Count)
+                    ResumeCommand(count);
+                else
+                    JournalErase();
+            });
+        }
+
+        /// <summary>
+        /// Erase, naming the session by the blocks to be written if the last
+        /// 'J' named another
+        /// </summary>
+        private void JournalErase()
+        {
+            if (deltaBlocks == null)
+                EraseDevice();
+            else
+                SendJournal(SessionId(deltaBlocks), count => EraseDevice());
+        }
+
+        private void ResumeCommand(int count)
+        {
+            WatchForAckOrNack(() =>
+            {
+                if (lastReply != ACK_OK)
+                {
+                    FlasherInterface.WriteLine(FlasherMessageType.Warning, "Resume refused, erasing");
+                    JournalErase();
+                    return true; // remove on execute
+                }
+                FlasherInterface.WriteLine(FlasherMessageType.Info, "Resuming after block {0} of {1}", count, image.Blocks.Count);
+                deltaBlocks = null;
+                deltaRanges = null;
+                imageBlockIndex = count;
+                nackCount = 0;
+                ackCount = 0;
+                if (state == FlasherState.AutoErasePending)
+                    state = FlasherState.AutoWriteStart;
+                return true; // remove on execute
+            });
+            SendJournalValue('U', (uint) count);
+        }
+
+        /// <summary>
+        /// Name the session with a 'J' command, then call done with the count
+        /// of its packets the bootloader had committed, 0 if none
+        /// </summary>
+        private void SendJournal(uint sessionId, Action<int> done)
+        {
+            WatchForAckOrNack(() =>
+            {
+                if (lastReply != ACK_OK)
+                {
+                    FlasherInterface.WriteLine(FlasherMessageType.Warning, "Journal refused");
+                    done(0);
+                    return true; // remove on execute
+                }
+                ReadBinary(8, reply =>
+                {
+                    var count = ReadBigEndian(reply, 0, 4);
+                    if (CRC32K.Compute(reply, 0, 4) != ReadBigEndian(reply, 4, 4))
+                    {
+                        FlasherInterface.WriteLine(FlasherMessageType.Error, "Journal reply corrupted");
+                        count = 0;
+                    }
+                    done((int) count);
+                });
+                return true; // remove on execute
+            });
+            SendJournalValue('J', sessionId);
+        }
+
+        // 'J' or 'U', a big endian value, and the CRC of the value
+        private void SendJournalValue(char command, uint value)
+        {
+            var message = new byte[1 + 4 + 4];
+            message[0] = (byte) command;
+            MakeImage.WriteBigEndian(message, 1, value, 4);
+            MakeImage.WriteBigEndian(message, 5, CRC32K.Compute(message, 1, 4), 4);
+            serialManager.WriteBytes(message);
+        }
+
+        // the session ID is the CRC of the packets to be sent
+        private static uint SessionId(IEnumerable<byte[]> blocks)
+        {
+            return CRC32K.Compute(blocks.SelectMany(b => b).ToArray());
+        }
+
+        #endregion
+
+        #region Staging
+
+        // stream bytes the application stores before asking for more
+        private const int StageChunkSize = 1024;
+
+        /// <summary>
+        /// Send the image to the running application for a staged update. The
+        /// application erases the bootloader staging region, then stores the
+        /// image stream a chunk at a time, asking for each next chunk once the
+        /// last is written. The bootloader copies it into place on the next
+        /// reset, so the application keeps running during the transfer.
+        /// </summary>
+        private void StageCommand()
+        {
+            if (image == null)
+            {
+                FlasherInterface.WriteLine(FlasherMessageType.Error, "ERROR: load or create image first");
+                return;
+            }
+
+            // the bootloader copies a staged image into application flash
+            // only, and refuses the whole stream otherwise, so boot flash and
+            // configuration blocks are left out. A loaded image cannot be
+            // trimmed, encrypted blocks hiding their addresses
+            var staged = image;
+            if (imageHexFilename != null)
+            {
+                staged = new MakeImage().CreateFromFile(imageHexFilename, picDetails, TrimStagedMemory,
+                    imageKey, PacketSize, bootCompression, (uint) bootLength);
+                if (staged == null)
+                {
+                    FlasherInterface.WriteLine(FlasherMessageType.Error, "ERROR: cannot make the staged image");
+                    return;
+                }
+            }
+            else if (!image.PageRanges.Any() || image.PageRanges.Any(r =>
+                r.Item1 < picDetails.FlashStart + bootLength ||
+                picDetails.FlashStart + picDetails.FlashSize < r.Item1 + r.Item2*picDetails.FlashPageSize))
+            {
+                FlasherInterface.WriteLine(FlasherMessageType.Error, "ERROR: image writes outside application flash, or does not list its pages. Stage from the hex file instead");
+                return;
+            }
+
+            // the packets exactly as they would be written to the bootloader
+            var stream = staged.Blocks.SelectMany(b => b).ToArray();
+            var sent = 0;
+            var done = false;
+            Action sendChunk = () =>
+            {
+                var count = Math.Min(StageChunkSize, stream.Length - sent);
+                serialManager.WriteBytes(stream.Skip(sent).Take(count).ToArray());
+                sent += count;
+            };
+
+            WatchForLine("Staging ready", line =>
+            {
+                if (done)
+                    return true; // remove on execute, left from a failed erase
+                // stream length then CRC, then the first chunk
+                var header = new byte[8];
+                MakeImage.WriteBigEndian(header, 0, (uint) stream.Length, 4);
+                MakeImage.WriteBigEndian(header, 4, CRC32K.Compute(stream), 4);
+                serialManager.WriteBytes(header);
+                FlasherInterface.WriteLine(FlasherMessageType.Info, "Staging {0} bytes", stream.Length);
+                sendChunk();
+                return true; // remove on execute
+            });
+            WatchForLine("Staged chunk", line =>
+            {
+                if (done || sent == stream.Length)
+                    return true; // remove on execute
+                sendChunk();
+                return false;
+            });
+            WatchForLine("Staging finished", line =>
+            {
+                done = true;
+                FlasherInterface.WriteLine(FlasherMessageType.Info, "Image staged, the device copies it into place as it resets");
+                return true; // remove on execute
+            });
+            WatchForLine("Staging failed", line =>
+            {
+                done = true;
+                FlasherInterface.WriteLine(FlasherMessageType.Error, "Application could not stage the image");
+                return true; // remove on execute
+            });
+
+            // sync bytes would land in the stream
+            state = FlasherState.Application;
+            WriteCommand('U');
+        }
+
+        #endregion
+
+        #region Blank check
+
+        /// <summary>
+        /// Ask the bootloader which pages are not blank. After an automatic 
+        /// erase, image pages that did not come back blank are erased once
+        /// more with 'P', instead of trusting the erase ACK or comparing a
+        /// whole flash CRC the flasher has no expected value for.
+        /// </summary>
+        private void BlankCheckCommand()
+        {
+            if (!bootCommands.Contains('K'))
+            {
+                FlasherInterface.WriteLine(FlasherMessageType.Warning, "Bootloader has no blank check");
+                FinishBlankCheck();
+                return;
+            }
+
+            WatchForAckOrNack(() =>
+            {
+                if (lastReply != ACK_OK)
+                {
+                    FlasherInterface.WriteLine(FlasherMessageType.Warning, "Blank check refused");
+                    FinishBlankCheck();
+                    return true; // remove on execute
+                }
+                ReadBinary(2, count =>
+                {
+                    var pageCount = (count[0] << 8) | count[1];
+                    ReadBinary((pageCount + 7)/8 + 4, bits => BlankCheckReply(count, bits));
+                });
+                return true; // remove on execute
+            });
+
+            // all program flash then boot flash pages
+            serialManager.WriteBytes(new byte[] {(byte) 'K', 0, 0, 0, 0, 0, 0});
+        }
+
+        private void BlankCheckReply(byte[] count, byte[] bits)
+        {
+            var pageCount = (count[0] << 8) | count[1];
+            var bitmapSize = bits.Length - 4;
+            var crc = CRC32K.Compute(count.Concat(bits.Take(bitmapSize)).ToArray());
+            var sentCrc = ReadBigEndian(bits, bitmapSize, 4);
+            var programPages = (int)(picDetails.FlashSize/picDetails.FlashPageSize);
+            if (crc != sentCrc || pageCount != (picDetails.FlashSize + picDetails.BootSize)/picDetails.FlashPageSize)
+            {
+                FlasherInterface.WriteLine(FlasherMessageType.Error, "Blank check corrupted");
+                FinishBlankCheck();
+                return;
+            }
+
+            var notBlank = new HashSet<uint>();
+            for (var i = 0; i < pageCount; ++i)
+            {
+                if ((bits[i/8] & (1 << (i & 7))) == 0)
+                    continue;
+                notBlank.Add(i < programPages
+                    ? picDetails.FlashStart + (uint) i*picDetails.FlashPageSize
+                    : picDetails.BootStart + (uint) (i - programPages)*picDetails.FlashPageSize);
+            }
+            FlasherInterface.WriteLine(FlasherMessageType.Info, "{0} of {1} pages not blank", notBlank.Count, pageCount);
+
+            if (state != FlasherState.AutoBlankPending || image == null)
+            {
+                FinishBlankCheck();
+                return;
+            }
+
+            // image pages the erase should have cleared. The boot start page
+            // is only erased when written, and other pages are the bootloader
+            // or were left alone on purpose
+            var pageRanges = deltaRanges ?? image.PageRanges;
+            var stale = pageRanges
+                .SelectMany(r => Enumerable.Range(0, (int) r.Item2).Select(i => r.Item1 + (uint) i*picDetails.FlashPageSize))
+                .Where(p => p != picDetails.BootStart && notBlank.Contains(p))
+                .ToList();
+
+            var ranges = MergePages(stale);
+            if (!stale.Any() || !bootCommands.Contains('P') || ranges.Count > MaxEraseRanges)
+            {
+                if (stale.Any())
+                    FlasherInterface.WriteLine(FlasherMessageType.Warning, "{0} image pages not blank, cannot re-erase them", stale.Count);
+                FinishBlankCheck();
+                return;
+            }
+
+            var refused = false;
+            WatchForEraseFinished(() =>
+            {
+                if (refused)
+                    return;
+                FlasherInterface.WriteLine(FlasherMessageType.Info, "Re-erased {0} pages not blank", stale.Count);
+                FinishBlankCheck();
+            });
+
+            // a rejected range list gets a single NACK, and the writes
+            // verify each row anyway, so carry on to them
+            WatchForAckOrNack(() =>
+            {
+                if (IsNack(lastReply) && lastReply != NACK_ERASE_FAILED)
+                {
+                    FlasherInterface.WriteLine(FlasherMessageType.Warning, "Re-erase refused");
+                    refused = true;
+                    FinishBlankCheck();
+                }
+                return true; // remove on execute
+            });
+
+            SendRangeErase(ranges);
+        }
+
+        private void FinishBlankCheck()
+        {
+            if (state == FlasherState.AutoBlankPending)
+                state = FlasherState.AutoWriteStart;
+        }
+
+        #endregion
+
+        /// <summary>
+        /// Report how long the erase took, and for a range erase,
+        /// about how much time it saved over erasing all of flash
+        /// </summary>
+        private void ReportEraseTime()
+        {
+            var ms = eraseTimer.ElapsedMilliseconds;
+            var totalPages = (picDetails.FlashSize + picDetails.BootSize)/picDetails.FlashPageSize;
+            if (eraseDeferred)
+            {
+                FlasherInterface.WriteLine(FlasherMessageType.Info, "Erase left to the writes, {0} ms", ms);
+                return;
+            }
+            if (eraseRanges == null)
+            {
+                FlasherInterface.WriteLine(FlasherMessageType.Info, "Erased {0} pages in {1} ms", totalPages, ms);
+                return;
+            }
+            var pages = eraseRanges.Sum(r => (long) r.Item2);
+            FlasherInterface.WriteLine(FlasherMessageType.Info,
+                "Erased {0} of {1} pages in {2} ms, about {3} ms saved over a full erase",
+                pages, totalPages, ms, ms*(totalPages - pages)/Math.Max(1, pages)
+                );
+        }
+
+        private static bool TryParseHex(string hexString, out uint val)
+        {
+            if (hexString.StartsWith("0x", StringComparison.CurrentCultureIgnoreCase))
+                hexString = hexString.Substring(2);
+            return UInt32.TryParse(hexString,
+                NumberStyles.HexNumber,
+                CultureInfo.CurrentCulture,
+                out val);
+        }
+        private uint[] LoadKey(string keyFilename)
+        {
+            if (!File.Exists(keyFilename))
+            {
+                FlasherInterface.WriteLine(FlasherMessageType.Error,"ERROR: key file {0} missing. No key used", keyFilename);
+                return null;
+            }
+            var text = File.ReadAllText(keyFilename);
+            text = text.Replace('\n', ' ');
+            text = text.Replace('\r', ' ');
+            text = text.Replace('\t', ' ');
+            var words = text.Split(new[] {' '}, StringSplitOptions.RemoveEmptyEntries);
+            if (words.Length != 8)
+            {
+                FlasherInterface.WriteLine(FlasherMessageType.Error,"ERROR: key file must have 8 entries");
+                return null;
+            }
+            // If encrypted, you need a 32 byte key, stored here as eight 32-bit values
             // These get written as the key, word 0 first (lowest address), each stored
             // little endian into a byte array
             // must match the key in the boot loader
@@ -874,6 +2475,9 @@ namespace Hypnocube.PICFlasher
                 return false;
             }
             FlasherInterface.WriteLine(FlasherMessageType.Info,"Loading image file {0}", imgFilename);
+            deltaBlocks = null;
+            imageHexFilename = null;
+            imageKey = null;
             image = Image.Read(imgFilename);
             return image != null;
         }
@@ -905,10 +2509,32 @@ namespace Hypnocube.PICFlasher
             ackNackActions.Add(action);
         }
 
+        // last ACK or NACK seen, for actions that need it
+        private byte lastReply;
+
+        // raw bytes requested by ReadBinary
+        private int binaryCount;
+        private readonly List<byte> binaryData = new List<byte>();
+        private Action<byte[]> binaryAction;
+
+        /// <summary>
+        /// Take the next count bytes as raw binary, not as text or 
+        /// ACK/NACK, and pass them to the action
+        /// </summary>
+        /// <param name="count"></param>
+        /// <param name="action"></param>
+        void ReadBinary(int count, Action<byte[]> action)
+        {
+            binaryCount = count;
+            binaryData.Clear();
+            binaryAction = action;
+        }
+
         private void ProcessActions(byte ch)
         {
             if (IsAck(ch) || IsNack(ch))
             {
+                lastReply = ch;
                 // ack or nack - check them
                 // line just added, check line actions
                 var toRemove = new List<Func<bool>>();
@@ -26,7 +26,6 @@ Code written by Chris Lomont, 2015
 using System;
 using System.Collections.Generic;
 using System.IO;
-using System.Runtime.Remoting.Messaging;
 using System.Text;
 
 namespace Hypnocube.PICFlasher
@@ -40,10 +39,18 @@ namespace Hypnocube.PICFlasher
         // 4 byte file header
         public static string Header = "HCFF";
         // file format
-        public static readonly uint Version = 0x00010001;
+        // 0x00010002 adds the page ranges after the blocks
+        // 0x00010003 adds the encrypted flag and page CRCs after those
+        public static readonly uint Version = 0x00010003;
+        // older formats still read, without page ranges or page CRCs
+        private static readonly uint VersionNoPages = 0x00010001;
+        private static readonly uint VersionNoPageCrcs = 0x00010002;
+
         public Image()
         {
             Blocks = new List<byte[]>();
+            PageRanges = new List<Tuple<uint, uint>>();
+            PageCrcs = new List<Tuple<uint, uint>>();
         }
 
         public PicDefs.PicDef PicDef { get; set; }
@@ -53,6 +60,45 @@ namespace Hypnocube.PICFlasher
         /// </summary>
         public List<byte[]> Blocks { get; private set; }
 
+        /// <summary>
+        /// Flash pages the blocks write to, as (physical page address, page count) 
+        /// ranges, used to erase only those pages. Empty if unknown, such as 
+        /// for older image files, in which case all of flash is erased.
+        /// </summary>
+        public List<Tuple<uint, uint>> PageRanges { get; private set; }
+
+        /// <summary>
+        /// True if the blocks are encrypted, so they must all be sent in order
+        /// </summary>
+        public bool Encrypted { get; set; }
+
+        /// <summary>
+        /// For each page the image writes, (physical page address, CRC32K of
+        /// the page after flashing), with unwritten bytes left erased as 0xFF.
+        /// Compared with the bootloader manifest to only send changed pages.
+        /// Empty if unknown.
+        /// </summary>
+        public List<Tuple<uint, uint>> PageCrcs { get; private set; }
+
+
+        /// <summary>
+        /// For an encrypted image, the ChaCha block counter each block payload
+        /// is encrypted from. The first block holds the unencrypted IV, and 
+        /// each payload after starts a fresh 64 byte keystream block, so the 
+        /// counters follow from the block lengths.
+        /// </summary>
+        public List<uint> KeystreamCounters()
+        {
+            var counters = new List<uint>();
+            var counter = 0U;
+            for (var i = 0; i < Blocks.Count; ++i)
+            {
+                counters.Add(counter);
+                if (i > 0) // 'W' and length not encrypted
+                    counter += (uint) (Blocks[i].Length - 3 + 63)/64;
+            }
+            return counters;
+        }
 
         public static Image Read(string filename)
         {
@@ -73,7 +119,7 @@ namespace Hypnocube.PICFlasher
                         return null;
                     }
                 var version = Read4(f);
-                if (version != Version)
+                if (version != Version && version != VersionNoPages && version != VersionNoPageCrcs)
                 {
                     FlasherInterface.WriteLine(FlasherMessageType.Error,"Image file is wrong version.");
                     return null;
@@ -86,6 +132,27 @@ namespace Hypnocube.PICFlasher
                 var blockCount = Read4(f);
                 for (var i = 0; i < blockCount; ++i)
                     image.Blocks.Add(ReadBytes(f));
+                if (version != VersionNoPages)
+                {
+                    var rangeCount = Read4(f);
+                    for (var i = 0; i < rangeCount; ++i)
+                    {
+                        var address = Read4(f);
+                        var pages = Read4(f);
+                        image.PageRanges.Add(new Tuple<uint, uint>(address, pages));
+                    }
+                }
+                if (version == Version)
+                {
+                    image.Encrypted = Read4(f) != 0;
+                    var crcCount = Read4(f);
+                    for (var i = 0; i < crcCount; ++i)
+                    {
+                        var address = Read4(f);
+                        var crc = Read4(f);
+                        image.PageCrcs.Add(new Tuple<uint, uint>(address, crc));
+                    }
+                }
             }
 
             return image;
@@ -126,6 +193,19 @@ namespace Hypnocube.PICFlasher
                 Write(f, (uint)Blocks.Count); // count
                 foreach (var block in Blocks)
                     Write(f, block);
+                Write(f, (uint)PageRanges.Count);
+                foreach (var range in PageRanges)
+                {
+                    Write(f, range.Item1);
+                    Write(f, range.Item2);
+                }
+                Write(f, Encrypted ? 1U : 0U);
+                Write(f, (uint)PageCrcs.Count);
+                foreach (var pageCrc in PageCrcs)
+                {
+                    Write(f, pageCrc.Item1);
+                    Write(f, pageCrc.Item2);
+                }
             }
         }
 
@@ -34,9 +34,15 @@ namespace Hypnocube.PICFlasher
     public sealed class LZ77Compressor
     {
 
+        /// <summary>
+        /// Set to write each literal and pair as they are made or read
+        /// </summary>
+        public static bool ShowSteps { get; set; }
+
         static void Write(string format, params object[] args)
         {
-            FlasherInterface.Write(FlasherMessageType.Compression,format,args);
+            if (ShowSteps)
+                FlasherInterface.Write(FlasherMessageType.Compression,format,args);
         }
 
         /// <summary>
@@ -243,5 +249,57 @@ namespace Hypnocube.PICFlasher
             return output;
         }
 
+        /// <summary>
+        /// True if the compressed data expands in place in a buffer of size
+        /// bytes, as the bootloader expands it: the data is moved to the end
+        /// of the buffer, and the output grows from the start, never over
+        /// compressed bytes not yet read.
+        /// </summary>
+        /// <param name="compressedData"></param>
+        /// <param name="size"></param>
+        /// <returns></returns>
+        public static bool FitsInPlace(List<byte> compressedData, int size)
+        {
+            var dataLength = compressedData.Count;
+            if (dataLength < 2 || size < dataLength)
+                return false;
+
+            var bitsForPair = (compressedData[0] > 15) ? 16 : 8;
+            var lengthMask = (1 << (compressedData[0] & 15)) - 1;
+            var lengthMin = bitsForPair == 8 ? 2 : 3;
+            var start = size - dataLength; // where the data is moved to
+
+            var lastSelectionBit = 8;
+            var lastSelectionByte = 0;
+            var srcIndex = 1;
+            var outputLength = 0;
+            while (srcIndex < dataLength)
+            {
+                if (lastSelectionBit == 8)
+                {
+                    lastSelectionByte = compressedData[srcIndex++];
+                    lastSelectionBit = 0;
+                    continue;
+                }
+                var type = (lastSelectionByte >> lastSelectionBit) & 1;
+                lastSelectionBit++;
+
+                if (type != 0)
+                {   // copy, output stays behind the input
+                    ++srcIndex;
+                    ++outputLength;
+                    continue;
+                }
+
+                var control = (int) compressedData[srcIndex++];
+                if (bitsForPair == 16)
+                    control += compressedData[srcIndex++]*256;
+                outputLength += (control & lengthMask) + lengthMin;
+                if (outputLength > start + srcIndex)
+                    return false;
+            }
+            return true;
+        }
+
     }
 }
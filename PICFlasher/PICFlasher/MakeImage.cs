@@ -28,6 +28,8 @@ using System.Collections.Generic;
 using System.Diagnostics;
 using System.Linq;
 using System.Security.Cryptography;
+using System.Threading;
+using System.Threading.Tasks;
 
 namespace Hypnocube.PICFlasher
 {
@@ -48,10 +50,17 @@ namespace Hypnocube.PICFlasher
         /// <param name="memoryMaskAction">Action that trims memory that would 
         /// overwrite boot protected rom positions.</param>
         /// <param name="key"></param>
+        /// <param name="packetSize">Data bytes in each write packet, a 
+        /// multiple of the page size the bootloader takes, 0 for one page</param>
+        /// <param name="compress">LZ77 compress the packets that get smaller,
+        /// for a bootloader that lists compression</param>
+        /// <param name="bootLength">Bytes of program flash the bootloader
+        /// reserves. The page after them is written last</param>
         /// <returns></returns>
         public Image CreateFromFile(string filename, PicDefs.PicDef picDef,
             Func<List<byte>, ulong, ulong> memoryMaskAction,
-            uint[] key = null)
+            uint[] key = null, uint packetSize = 0, bool compress = false,
+            uint bootLength = 0)
         {
             const bool strictParsing = true;
             if (!LoadHexFile(filename, strictParsing))
@@ -74,13 +83,33 @@ namespace Hypnocube.PICFlasher
             // remove any that are now zero length
             flashBlocks = flashBlocks.Where(b => b.Data.Count > 0).ToList();
 
+            // program whole rows, instead of a word at a time at block ends
+            var payloadLength = packetSize != 0 ? packetSize : picDef.FlashPageSize;
+            int rowWrites, wordWrites;
+            CountWrites(picDef, flashBlocks, payloadLength, out rowWrites, out wordWrites);
+            flashBlocks = AlignToRows(picDef, flashBlocks);
+            int alignedRowWrites, alignedWordWrites;
+            CountWrites(picDef, flashBlocks, payloadLength, out alignedRowWrites, out alignedWordWrites);
+            FlasherInterface.WriteLine(FlasherMessageType.Info, "Row aligned to {0} blocks, {1} row and {2} word writes instead of {3} and {4}",
+                flashBlocks.Count, alignedRowWrites, alignedWordWrites, rowWrites, wordWrites);
+
             // if going to be encrypted, may as well
             // permute block order
             if (key != null)
                 PermuteBlocks(picDef,flashBlocks);
 
             // convert the flash blocks into an image file
-            var image = PackImage(picDef, flashBlocks);
+            var image = PackImage(picDef, flashBlocks, payloadLength, bootLength);
+
+            // pages to erase, sorted so the permuted order is not revealed
+            image.PageRanges.AddRange(FindPageRanges(picDef, flashBlocks));
+            image.PageCrcs.AddRange(FindPageCrcs(picDef, flashBlocks));
+            image.Encrypted = key != null;
+
+            // compress before encrypting, which leaves nothing to compress.
+            // The bootloader buffer holds a whole payload
+            if (compress)
+                CompressImage(image, (int) payloadLength + 10);
 
             // if encrypted, do so now 
             if (key != null)
@@ -136,8 +165,10 @@ namespace Hypnocube.PICFlasher
         /// </summary>
         /// <param name="picDef"></param>
         /// <param name="flashBlocks"></param>
+        /// <param name="packetSize"></param>
+        /// <param name="bootLength"></param>
         /// <returns></returns>
-        private Image PackImage(PicDefs.PicDef picDef, IEnumerable<FlashBlock> flashBlocks)
+        private Image PackImage(PicDefs.PicDef picDef, IEnumerable<FlashBlock> flashBlocks, uint packetSize, uint bootLength)
         {
 
             var image = new Image{PicDef = picDef};
@@ -146,7 +177,14 @@ namespace Hypnocube.PICFlasher
             // has possible massive expansion downside 
             // if someone writes many small sections instead 
             // of contiguous blocks
-            var payloadLength = picDef.FlashPageSize;
+            var payloadLength = packetSize;
+
+            // a fast booting bootloader takes a blank first application page,
+            // the one right after the bootloader, to mean no application, so
+            // that page is written last. An interrupted flash then leaves the
+            // bootloader listening
+            var firstPage = (ulong) picDef.FlashStart + bootLength;
+            var lastBlocks = new List<byte[]>();
 
             using (var cryptoRng = new RNGCryptoServiceProvider())
             {
@@ -155,14 +193,181 @@ namespace Hypnocube.PICFlasher
                     var address = flashBlock.Address;
                     while (address < flashBlock.Address + (ulong) flashBlock.Data.Count)
                     {
-                        image.Blocks.Add(CreateBlock(cryptoRng, picDef, ref address, flashBlock, payloadLength));
+                        var blockPage = address & ~((ulong) picDef.FlashPageSize - 1);
+                        var block = CreateBlock(cryptoRng, picDef, ref address, flashBlock, payloadLength);
+                        if (blockPage == firstPage)
+                            lastBlocks.Add(block);
+                        else
+                            image.Blocks.Add(block);
                     }
                 }
             }
+            image.Blocks.AddRange(lastBlocks);
+            if (!lastBlocks.Any())
+                FlasherInterface.WriteLine(FlasherMessageType.Warning,
+                    "Image does not write page 0x{0:X8}, a fast booting bootloader will always wait for the flasher", firstPage);
 
             return image;
         }
 
+        /// <summary>
+        /// Merge blocks that share a flash row, and pad them out to whole rows
+        /// with 0xFF, the erased value, so the bootloader programs only whole
+        /// rows. A row partly written is otherwise programmed a word at a time,
+        /// each word its own NVM unlock and program. Blocks reaching into the
+        /// configuration words are not padded, since the bootloader will not
+        /// write them
+        /// </summary>
+        /// <param name="picDef"></param>
+        /// <param name="flashBlocks"></param>
+        /// <returns></returns>
+        private static List<FlashBlock> AlignToRows(PicDefs.PicDef picDef, IEnumerable<FlashBlock> flashBlocks)
+        {
+            var rowMask = ~(ulong)(picDef.FlashRowSize - 1);
+            var configStart = (ulong) picDef.ConfigurationStart;
+            var configEnd = configStart + picDef.ConfigurationSize;
+
+            // padded start and end of each block, in address order
+            var spans = flashBlocks
+                .Select(b =>
+                {
+                    var start = b.Address & rowMask;
+                    var end = (b.Address + (ulong) b.Data.Count + picDef.FlashRowSize - 1) & rowMask;
+                    if (start < configEnd && configStart < end)
+                    {
+                        start = b.Address;
+                        end = b.Address + (ulong) b.Data.Count;
+                    }
+                    return new {Block = b, Start = start, End = end};
+                })
+                .OrderBy(s => s.Start)
+                .ToList();
+
+            var merged = new List<FlashBlock>();
+            var i = 0;
+            while (i < spans.Count)
+            {
+                // blocks touching or overlapping the padded span join it
+                var start = spans[i].Start;
+                var end = spans[i].End;
+                var j = i + 1;
+                while (j < spans.Count && spans[j].Start <= end)
+                {
+                    end = Math.Max(end, spans[j].End);
+                    ++j;
+                }
+
+                var block = new FlashBlock {Address = start};
+                block.Data.AddRange(Enumerable.Repeat((byte) 0xFF, (int) (end - start)));
+                for (var k = i; k < j; ++k)
+                {
+                    var source = spans[k].Block;
+                    for (var n = 0; n < source.Data.Count; ++n)
+                        block.Data[(int) (source.Address - start) + n] = source.Data[n];
+                }
+                merged.Add(block);
+                i = j;
+            }
+            return merged;
+        }
+
+        /// <summary>
+        /// Count the row and word programming operations the bootloader makes
+        /// for the blocks, split into packets as PackImage does
+        /// </summary>
+        /// <param name="picDef"></param>
+        /// <param name="flashBlocks"></param>
+        /// <param name="payloadLength"></param>
+        /// <param name="rows"></param>
+        /// <param name="words"></param>
+        private static void CountWrites(PicDefs.PicDef picDef, IEnumerable<FlashBlock> flashBlocks, uint payloadLength, out int rows, out int words)
+        {
+            rows = words = 0;
+            foreach (var flashBlock in flashBlocks)
+            {
+                var address = flashBlock.Address;
+                var maxAddress = flashBlock.Address + (ulong) flashBlock.Data.Count;
+                while (address < maxAddress)
+                {
+                    var end = address + BlockLength(picDef, address, maxAddress - address, payloadLength);
+
+                    // as BootWriteFlash, a row when aligned with a whole row left
+                    while (address < end)
+                    {
+                        if ((address & (picDef.FlashRowSize - 1)) == 0 && address + picDef.FlashRowSize <= end)
+                        {
+                            ++rows;
+                            address += picDef.FlashRowSize;
+                        }
+                        else
+                        {
+                            ++words;
+                            address += 4;
+                        }
+                    }
+                    address = end;
+                }
+            }
+        }
+
+        /// <summary>
+        /// Find the flash pages written by the blocks, merged into sorted
+        /// (page address, page count) ranges
+        /// </summary>
+        /// <param name="picDef"></param>
+        /// <param name="flashBlocks"></param>
+        /// <returns></returns>
+        private static List<Tuple<uint, uint>> FindPageRanges(PicDefs.PicDef picDef, IEnumerable<FlashBlock> flashBlocks)
+        {
+            var pageMask = ~(ulong)(picDef.FlashPageSize - 1);
+            var pages = new SortedSet<ulong>();
+            foreach (var flashBlock in flashBlocks)
+            {
+                var last = (flashBlock.Address + (ulong)flashBlock.Data.Count - 1) & pageMask;
+                for (var page = flashBlock.Address & pageMask; page <= last; page += picDef.FlashPageSize)
+                    pages.Add(page);
+            }
+
+            var ranges = new List<Tuple<uint, uint>>();
+            foreach (var page in pages)
+            {
+                var n = ranges.Count - 1;
+                if (n >= 0 && ranges[n].Item1 + ranges[n].Item2 * picDef.FlashPageSize == page && ranges[n].Item2 < 65535)
+                    ranges[n] = new Tuple<uint, uint>(ranges[n].Item1, ranges[n].Item2 + 1);
+                else
+                    ranges.Add(new Tuple<uint, uint>((uint)page, 1));
+            }
+            return ranges;
+        }
+
+        /// <summary>
+        /// Compute the CRC32K each written page will have after flashing,
+        /// with bytes not in any block left erased as 0xFF, sorted by address
+        /// </summary>
+        /// <param name="picDef"></param>
+        /// <param name="flashBlocks"></param>
+        /// <returns></returns>
+        private static List<Tuple<uint, uint>> FindPageCrcs(PicDefs.PicDef picDef, IEnumerable<FlashBlock> flashBlocks)
+        {
+            var pageMask = ~(ulong)(picDef.FlashPageSize - 1);
+            var pages = new SortedDictionary<ulong, byte[]>();
+            foreach (var flashBlock in flashBlocks)
+            {
+                for (var i = 0; i < flashBlock.Data.Count; ++i)
+                {
+                    var address = flashBlock.Address + (ulong) i;
+                    byte[] page;
+                    if (!pages.TryGetValue(address & pageMask, out page))
+                    {
+                        page = Enumerable.Repeat((byte) 0xFF, (int) picDef.FlashPageSize).ToArray();
+                        pages.Add(address & pageMask, page);
+                    }
+                    page[address & ~pageMask] = flashBlock.Data[i];
+                }
+            }
+            return pages.Select(p => new Tuple<uint, uint>((uint) p.Key, CRC32K.Compute(p.Value))).ToList();
+        }
+
         /// <summary>
         /// Consume bytes starting at address
         /// Tries to leave next aligned on page (best) or row (next best)
@@ -183,28 +388,7 @@ namespace Hypnocube.PICFlasher
             uint payloadLength)
         {
             var maxAddress = (ulong)flashBlock.Data.Count + flashBlock.Address;
-            var left = maxAddress - address;
-            var pageExcess = (address & (picDef.FlashPageSize - 1));
-            var rowExcess = (address & (picDef.FlashRowSize- 1));
-
-            var length = 0U; // length of data to write
-            if (pageExcess == 0)
-            {
-                length = picDef.FlashPageSize;
-            }
-            else if (rowExcess == 0)
-            { 
-                // eat enough rows to get to next page
-                length = (uint)(picDef.FlashPageSize - pageExcess);
-            }
-            else
-            {
-                // eat enough to get to next row
-                length = (uint)(picDef.FlashRowSize - rowExcess);
-            }
-
-            // do not overflow
-            length = (uint)Math.Min(length, left);
+            var length = BlockLength(picDef, address, maxAddress - address, payloadLength);
 
             Trace.Assert(length <= payloadLength);
 
@@ -227,6 +411,41 @@ namespace Hypnocube.PICFlasher
         }
 
 
+        /// <summary>
+        /// Length of data for the packet starting at address, with left bytes
+        /// of the flash block remaining
+        /// </summary>
+        /// <param name="picDef"></param>
+        /// <param name="address"></param>
+        /// <param name="left"></param>
+        /// <param name="payloadLength"></param>
+        /// <returns></returns>
+        private static uint BlockLength(PicDefs.PicDef picDef, ulong address, ulong left, uint payloadLength)
+        {
+            var pageExcess = (address & (picDef.FlashPageSize - 1));
+            var rowExcess = (address & (picDef.FlashRowSize- 1));
+
+            var length = 0U; // length of data to write
+            if (pageExcess == 0)
+            {
+                // as many whole pages as fit
+                length = payloadLength;
+            }
+            else if (rowExcess == 0)
+            { 
+                // eat enough rows to get to next page
+                length = (uint)(picDef.FlashPageSize - pageExcess);
+            }
+            else
+            {
+                // eat enough to get to next row
+                length = (uint)(picDef.FlashRowSize - rowExcess);
+            }
+
+            // do not overflow
+            return (uint)Math.Min(length, left);
+        }
+
         /// <summary>
         /// Make a block for the image that stores the crypto
         /// needs to send the bootloader.
@@ -425,22 +644,28 @@ namespace Hypnocube.PICFlasher
         void EncryptImage(Image image, uint[]userKey)
         {
             var initializationVector = ChaCha.CreateIVOrKey(8);
-            var encryptor = new ChaCha();
 
             // expand the key into a byte array 
             var key = new byte[32];
             for (var i = 0U ; i < 8; ++i)
                 WriteBigEndian(key, i*4, userKey[i], 4);
 
-            encryptor.SetKeyAndInitializationVector(key, initializationVector);
             const int numberOfRounds = 20;
 
             // create a crypto block, must be first in image
             var cryptoBlock = MakeCryptoBlock(initializationVector);
+            image.Blocks.Insert(0,cryptoBlock);
 
-            // encrypt each block
-            foreach (var block in image.Blocks)
+            // each block starts at a known keystream position, so they are
+            // encrypted in parallel, giving the same bytes as one stream
+            var counters = image.KeystreamCounters();
+            Parallel.For(1, image.Blocks.Count, i =>
             {   // do not encrypt header
+                var block = image.Blocks[i];
+                var encryptor = new ChaCha();
+                encryptor.SetKeyAndInitializationVector(key, initializationVector);
+                encryptor.SetBlockCounter(counters[i]);
+
                 var cipherBytes = new byte[block.Length-3];
                 var messageBytes = new byte[cipherBytes.Length];
                 Array.Copy(block,3,messageBytes,0,messageBytes.Length);
@@ -448,11 +673,7 @@ namespace Hypnocube.PICFlasher
                 encryptor.Encrypt(messageBytes, cipherBytes, numberOfRounds);
 
                 Array.Copy(cipherBytes,0,block,3,cipherBytes.Length);
-            }
-
-
-            // insert first into the image
-            image.Blocks.Insert(0,cryptoBlock);
+            });
         }
 
         private void PermuteBlocks(PicDefs.PicDef picDef, List<FlashBlock> list)
@@ -555,9 +776,51 @@ namespace Hypnocube.PICFlasher
         private int rndCount = 0;
         private int rndPass = 0;
 
+        /// <summary>
+        /// Compress the data of each block that gets smaller and that the 
+        /// bootloader can expand in place in a buffer of bufferSize bytes. The
+        /// top bit of the packet length marks a compressed block, whose CRC is
+        /// over the compressed payload. The random padding after short data
+        /// is dropped, there being no size left to hide.
+        /// </summary>
+        private void CompressImage(Image image, int bufferSize)
+        {
+            var before = image.Blocks.Sum(b => b.Length);
+            var compressedBlocks = 0;
+            Parallel.For(0, image.Blocks.Count, i =>
+            {
+                var block = image.Blocks[i];
+                // data, then address and length L, then CRC
+                var length = (block[block.Length - 6] << 8) | block[block.Length - 5];
+                var compressed = Compress(block.Skip(3).Take(length).ToList());
+                if (compressed == null)
+                    return;
+                var payloadLength = compressed.Count + 4 + 2 + 4;
+                if (payloadLength >= block.Length - 3 || payloadLength >= 0x8000 ||
+                    !LZ77Compressor.FitsInPlace(compressed, bufferSize))
+                    return;
+
+                var packed = new byte[payloadLength + 3];
+                packed[0] = (byte) 'W';
+                WriteBigEndian(packed, 1, (uint) payloadLength | 0x8000, 2);
+                compressed.CopyTo(packed, 3);
+                Array.Copy(block, block.Length - 10, packed, packed.Length - 10, 6);
+                var crc32 = CRC32K.Compute(packed, 3, packed.Length - 3 - 4);
+                WriteBigEndian(packed, (uint) (packed.Length - 4), crc32, 4);
+
+                image.Blocks[i] = packed;
+                Interlocked.Increment(ref compressedBlocks);
+            });
+            FlasherInterface.WriteLine(FlasherMessageType.Info, "Compressed {0} of {1} blocks, {2} bytes instead of {3}",
+                compressedBlocks, image.Blocks.Count, image.Blocks.Sum(b => b.Length), before);
+        }
+
+        /// <summary>
+        /// Smallest compression over all the settings, checked to decompress,
+        /// or null if none does
+        /// </summary>
         private List<byte> Compress(List<byte> payload)
         {
-            var minLength = Int32.MaxValue;
             List<byte> bestData = null;
             // test all compression settings
             for (var bitsForPair = 8; bitsForPair <= 16; bitsForPair += 8)
@@ -565,26 +828,15 @@ namespace Hypnocube.PICFlasher
                 for (var bitsForlength = 1; bitsForlength <= bitsForPair - 1; ++bitsForlength)
                 {
                     var temp = LZ77Compressor.Compress(payload, bitsForPair, bitsForlength);
-                    if (temp.Count < minLength)
-                    {
-                        minLength = temp.Count;
-                        bestData = temp;
-                    }
+                    if (bestData != null && temp.Count >= bestData.Count)
+                        continue;
 
                     // check decompressor works
                     var decompressed = LZ77Compressor.Decompress(temp);
-                    var match = decompressed.Count == payload.Count;
-                    for (var i = 0; i < decompressed.Count && match; i++)
-                        match &= decompressed[i] == payload[i];
-
-                    FlasherInterface.WriteLine("{0},{1} -> {3} = {2:F1} (Match: {4})",
-                        bitsForPair, bitsForlength,
-                        100.0 * temp.Count / payload.Count,
-                        temp.Count,
-                        match
-                        );
-
-
+                    if (decompressed != null && decompressed.SequenceEqual(payload))
+                        bestData = temp;
+                    else
+                        FlasherInterface.WriteLine(FlasherMessageType.Error, "Compression {0},{1} does not decompress", bitsForPair, bitsForlength);
                 }
             }
 
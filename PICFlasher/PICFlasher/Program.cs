@@ -44,6 +44,11 @@ namespace Hypnocube.PICFlasher
             FlasherInterface.WriteLine("Usage: {0}{1} picType baud files{2}", tok1,AppDomain.CurrentDomain.FriendlyName,tok2);
             FlasherInterface.WriteLine("   '{0}picType{1}' is a pic32 type, labeled such as PIC32MX150F128B, and must appear.",tok1,tok2);
             FlasherInterface.WriteLine("   '{0}baud{1}' is the baudrate and must match the bootloader, and must appear.",tok1,tok2);
+            FlasherInterface.WriteLine("       Bootloaders built with USE_AUTOBAUD match rates from 9600 up to their own.");
+            FlasherInterface.WriteLine("       Use baud:fast, such as 1000000:3000000, to switch to a faster rate");
+            FlasherInterface.WriteLine("       after connecting, if the bootloader supports it.");
+            FlasherInterface.WriteLine("       The flasher holds a break between sync bytes, which bootloaders built");
+            FlasherInterface.WriteLine("       with USE_FAST_BOOT need to see at power on, so power the device after starting.");
             FlasherInterface.WriteLine("   '{0}files{1}' is a list of filenames to use.", tok1, tok2);
             FlasherInterface.WriteLine("   At most one file each of .hex, .key, and .img can occur.");
             FlasherInterface.WriteLine("   A .hex file is an Intel hex file containing an unencrypted flash image.");
@@ -104,7 +109,11 @@ namespace Hypnocube.PICFlasher
             var picName = args[0]; // will be checked in the flasher
 
             var baudRate = -1; // must match bootloader
-            if (!Int32.TryParse(args[1], out baudRate) || baudRate <= 0)
+            var fastBaudRate = 0; // optional, switched to after connecting
+            var rates = args[1].Split(':');
+            if (!Int32.TryParse(rates[0], out baudRate) || baudRate <= 0 ||
+                rates.Length > 2 ||
+                (rates.Length == 2 && (!Int32.TryParse(rates[1], out fastBaudRate) || fastBaudRate <= 0)))
             {
                 FlasherInterface.WriteLine("Invalid or undefined baud rate. Exiting...");
                 return -3;
@@ -132,7 +141,7 @@ namespace Hypnocube.PICFlasher
 
             // create and run the pic flasher
             var picFlasher = new Flasher();
-            var success = picFlasher.Run(baudRate, picName, hexFilename, imgFilename, keyFilename);
+            var success = picFlasher.Run(baudRate, fastBaudRate, picName, hexFilename, imgFilename, keyFilename);
             
             return success?1:0; // map to value to return to environment
         }
@@ -118,6 +118,9 @@ namespace Hypnocube.PICFlasher
             var success = serialPort != null && serialPort.IsOpen;
             if (success)
             {
+                // bootloader restarts at the initial rate
+                currentBaudRate = rate;
+
                 // clear internals
                 serialErrorCount = 0;
                 serialData = new ConcurrentQueue<byte[]>();
@@ -155,6 +158,43 @@ namespace Hypnocube.PICFlasher
 
         private readonly int baudRate;
 
+        // rate the open port runs at, starts at baudRate on each port open
+        private int currentBaudRate;
+
+        /// <summary>
+        /// Baud rate the port currently runs at
+        /// </summary>
+        public int BaudRate
+        {
+            get { return currentBaudRate; }
+        }
+
+        /// <summary>
+        /// Change the rate of the open port, used after the bootloader
+        /// agrees to a new rate. Pending received data is dropped, since
+        /// it may be garbled by the switch.
+        /// </summary>
+        /// <param name="rate"></param>
+        public void SetBaudRate(int rate)
+        {
+            currentBaudRate = rate;
+            if (serialPort != null && serialPort.IsOpen)
+            {
+                serialPort.BaudRate = rate;
+                serialPort.DiscardInBuffer();
+            }
+        }
+
+        /// <summary>
+        /// Hold the transmit line low, or release it
+        /// </summary>
+        /// <param name="on"></param>
+        public void SetBreak(bool on)
+        {
+            if (serialPort != null && serialPort.IsOpen)
+                serialPort.BreakState = on;
+        }
+
         private readonly List<string> portNames;
         private readonly List<string> addedNames;
         private readonly List<string> removedNames;
@@ -163,6 +203,7 @@ namespace Hypnocube.PICFlasher
         public SerialManager(int baudRate)
         {
             this.baudRate = baudRate;
+            currentBaudRate = baudRate;
             portNames = SerialPort.GetPortNames().ToList();
             addedNames = new List<string>();
             removedNames = new List<string>();